@@ -53,10 +53,11 @@ end
 
 local synthcode = template [[
 	local system = ...
-	local voice = assert(system.voices[$id], "voice does not exist")
+	local voice = system.voice($id)
+	local param = system.param
 	$locals
 	$objects
-	voice.perform = function(self, out, frames)	
+	voice.perform = function(P, id, out, frames)	
 		local lbuf, rbuf = unpack(out)
 		$pre
 		for i = 0, frames-1 do
@@ -152,9 +153,9 @@ kernel_mt.__index = kernel_mt
 function kernel_mt:member(name, init)
 	local id = #self.objects + 1
 	self.objects[name] = id
-	self.objects:write("voice.data[%d] = %s", id, init)
-	self.pre:write("local %s = self[%d]", name, id)
-	self.post:write("self[%d] = %s", id, name)
+	self.objects:write("param[%d][voice.id] = %s", id, init)
+	self.pre:write("local %s = P[%d][id]", name, id)
+	self.post:write("P[%d][id] = %s", id, name)
 	return name
 end
 
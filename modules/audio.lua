@@ -12,135 +12,390 @@ local audio = {
 	driver = driver,
 }
 
-local msgbuffer = driver.msgbuffer
-
--- hack for testing buffer wrapping/overflow handling:
-msgbuffer.size = 1024 * 128
-
-local function write_header(cmd, size)
-	local required = size + 1 -- plus one char for the cmd flag
-	local r, w = msgbuffer.read, msgbuffer.write	
-	-- first make sure there is enough space:
-	if w < r then
-		local available = r - w
-		if required >= available then
-			print(w, r, required)
-			error("audio message buffer overflow")
-		end
-	else
-		local size = msgbuffer.size
-		local available = size - w - 1
-		if required > available then
-			-- can't write because we'd hit the loop boundary
-			-- but maybe we can skip to the end of the buffer 
-			-- and write from the start?
-			if required < r then	
-				-- insert a skip marker:
-				msgbuffer.data[w] = C.AV_AUDIO_CMD_SKIP
-				--print("\twrote skip to", w)
-				-- move writer to buffer start:
-				w = 0
-			else
-				print(w, r, len)
-				error("audio message buffer overflow")
-			end
-		end
-	end
-	-- now go ahead and write the command flag:
-	msgbuffer.data[w] = cmd
-	return w + 1
-end
+local msgqueue = driver.msgqueue
+
+-- how long the main thread will wait for the audio thread to drain a full queue:
+local overflow_timeout = 0.5
 
+-- Messages are applied sample-accurately on the audio clock (driver.time).
+-- By default they are scheduled driver.lag seconds ahead of the audio clock,
+-- which must be long enough to cover main-thread jitter; 
+-- every sending function also accepts an explicit time t on the audio clock.
 
+--- The current time of the audio clock, in seconds
+function audio.now()
+	return driver.time
+end
 
+-- reserve space for a message body of the given size:
+local function reserve(cmd, size, t)
+	t = t or (driver.time + driver.lag)
+	local body = C.av_msgqueue_reserve(msgqueue, cmd, size, t)
+	if body == nil then
+		-- publish anything pending, and give the audio thread a chance to catch up:
+		C.av_msgqueue_commit(msgqueue)
+		local t0 = C.av_time()
+		repeat
+			C.av_sleep(0.001)
+			body = C.av_msgqueue_reserve(msgqueue, cmd, size, t)
+		until body ~= nil or C.av_time() - t0 > overflow_timeout
+		if body == nil then
+			error("audio message queue overflow")
+		end
+	end
+	return body
+end
 
-function audio.clear()
-	idlast = 0
-	idpool = {}
+function audio.clear(t)
 	-- send to audio thread:
-	msgbuffer.write = write_header(C.AV_AUDIO_CMD_CLEAR, 0)
+	reserve(C.AV_AUDIO_CMD_CLEAR, 0, t)
+	C.av_msgqueue_commit(msgqueue)
+	-- all voice ids can now be reused:
+	C.av_audio_voice_freeall()
 end
 
-function audio.setparam(id, pid, value)
+function audio.setparam(id, pid, value, t)
 	--print("setparam", id, pid, value)
 	-- send to audio thread:
-	local len = ffi.sizeof("av_msg_param")
-	local w = write_header(C.AV_AUDIO_CMD_VOICE_PARAM, len)
-	-- write body:
-	local msg = ffi.cast("av_msg_param *", msgbuffer.data + w)
+	local msg = ffi.cast("av_msg_param *", reserve(C.AV_AUDIO_CMD_VOICE_PARAM, ffi.sizeof("av_msg_param"), t))
 	msg.id = id
 	msg.pid = pid
 	msg.value = value
 	-- mark as complete:
-	msgbuffer.write = w + len
-	--print("WRITE PARAM", w) dump()
+	C.av_msgqueue_commit(msgqueue)
 end
 
+local ramp_size = ffi.sizeof("av_param_ramp")
+local params_size = ffi.sizeof("av_msg_params")
 
-function audio.setcode(str)
-	-- send to audio thread:
-	local len = #str+1	-- plus one for null terminator
-	local w = write_header(C.AV_AUDIO_CMD_VOICE_CODE, len)
-	-- write body:
-	ffi.copy(msgbuffer.data + w, str, len)
-	-- mark as complete:
-	msgbuffer.write = w + len
-	--print("WRITE", str, buffer.write) dump()
+local function rampshape(shape)
+	return shape == "exp" and C.AV_AUDIO_RAMP_EXP or C.AV_AUDIO_RAMP_LINEAR
+end
+
+--- Move a parameter smoothly to a new value, natively on the audio thread
+-- Native kernels interpolate it per sample, so there is no zipper noise.
+-- @param time the ramp duration in seconds (0 sets it at once)
+-- @param shape "linear" (default) or "exp" (one-pole approach)
+-- @param t optional time on the audio clock
+function audio.rampparam(id, pid, value, time, shape, t)
+	local msg = ffi.cast("av_msg_params *", reserve(C.AV_AUDIO_CMD_PARAMS, params_size + ramp_size, t))
+	msg.count = 1
+	local r = ffi.cast("av_param_ramp *", msg + 1)
+	r.id, r.pid, r.value, r.time, r.shape = id, pid, value, time or 0, rampshape(shape)
+	C.av_msgqueue_commit(msgqueue)
+end
+
+local batch = {}
+batch.__index = batch
+
+--- Create a batch of parameter changes, sent together as one message
+-- e.g. to drive thousands of parameters per frame from visuals:
+--   local b = audio.params()
+--   for id, v in pairs(voices) do b:set(id, 1, v.amp, 1/60) end
+--   b:send()
+-- @param capacity changes held before they are sent automatically (default AV_AUDIO_PARAMS_MAX)
+function audio.params(capacity)
+	capacity = capacity or C.AV_AUDIO_PARAMS_MAX
+	return setmetatable({
+		ramps = ffi.new("av_param_ramp[?]", capacity),
+		count = 0,
+		capacity = capacity,
+	}, batch)
+end
+
+--- Add a change to the batch (see audio.rampparam)
+function batch:set(id, pid, value, time, shape)
+	if self.count >= self.capacity then self:send() end
+	local r = self.ramps[self.count]
+	r.id, r.pid, r.value, r.time, r.shape = id, pid, value, time or 0, rampshape(shape)
+	self.count = self.count + 1
+end
+
+--- Send the changes in the batch (applied at time t, or now), and empty it
+function batch:send(t)
+	local sent = 0
+	while sent < self.count do
+		local n = math.min(self.count - sent, C.AV_AUDIO_PARAMS_MAX)
+		local msg = ffi.cast("av_msg_params *", reserve(C.AV_AUDIO_CMD_PARAMS, params_size + n * ramp_size, t))
+		msg.count = n
+		ffi.copy(msg + 1, self.ramps + sent, n * ramp_size)
+		sent = sent + n
+	end
+	C.av_msgqueue_commit(msgqueue)
+	self.count = 0
+end
+
+
+-- built-in native kernels:
+audio.kernels = {
+	sine = C.AV_AUDIO_KERNEL_SINE,
+	stream = C.AV_AUDIO_KERNEL_STREAM,
+}
+
+--- Attach a native kernel to a voice (0 to detach)
+-- Native kernels are rendered in parallel on the audio worker threads.
+-- @param id the voice id
+-- @param kernel an index from audio.kernels or C.av_audio_kernel_register()
+-- @param t optional time on the audio clock
+function audio.setkernel(id, kernel, t)
+	local msg = ffi.cast("av_msg_kernel *", reserve(C.AV_AUDIO_CMD_VOICE_KERNEL, ffi.sizeof("av_msg_kernel"), t))
+	msg.id = id
+	msg.kernel = kernel
+	C.av_msgqueue_commit(msgqueue)
+end
+
+--- Set the number of worker threads rendering native kernels
+-- Briefly stops the stream if it is running.
+function audio.workers(n)
+	C.av_audio_setworkers(n)
+end
+
+--- Spatialise a voice at a world position (x right, y up, -z forward)
+-- Spatial voices are encoded to ambisonics and decoded to the speaker layout.
+function audio.setposition(id, x, y, z, t)
+	local msg = ffi.cast("av_msg_position *", reserve(C.AV_AUDIO_CMD_VOICE_POSITION, ffi.sizeof("av_msg_position"), t))
+	msg.id = id
+	msg.spatial = 1
+	msg.pos[0], msg.pos[1], msg.pos[2] = x, y, z
+	C.av_msgqueue_commit(msgqueue)
 end
 
-local idpool = {}
-local idlast = 0
+--- Stop spatialising a voice; it mixes directly to the outputs again
+function audio.setdirect(id, t)
+	local msg = ffi.cast("av_msg_position *", reserve(C.AV_AUDIO_CMD_VOICE_POSITION, ffi.sizeof("av_msg_position"), t))
+	msg.id = id
+	msg.spatial = 0
+	msg.pos[0], msg.pos[1], msg.pos[2] = 0, 0, 0
+	C.av_msgqueue_commit(msgqueue)
+end
 
-function audio.add(name)
-	local name
-	if #idpool > 0 then
-		name = table.remove(idpool)
+--- Set the listener pose that spatial voices are heard from
+-- @param pos a vec3 (or {x,y,z})
+-- @param quat a quat (or {x,y,z,w}), optional
+-- @param near distance within which sources stop getting louder (default 1)
+function audio.setlistener(pos, quat, near, t)
+	local msg = ffi.cast("av_msg_listener *", reserve(C.AV_AUDIO_CMD_LISTENER, ffi.sizeof("av_msg_listener"), t))
+	msg.pos[0], msg.pos[1], msg.pos[2] = pos.x or pos[1], pos.y or pos[2], pos.z or pos[3]
+	if quat then
+		msg.quat[0], msg.quat[1], msg.quat[2], msg.quat[3] = quat.x or quat[1], quat.y or quat[2], quat.z or quat[3], quat.w or quat[4]
 	else
-		idlast = idlast + 1
-		name = idlast
+		msg.quat[0], msg.quat[1], msg.quat[2], msg.quat[3] = 0, 0, 0, 1
+	end
+	msg.near = near or 1
+	C.av_msgqueue_commit(msgqueue)
+end
+
+--- Speaker layouts for audio.setspeakers(): lists of {azimuth, elevation} in degrees
+-- (azimuth counter-clockwise from the front, elevation up from the horizon)
+audio.layouts = {}
+
+--- n speakers evenly spaced on a ring, clockwise from the front-left
+function audio.layouts.ring(n, elevation, offset)
+	local layout = {}
+	offset = offset or 180 / n
+	for i = 0, n-1 do
+		layout[i+1] = { offset - 360 * i / n, elevation or 0 }
+	end
+	return layout
+end
+
+--- the 54-channel AlloSphere: rings of 12, 30 and 12 speakers.
+-- (nominal elevations; substitute measured positions where available)
+function audio.layouts.allosphere()
+	local layout = {}
+	for _, ring in ipairs{ audio.layouts.ring(12, 41), audio.layouts.ring(30, 0), audio.layouts.ring(12, -32.5) } do
+		for _, s in ipairs(ring) do layout[#layout+1] = s end
+	end
+	return layout
+end
+
+--- Decode spatial voices to a speaker layout; speaker i plays on output channel i
+-- @param layout a list of {azimuth, elevation} in degrees (see audio.layouts)
+-- @param order ambisonic order (1 to 3), default the highest that n speakers can support in 3D
+function audio.setspeakers(layout, order, t)
+	local n = #layout
+	if not order then
+		order = math.min(3, math.max(1, math.floor(math.sqrt(n)) - 1))
+	end
+	local azimuth = ffi.new("double[?]", n)
+	local elevation = ffi.new("double[?]", n)
+	for i, s in ipairs(layout) do
+		azimuth[i-1] = s[1]
+		elevation[i-1] = s[2] or 0
+	end
+	local msg = ffi.cast("av_msg_decoder *", reserve(C.AV_AUDIO_CMD_DECODER, ffi.sizeof("av_msg_decoder"), t))
+	if C.av_ambi_decoder_design(msg, order, n, azimuth, elevation) == 0 then
+		-- still publish a valid (ignored) message:
+		msg.order = 0
+		C.av_msgqueue_commit(msgqueue)
+		error("unsupported speaker layout")
+	end
+	C.av_msgqueue_commit(msgqueue)
+end
+
+--- Open a WAV or AIFF file for streaming from disk
+-- Play it with one voice: audio.setkernel(id, audio.kernels.stream) 
+-- and audio.setparam(id, 0, stream). Param 1 is the amplitude, param 2 pans mono files.
+-- @param path the sound file
+-- @param loop whether to loop at the end of the file
+-- @return the stream id
+function audio.openstream(path, loop)
+	local stream = C.av_audio_stream_open(path, loop and 1 or 0)
+	if stream == 0 then
+		error("unable to stream "..tostring(path))
+	end
+	return stream
+end
+
+--- Close a stream once no voice is playing it
+function audio.closestream(stream, t)
+	local msg = ffi.cast("int *", reserve(C.AV_AUDIO_CMD_STREAM_CLOSE, ffi.sizeof("int"), t))
+	msg[0] = stream
+	C.av_msgqueue_commit(msgqueue)
+end
+
+local streaminfo = ffi.new("av_AudioStreamInfo")
+
+--- Playback state of a stream
+-- @return a table of channels, samplerate, frames, played, underruns and finished, or nil if not open
+function audio.streaminfo(stream)
+	if C.av_audio_stream_info(stream, streaminfo) == 0 then return end
+	return {
+		channels = streaminfo.channels,
+		samplerate = streaminfo.samplerate,
+		frames = streaminfo.frames,
+		played = streaminfo.played,
+		underruns = streaminfo.underruns,
+		finished = streaminfo.finished ~= 0,
+	}
+end
+
+--- Convolve the output with an impulse response from a WAV or AIFF file
+-- Output channel c uses file channel c % (file channels). Long responses are fine:
+-- only their first partitions are convolved on the audio thread.
+-- @param path the impulse response file, or nil to remove the reverb
+-- @param wet level of the reverb (default 0.5)
+-- @param dry level of the direct signal (default 1)
+function audio.reverb(path, wet, dry, t)
+	local data
+	if path then
+		data = C.av_audio_sound_load(path, streaminfo)
+		if data == nil then error("could not load impulse response "..path) end
 	end
+	local msg = ffi.cast("av_msg_reverb *", reserve(C.AV_AUDIO_CMD_REVERB, ffi.sizeof("av_msg_reverb"), t))
+	msg.dry = dry or 1
+	msg.wet = wet or 0.5
+	msg.channels = 0
+	if data then
+		C.av_audio_reverb_design(msg, data, streaminfo.frames, streaminfo.channels, driver.outchannels)
+		C.av_audio_sound_free(data)
+	end
+	-- still publish a valid (levels only) message if the design failed:
+	C.av_msgqueue_commit(msgqueue)
+	if msg.channels < 0 then error("unsupported impulse response "..path) end
+end
+
+--- Change the reverb levels (ramped over one block)
+function audio.reverbmix(wet, dry, t)
+	local msg = ffi.cast("av_msg_reverb *", reserve(C.AV_AUDIO_CMD_REVERB, ffi.sizeof("av_msg_reverb"), t))
+	msg.channels = -1
+	msg.dry = dry or 1
+	msg.wet = wet
+	C.av_msgqueue_commit(msgqueue)
+end
 
+--- Install voice code on the audio thread
+-- The code is compiled here, so syntax errors are raised on the main thread and the
+-- audio thread only has to load ready-made bytecode.
+-- @param str Lua source; it is called with the audio system table
+-- @param t optional time on the audio clock
+-- @param fade optional crossfade time (in seconds) from the voices' previous code
+function audio.setcode(str, t, fade)
+	local f, err = loadstring(str, "=voice")
+	if not f then error(err, 2) end
+	local bytecode = string.dump(f)
+	local header = ffi.sizeof("av_msg_bytecode")
 	-- send to audio thread:
-	local len = ffi.sizeof("int")
-	local w = write_header(C.AV_AUDIO_CMD_VOICE_ADD, len)
-	-- write body:
-	local msg = ffi.cast("int *", msgbuffer.data + w)
+	local body = reserve(C.AV_AUDIO_CMD_VOICE_BYTECODE, header + #bytecode, t)
+	local msg = ffi.cast("av_msg_bytecode *", body)
+	msg.size = #bytecode
+	msg.fade = fade or 0
+	ffi.copy(ffi.cast("char *", body) + header, bytecode, #bytecode)
+	-- mark as complete:
+	C.av_msgqueue_commit(msgqueue)
+end
+
+function audio.add(t)
+	local name = C.av_audio_voice_alloc()
+	if name == 0 then
+		error("too many audio voices")
+	end
+
+	-- send to audio thread:
+	local msg = ffi.cast("int *", reserve(C.AV_AUDIO_CMD_VOICE_ADD, ffi.sizeof("int"), t))
 	msg[0] = name
 	-- mark as complete:
-	msgbuffer.write = w + len
-	--print("WRITE", name, buffer.write) dump()
+	C.av_msgqueue_commit(msgqueue)
 	
 	return name
 end
 
-function audio.remove(name)
+function audio.remove(name, t)
 	-- send to audio thread:
-	local len = ffi.sizeof("int")
-	local w = write_header(C.AV_AUDIO_CMD_VOICE_REMOVE, len)
-	-- write body:
-	local msg = ffi.cast("int *", msgbuffer.data + w)
+	local msg = ffi.cast("int *", reserve(C.AV_AUDIO_CMD_VOICE_REMOVE, ffi.sizeof("int"), t))
 	msg[0] = name
 	-- mark as complete:
-	msgbuffer.write = w + len
-	--print("WRITE", name, buffer.write) dump()
+	C.av_msgqueue_commit(msgqueue)
 	
 	-- recycle name:
-	table.insert(idpool, name)
+	C.av_audio_voice_free(name)
 end
 
-function audio.send(str)
+function audio.send(str, t)
 	-- send to audio thread:
 	local len = #str+1	-- plus one for null terminator
-	local w = write_header(C.AV_AUDIO_CMD_GENERIC, len)
 	-- write body:
-	ffi.copy(msgbuffer.data + w, str, len)
+	ffi.copy(reserve(C.AV_AUDIO_CMD_GENERIC, len, t), str, len)
 	-- mark as complete:
-	msgbuffer.write = w + len
-	--print("WRITE", str, buffer.write) dump()
+	C.av_msgqueue_commit(msgqueue)
 end
 
 function audio.dump()
-	msgbuffer_dump()
+	print("audio message queue", C.av_msgqueue_used(msgqueue), msgqueue.size)
+	local stats = driver.stats
+	print(string.format("audio load %.1f%% (avg %.1f%%) worst block %.3fms, %d underflows, %d overflows, %d late messages, %d stream underruns",
+		stats.load * 100, stats.load_avg * 100, stats.block_max * 1000, 
+		stats.underflows, stats.overflows, stats.late, stats.stream_underruns))
+end
+
+--- Audio callback statistics (see av_AudioStats), readable at any time
+-- @return the live stats struct
+function audio.stats()
+	return driver.stats
+end
+
+--- Ask the audio thread to clear its statistics (at the next block)
+function audio.resetstats()
+	driver.stats.reset = 1
+end
+
+audio.resamplequalities = {
+	fast = C.AV_RESAMPLE_FAST,
+	medium = C.AV_RESAMPLE_MEDIUM,
+	best = C.AV_RESAMPLE_BEST,
+}
+
+--- Run the devices at another rate than driver.samplerate, resampling at the boundary
+-- (restarts the stream)
+-- @param rate in Hz (0 for samplerate, or the nearest rate the devices support)
+-- @param quality a name from audio.resamplequalities (default "medium");
+-- it also applies to file streams opened afterwards
+function audio.devicerate(rate, quality)
+	driver.devicerate = rate or 0
+	if quality then
+		driver.resamplequality = audio.resamplequalities[quality] or error("unknown resample quality "..tostring(quality))
+	end
+	audio.start()
 end
 
 function audio.start()
@@ -151,6 +406,124 @@ function audio.start()
 	end
 end
 
+--- The most recent live input, read in place (no copy)
+-- The samples stay valid for a few seconds; audio.capturevalid(start) confirms 
+-- they were not overwritten while they were being used.
+-- @param frames how many frames
+-- @param channel input channel (default 0)
+-- @return a float pointer to frames contiguous samples (or nil if unavailable),
+-- the frame index of the first sample, and its time on the audio clock
+function audio.capture(frames, channel)
+	local count = C.av_audio_capture_count()
+	-- not captured yet (or, for a moment every 2^32 frames, the count has wrapped):
+	if count < frames then return end
+	local start = count - frames
+	local ptr = C.av_audio_capture_read(channel or 0, start, frames)
+	if ptr == nil then return end
+	return ptr, start, C.av_audio_capture_time(driver.capture, start)
+end
+
+--- Whether captured input starting at frame start is still intact
+function audio.capturevalid(start)
+	return C.av_audio_capture_valid(start) ~= 0
+end
+
+--- Start a spectral analysis of live input or of the output
+-- It runs on a helper thread; read the returned av_Analysis (see av.h) at any time,
+-- e.g. a.magnitude[k], a.bands[b], a.onsets, or use audio.readanalysis for a consistent copy.
+-- @param source input channel, or "output" (default 0)
+-- @param size window length in frames (even; default 1024)
+-- @param hop frames between analyses (default size / 2)
+-- @return the analysis, or nil if it could not be started
+function audio.analysis(source, size, hop)
+	size = size or 1024
+	if source == "output" then source = -1 end
+	local a = C.av_audio_analysis_start(source or 0, size, hop or math.floor(size / 2))
+	if a == nil then return end
+	return a
+end
+
+--- Stop updating an analysis returned by audio.analysis
+function audio.stopanalysis(a)
+	C.av_audio_analysis_stop(a)
+end
+
+--- Call f(a) while no update of analysis a is being written, retrying if one was
+-- @return whatever f returns
+function audio.readanalysis(a, f)
+	while true do
+		local seq = a.sequence
+		if seq % 2 == 0 then
+			local r1, r2, r3, r4 = f(a)
+			if a.sequence == seq then return r1, r2, r3, r4 end
+		end
+	end
+end
+
+--- Record the output to disk, as 32-bit float
+-- The file type follows the extension: .w64, .caf, or otherwise .wav
+-- @param path the file to write
+-- @param input true to record the inputs too (after the outputs)
+function audio.record(path, input)
+	if C.av_audio_record_start(path, input and 1 or 0) == 0 then
+		error("unable to record audio to "..tostring(path))
+	end
+end
+
+--- Stop recording; the file is completed in the background
+function audio.stoprecord()
+	C.av_audio_record_stop()
+end
+
+local recordinfo = ffi.new("av_AudioRecordInfo")
+
+--- State of the current (or last) recording
+-- @return a table of recording, channels, frames, dropped (blocks), failed
+function audio.recordinfo()
+	C.av_audio_record_info(recordinfo)
+	return {
+		recording = recordinfo.recording ~= 0,
+		channels = recordinfo.channels,
+		frames = recordinfo.frames,
+		dropped = recordinfo.dropped,
+		failed = recordinfo.failed ~= 0,
+	}
+end
+
+--- Change the stream geometry without restarting
+-- Voices, pending messages and the audio clock carry over; the stream briefly stops.
+-- @param config a table with any of samplerate, blocksize, inchannels, outchannels, 
+-- and latency (seconds of main-thread generation ring); missing fields keep their values
+-- @return true if the devices accepted the new geometry
+function audio.reconfigure(config)
+	local ok = C.av_audio_reconfigure(
+		config.samplerate or 0, 
+		config.blocksize or 0, 
+		config.inchannels or -1, 
+		config.outchannels or 0, 
+		config.latency or 0) ~= 0
+	if not ok then
+		print("audio reconfiguration failed; previous settings restored")
+	end
+	return ok
+end
+
+--- Render audio offline, as fast as possible, without an audio device.
+-- Uses the driver's current samplerate, blocksize and channel counts. 
+-- Any running device stream is stopped first; use audio.start() to resume it.
+-- @param path a WAV file to write, or nil
+-- @param seconds duration to render
+-- @param buffer optional float array to receive the interleaved output
+-- @return number of frames rendered
+function audio.render(path, seconds, buffer)
+	local frames = math.floor(seconds * driver.samplerate)
+	local done = C.av_audio_render(path, buffer, frames)
+	if done < 0 then
+		error("unable to render audio to "..tostring(path))
+	end
+	return done
+end
+
 audio.clear()
 audio.start()
 
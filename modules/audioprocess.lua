@@ -10,119 +10,160 @@ local random = math.random
 local pi = math.pi
 
 local driver = C.av_audio_get()
-local msgbuffer = driver.msgbuffer
+
+-- voice lifetimes and parameters are handled natively (see av_audio.cpp);
+-- Lua only supplies the perform kernels:
+local pool = driver.voices
+local nextvoice = pool.next
+local serial = pool.serial
+local param = pool.param
+local spatial = pool.spatial
 
 -- opportunities to optimize here:
 --[[
 don't convert msg to string unless necessary; 
-use ffi cdef'd message structs and ffi.cast instead
-pre-allocate space for voices instead of creating tables
-use a linked list for voices
-use int keys for voices
 cache def constructors?
 --]]
 
--- active synth voices:
+-- one table per voice id, allocated up front so that nothing is created on the audio thread.
+-- a kernel only runs if it was installed since the voice id was last activated.
 local voices = {}
+for id = 1, pool.capacity-1 do
+	voices[id] = { id = id, serial = 0, perform = false, previous = false, fade = 0, fadelength = 0 }
+end
+
 -- current output buffer pointers:
 local outbuffers = {}
+-- spatial voices render into these, and are then encoded to ambisonics:
+local spatialbuffers = {}
+
+-- crossfading voices render the old and new kernels into these planar buses,
+-- which are allocated natively with the stream geometry (see av_Audio.fade):
+local fadeold, fadenew = {}, {}
+
+local function fadebuffers(channels, stride)
+	local fade = driver.fade
+	local second = fade + stride * driver.fadechannels
+	for c = 1, channels do
+		fadeold[c] = fade + stride * (c-1)
+		fadenew[c] = second + stride * (c-1)
+	end
+	for c = channels+1, #fadeold do
+		fadeold[c], fadenew[c] = nil, nil
+	end
+end
+
+-- render a voice into out, crossfading from its previous kernel if it has one:
+local function render(v, id, perform, out, frames)
+	local previous = v.previous
+	if not previous then
+		perform(param, id, out, frames)
+		return
+	end
+	local channels = #out
+	fadebuffers(channels, driver.busstride)
+	for c = 1, channels do
+		ffi.fill(fadeold[c], frames * 4)
+		ffi.fill(fadenew[c], frames * 4)
+	end
+	previous(param, id, fadeold, frames)
+	perform(param, id, fadenew, frames)
+	local g0 = v.fade / v.fadelength
+	local g1 = math.min(1, (v.fade + frames) / v.fadelength)
+	for c = 1, channels do
+		C.av_block_mixramp(out[c], fadeold[c], 1-g0, 1-g1, frames)
+		C.av_block_mixramp(out[c], fadenew[c], g0, g1, frames)
+	end
+	v.fade = v.fade + frames
+	if v.fade >= v.fadelength then
+		v.previous = false
+	end
+end
 
 local system = {
 	voices = voices,
+	param = param,
 	outbuffers = outbuffers,
 	driver = driver,
 }
 
+-- crossfade time (in frames) for code currently being installed:
+local installfade = 0
+
+-- returns the voice table for an active voice id, ready for a new perform kernel.
+-- if the voice was already playing, its old kernel fades out as the new one fades in.
+function system.voice(id)
+	local v = assert(voices[id], "voice does not exist")
+	assert(nextvoice[id] >= 0, "voice is not active")
+	if installfade > 0 and v.perform and v.serial == serial[id] then
+		v.previous = v.perform
+		v.fade = 0
+		v.fadelength = installfade
+	else
+		v.previous = false
+	end
+	v.serial = serial[id]
+	v.perform = false
+	return v
+end
+
+-- called from av_audio.cpp with voice code that was compiled on the main thread:
+function installcode(chunk, fade)
+	installfade = math.floor(fade * driver.samplerate)
+	local ok, err = pcall(chunk, system)
+	installfade = 0
+	if not ok then print(err) end
+end
+
+-- called from av_audio.cpp for messages it doesn't handle natively:
 function handlemessage(cmd, data)
-	if cmd == C.AV_AUDIO_CMD_VOICE_PARAM then
-		-- parse the param
-		local msg = ffi.cast("av_msg_param *", data)
-		print("READ PARAM", msg.id, msg.pid, msg.value)
-		
-		voices[msg.id].data[msg.pid] = msg.value
-		
-		return ffi.sizeof("av_msg_param")
-	elseif cmd == C.AV_AUDIO_CMD_GENERIC then
+	if cmd == C.AV_AUDIO_CMD_GENERIC then
 		-- if message body is a string, continue like this:
-		local msg = ffi.string(data)
+		local msg = ffi.string(ffi.cast("const char *", data))
 		print("READ STRING", msg, #msg)
-		return #msg + 1
-	elseif cmd == C.AV_AUDIO_CMD_VOICE_ADD then
-		-- if message body is a string, continue like this:
-		local msg = ffi.cast("int *", data)
-		local name = msg[0]
-		print("READ ADD", msg[0])
-		
-		-- add to voices
-		voices[name] = { data={} }
-		
-		return ffi.sizeof("int")
 	elseif cmd == C.AV_AUDIO_CMD_VOICE_CODE then
 		-- if message body is a string, continue like this:
-		local msg = ffi.string(data)
+		local msg = ffi.string(ffi.cast("const char *", data))
 		print("READ CODE") --, msg, #msg)
 		
-		local ok, f = pcall(loadstring, msg)
-		if ok then ok, f = pcall(f, system) end
-		if not ok then print(f) end
-		
-		return #msg + 1
-	elseif cmd == C.AV_AUDIO_CMD_VOICE_REMOVE then
-		-- if message body is a string, continue like this:
-		local msg = ffi.cast("int *", data)
-		local name = msg[0]
-		print("READ REMOVE", name)
-		
-		-- remove from voices
-		voices[name].perform = nil
-		
-		return ffi.sizeof("int")
+		-- (audio.setcode sends precompiled AV_AUDIO_CMD_VOICE_BYTECODE instead; 
+		-- raw source has to be parsed here, on the audio thread)
+		local f, err = loadstring(msg)
+		if f then installcode(f, 0) else print(err) end
 	elseif cmd == C.AV_AUDIO_CMD_CLEAR then
-		print("READ CLEAR")
-		-- remove all voices
-		for k in pairs(voices) do 
-			voices[k].perform = nil 
-		end
+		-- the native side has already removed all voices
 		print("cleared audio system")
-		return 0
-	else
-		-- probably want to bail the program if there is an error here... 
-		assert(cmd == C.AV_AUDIO_CMD_EMPTY, "unexpected message type")
-		return 0
 	end
 end
 
 local function callback(self, time, inputs, outputs, frames)
-	-- read any incoming messages:
-	local r, w = msgbuffer.read, msgbuffer.write
-	-- r ~= w implies that the buffer is not empty:
-	while r ~= w do		
-		local cmd = msgbuffer.data[r]
-		--print("reading cmd at", cmd, r, type(cmd))
-		if cmd == C.AV_AUDIO_CMD_SKIP then
-			--print("\tfound skip at", r)
-			r = 0
-			cmd = msgbuffer.data[r]
-		end
-		r = r + 1
-		r = r + handlemessage(cmd, msgbuffer.data + r)
-		if r >= msgbuffer.size then r = 0 end
-		
-		-- could do this outside the loop?:
-		msgbuffer.read = r
-	end	
-	
-	-- get and clear output buffers:
-	for c = 1, 2 do
-		local buf = outputs + frames * (c-1)
-		outbuffers[c] = buf
+	-- get the planar output buffers for this segment:
+	local stride = driver.busstride
+	for c = 1, math.max(driver.outchannels, 2) do
+		outbuffers[c] = outputs + stride * (c-1)
 	end
+	for c = math.max(driver.outchannels, 2)+1, #outbuffers do
+		outbuffers[c] = nil
+	end
+	spatialbuffers[1] = driver.spatial
+	spatialbuffers[2] = driver.spatial + stride
 	
-	-- play all voices:
-	for id, v in pairs(voices) do
-		if v.perform then
-			v.perform(v.data, outbuffers, frames)
+	-- play all active voices:
+	local id = nextvoice[0]
+	while id ~= 0 do
+		local v = voices[id]
+		local perform = v.perform
+		if perform and v.serial == serial[id] then
+			if spatial[id] ~= 0 then
+				ffi.fill(spatialbuffers[1], frames * 4)
+				ffi.fill(spatialbuffers[2], frames * 4)
+				render(v, id, perform, spatialbuffers, frames)
+				C.av_audio_ambi_encode(id, spatialbuffers[1], spatialbuffers[2], frames)
+			else
+				render(v, id, perform, outbuffers, frames)
+			end
 		end
+		id = nextvoice[id]
 	end
 	
 	--[[
@@ -236,8 +277,8 @@ local function callback(self, time, inputs, outputs, frames)
 	
 	--]]
 	
-	-- TODO: tune this
-	collectgarbage("step")
+	-- garbage collection is scheduled natively, in whatever time is left after each block
+	-- (see av_audio_gc in av_audio.cpp)
 end
 
 function nullonframes(self, time, inputs, outputs, frames) end
@@ -1,6 +1,9 @@
 local gl = require "gl"
 local glu = require "glu"
 
+-- (for win:bindscreen)
+local win = require "window"
+
 local cubefbo = {}
 cubefbo.__index = cubefbo
 
@@ -84,7 +87,7 @@ function cubefbo:create()
 		
 		-- cleanup:
 		gl.BindRenderbuffer(gl.RENDERBUFFER, 0)
-		gl.BindFramebuffer(gl.FRAMEBUFFER, 0)
+		win:bindscreen()
 		
 		glu.assert("intializing cubefbo")
 	end
@@ -136,9 +139,8 @@ function cubefbo:face(face)
 end
 
 function cubefbo:endcapture()
-	gl.BindFramebuffer(gl.FRAMEBUFFER, 0)
+	win:bindscreen()
 	self.cubefbobound = false
-	gl.DrawBuffer(gl.BACK)
 	gl.Disable(gl.SCISSOR_TEST)
 	glu.assert("cubefbo:endcapture")
 end
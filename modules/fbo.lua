@@ -2,6 +2,9 @@ local gl = require "gl"
 local glu = require "glu"
 local ffi = require "ffi"
 
+-- (for win:bindscreen)
+local win = require "window"
+
 local fbo = {}
 fbo.__index = fbo
 
@@ -68,7 +71,7 @@ function fbo:create()
 		
 		-- cleanup:
 		gl.BindRenderbuffer(gl.RENDERBUFFER, 0)
-		gl.BindFramebuffer(gl.FRAMEBUFFER, 0)
+		win:bindscreen()
 		
 		glu.assert("intializing fbo")
 	end
@@ -124,9 +127,8 @@ end
 
 
 function fbo:unbindbuffer()
-	gl.BindFramebuffer(gl.FRAMEBUFFER, 0)
+	win:bindscreen()
 	self.fbobound = false
-	gl.DrawBuffer(gl.BACK)
 end
 
 function fbo:startcapture()
@@ -0,0 +1,74 @@
+--- trace: timing where frames go, as Chrome trace-event JSON
+
+local ffi = require "ffi"
+local C = ffi.C
+-- to cdef the av_trace stuff:
+local builtin = require "builtin"
+
+-- Spans are recorded by the C++ main loop (frame, tick, draw, swap),
+-- the audio callback (audio block, render, reverb, gc) and the RGBD thread,
+-- along with any spans scripts add here; nothing is recorded until enabled.
+-- Open the written file in chrome://tracing or https://ui.perfetto.dev
+
+local trace = {}
+
+-- span names must persist in C:
+local names = {}
+local function intern(name)
+	local s = names[name]
+	if not s then
+		s = C.av_trace_intern(name)
+		names[name] = s
+	end
+	return s
+end
+
+--- Start (or with false, stop) recording
+function trace.enable(b)
+	C.av_trace_enable(b == false and 0 or 1)
+end
+
+--- Whether recording
+function trace.enabled()
+	return C.av_trace_enabled() ~= 0
+end
+
+--- Begin a span, which lasts until the matching trace.finish()
+-- @param name the span's name
+function trace.begin(name)
+	C.av_trace_begin(intern(name))
+end
+
+--- End the innermost span
+function trace.finish()
+	C.av_trace_end()
+end
+
+--- Call a function within a span
+-- @param name the span's name
+-- @param f the function, followed by any arguments
+-- @return what f returns
+function trace.scope(name, f, ...)
+	C.av_trace_begin(intern(name))
+	local res = { pcall(f, ...) }
+	C.av_trace_end()
+	if not res[1] then error(res[2], 2) end
+	return unpack(res, 2)
+end
+
+--- Forget what has been recorded so far
+function trace.clear()
+	C.av_trace_clear()
+end
+
+--- Write what has been recorded (the most recent spans of each thread)
+-- @param path the file to write (default trace.json)
+-- @return the number of events written
+function trace.write(path)
+	path = path or "trace.json"
+	local n = C.av_trace_write(path)
+	if n < 0 then error("failed to write trace to " .. path) end
+	return n
+end
+
+return trace
@@ -0,0 +1,181 @@
+--- ugen: block-processing unit generators (see av.h)
+-- Each object processes a whole block per call, e.g. in a voice kernel:
+--   local osc, env = ugen.osc(440), ugen.env(0.01, 0.1, 0.5, 0.2)
+--   voice.perform = function(P, id, out, frames)
+--     osc:sine(buf, frames)
+--     env:process(amp, frames)
+--     ugen.mul(buf, amp, frames)
+--     ugen.mix(out[1], buf, 0.5, frames)
+--   end
+-- Objects hold no Lua references, so they can be created up front and reused freely.
+
+local ffi = require "ffi"
+local C = ffi.C
+-- to cdef the av_Audio stuff:
+local builtin = require "builtin"
+
+local driver = C.av_audio_get()
+
+local ugen = {}
+
+local function samplerate()
+	return driver.samplerate
+end
+
+--- Allocate a zeroed float buffer (e.g. for intermediate signals)
+function ugen.buffer(frames)
+	return ffi.new("float[?]", frames or driver.blocksize)
+end
+
+local osc = {}
+osc.__index = osc
+
+--- Create an oscillator
+-- @param freq frequency in Hz
+-- @param phase initial phase in cycles (optional)
+function ugen.osc(freq, phase)
+	local self = ffi.new("av_Osc")
+	self.phase = phase or 0
+	self:freq(freq or 440)
+	return self
+end
+
+function osc:freq(freq)
+	C.av_osc_setfreq(self, freq, samplerate())
+	return self
+end
+
+function osc:sine(out, frames) C.av_osc_sine(self, out, frames) end
+function osc:saw(out, frames) C.av_osc_saw(self, out, frames) end
+function osc:square(out, frames) C.av_osc_square(self, out, frames) end
+function osc:triangle(out, frames) C.av_osc_triangle(self, out, frames) end
+--- Play a wavetable (a float array whose size is a power of two)
+function osc:table(table, size, out, frames) C.av_osc_table(self, table, size, out, frames) end
+
+ffi.metatype("av_Osc", osc)
+
+local biquad = {}
+biquad.__index = biquad
+
+ugen.biquadtypes = {
+	lowpass = C.AV_BIQUAD_LOWPASS,
+	highpass = C.AV_BIQUAD_HIGHPASS,
+	bandpass = C.AV_BIQUAD_BANDPASS,
+	notch = C.AV_BIQUAD_NOTCH,
+	peak = C.AV_BIQUAD_PEAK,
+	lowshelf = C.AV_BIQUAD_LOWSHELF,
+	highshelf = C.AV_BIQUAD_HIGHSHELF,
+}
+
+--- Create a biquad filter
+-- @param kind one of the names in ugen.biquadtypes (default "lowpass")
+-- @param freq cutoff or center frequency in Hz
+-- @param q resonance (default 0.707)
+-- @param gain in dB, for peak and shelf filters
+function ugen.biquad(kind, freq, q, gain)
+	local self = ffi.new("av_Biquad")
+	self:set(kind, freq, q, gain)
+	return self
+end
+
+function biquad:set(kind, freq, q, gain)
+	local t = ugen.biquadtypes[kind or "lowpass"] or error("unknown biquad type "..tostring(kind))
+	C.av_biquad_set(self, t, freq or 1000, q or 0.707, gain or 0, samplerate())
+	return self
+end
+
+function biquad:process(input, out, frames) C.av_biquad_process(self, input, out or input, frames) end
+
+ffi.metatype("av_Biquad", biquad)
+
+local svf = {}
+svf.__index = svf
+
+--- Create a state-variable filter (smooth under modulation)
+function ugen.svf(freq, q)
+	local self = ffi.new("av_SVF")
+	self:set(freq, q)
+	return self
+end
+
+function svf:set(freq, q)
+	C.av_svf_set(self, freq or 1000, q or 0.707, samplerate())
+	return self
+end
+
+--- Filter input; any of low, band, high may be nil
+function svf:process(input, low, band, high, frames) C.av_svf_process(self, input, low, band, high, frames) end
+
+ffi.metatype("av_SVF", svf)
+
+local env = {}
+env.__index = env
+
+--- Create an ADSR envelope (times in seconds)
+function ugen.env(attack, decay, sustain, release)
+	local self = ffi.new("av_Env")
+	self:set(attack, decay, sustain, release)
+	return self
+end
+
+function env:set(attack, decay, sustain, release)
+	C.av_env_set(self, attack or 0.01, decay or 0.1, sustain or 0.5, release or 0.2, samplerate())
+	return self
+end
+
+function env:gate(on) C.av_env_gate(self, on and 1 or 0) end
+--- Write the envelope into out; returns false once it has finished releasing
+function env:process(out, frames) return C.av_env_process(self, out, frames) ~= 0 end
+
+ffi.metatype("av_Env", env)
+
+local delay = {}
+delay.__index = delay
+
+-- the buffers of delay lines, keyed by the line (the struct only holds a pointer):
+local delaybuffers = setmetatable({}, { __mode = "k" })
+
+--- Create a delay line
+-- @param maxdelay the longest delay in seconds
+function ugen.delay(maxdelay)
+	local size = 2
+	while size < (maxdelay or 1) * samplerate() + 2 do size = size * 2 end
+	local self = ffi.new("av_Delay")
+	local buffer = ffi.new("float[?]", size)
+	delaybuffers[self] = buffer
+	self.buffer = buffer
+	self.size = size
+	return self
+end
+
+--- Delay input by the given time in seconds, with optional feedback
+function delay:process(input, out, frames, time, feedback)
+	C.av_delay_process(self, input, out or input, frames, time * samplerate(), feedback or 0)
+end
+
+ffi.metatype("av_Delay", delay)
+
+local noise = {}
+noise.__index = noise
+
+function ugen.noise(seed)
+	local self = ffi.new("av_Noise")
+	self.seed = seed or math.random(2^31)
+	return self
+end
+
+function noise:white(out, frames) C.av_noise_white(self, out, frames) end
+function noise:pink(out, frames) C.av_noise_pink(self, out, frames) end
+
+ffi.metatype("av_Noise", noise)
+
+--- out[i] *= input[i]
+ugen.mul = C.av_block_mul
+--- out[i] *= gain
+ugen.scale = C.av_block_scale
+--- out[i] += input[i] * gain
+ugen.mix = C.av_block_mix
+--- out[i] += input[i] * (gain ramping from gain0 to gain1)
+ugen.mixramp = C.av_block_mixramp
+
+return ugen
@@ -92,6 +92,9 @@ function Window:__newindex(k, v)
 	elseif k == "fullscreen" then
 		self:setfullscreen(v)
 		
+	elseif k == "vsync" then
+		self:setvsync(v and 1 or 0)
+		
 	--[=[
 	elseif k == "title" then
 		self:settitle(v)
@@ -107,6 +110,8 @@ end
 function Window:__index(k)
 	if k == "fullscreen" then
 		return self.is_fullscreen ~= 0
+	elseif k == "vsync" then
+		return self.is_vsync ~= 0
 	elseif k == "dim" then
 		return { self.width, self.height }
 	else
@@ -114,6 +119,14 @@ function Window:__index(k)
 	end
 end
 
+-- make the screen the render target again (e.g. after drawing into an FBO).
+-- when rendering headless, the screen is itself an FBO (see av_Window.framebuffer):
+function Window:bindscreen()
+	local screen = self.framebuffer
+	gl.BindFramebuffer(gl.FRAMEBUFFER, screen)
+	gl.DrawBuffer(screen ~= 0 and gl.COLOR_ATTACHMENT0 or gl.BACK)
+end
+
 setmetatable(Window, {
 	__index = function(self, k)
 		Window[k] = lib["av_window_" .. k]
@@ -127,9 +140,20 @@ local win = lib.av_window_create()
 local updating = true
 local firstdraw = true
 
+-- span names for the trace (see trace.lua):
+local trace_gc = lib.av_trace_intern("gc")
+local trace_update = lib.av_trace_intern("update")
+local trace_draw = lib.av_trace_intern("lua draw")
+
+local drainevents
+
 -- set default callbacks:
 win.ondraw = function(self) 
+	drainevents(self)
+	
+	lib.av_trace_begin(trace_gc)
 	collectgarbage()
+	lib.av_trace_end()
 	
 	if firstdraw then
 		gl.Enable(gl.MULTISAMPLE)	
@@ -147,7 +171,9 @@ win.ondraw = function(self)
 	t = t1
 	
 	if updating and update and type(update) == "function" then
+		lib.av_trace_begin(trace_update)
 		local ok, err = xpcall(function() update(dt) end, debug.traceback)
+		lib.av_trace_end()
 		if not ok then 
 			print(debug.traceback(err)) 
 			-- prevent error spew:
@@ -175,7 +201,9 @@ win.ondraw = function(self)
 	gl.Color(1, 1, 1)
 	
 	if draw and type(draw) == "function" then
+		lib.av_trace_begin(trace_draw)
 		local ok, err = xpcall(function() draw(w, h) end, debug.traceback)
+		lib.av_trace_end()
 		if not ok then 
 			print("error in draw")
 			print(debug.traceback(err)) 
@@ -185,7 +213,9 @@ win.ondraw = function(self)
 	end
 end
 win.oncreate = function(self) end
-win.onkey = function(self, e, k) 
+
+-- input arrives as a batch each frame, rather than through per-event callbacks:
+local function onkey(self, e, k) 
 	e = key_events[e]
 	if k > 31 and k < 127 then
 		-- convert printable characters:
@@ -216,12 +246,27 @@ win.onkey = function(self, e, k)
 		if not ok then print(debug.traceback(err)) end
 	end
 end
-win.onmouse = function(self, e, b, x, y) 
+local function onmouse(self, e, b, x, y) 
 	if mouse and type(mouse) == "function" then
 		local ok, err = pcall(mouse, mouse_events[e], b, x / win.width, (self.height-y-1) / win.height)
 		if not ok then print(debug.traceback(err)) end
 	end
 end
+
+local eventcount = ffi.new("int[1]")
+drainevents = function(self)
+	local events = lib.av_window_events(self, eventcount)
+	for i = 0, eventcount[0]-1 do
+		local ev = events[i]
+		self.shift, self.alt, self.ctrl = ev.shift, ev.alt, ev.ctrl
+		if ev.type <= lib.AV_EVENT_KEYUP then
+			onkey(self, ev.type, ev.key)
+		else
+			onmouse(self, ev.type - lib.AV_EVENT_MOUSEDOWN, ev.key, ev.x, ev.y)
+		end
+	end
+end
+
 win.onvisible = function(self, s) end
 win.onresize = function(self, w, h) end
 
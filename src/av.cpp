@@ -5,6 +5,11 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <math.h>
+
+#ifdef AV_LINUX
+	#include <GL/glx.h>
+#endif
 
 #ifdef AV_OSX_HID
 #include "hidapi/hidapi/hidapi.h"
@@ -110,12 +115,20 @@ struct av_Window_GLUT : public av_Window {
 		height = 480;
 		is_fullscreen = 0;
 		is_stereo = 0;
+		#ifdef AV_OSX
+		// (OSX windows have always had vsync forced on; novsync frees them)
+		is_vsync = 1;
+		#else
+		is_vsync = 0;
+		#endif
 		reset();
 	}
 	
 	void reset() {
 		shift = alt = ctrl = 0;
 		fps = 60;
+		frametime = framecost = jitter = 0;
+		events_dropped = 0;
 		oncreate = 0;
 		onresize = 0;
 		onvisible = 0;
@@ -156,17 +169,81 @@ void av_tick() {
 	lua_settop(L, 0);
 }
 
-void timerfunc(int id) {
-	static int f = 0;
-	
-	// trigger filewatching etc:
-	if (f++ > 10) {
-		av_tick();
-		f = 0;
+// frame scheduling. 
+// frames are paced against absolute deadlines on the monotonic clock, so that the time
+// spent ticking & drawing doesn't add to the period. in vsync mode, the buffer swap 
+// blocks until the display refresh instead, and the next frame starts straight away.
+double frame_deadline = 0;	// when the next frame is due
+double frame_start = 0;		// when the last frame started
+double frame_average = 0;	// smoothed period
+
+// if a frame is more than this many periods late, don't try to catch up:
+#define FRAME_RESYNC 2
+
+void setswapinterval(int interval) {
+	#if defined AV_OSX
+		GLint VBL = interval;
+		CGLContextObj ctx = CGLGetCurrentContext();
+		CGLSetParameter(ctx, kCGLCPSwapInterval, &VBL);
+	#elif defined AV_LINUX
+		typedef int (*swapfunc)(int);
+		swapfunc f = (swapfunc)glXGetProcAddress((const GLubyte *)"glXSwapIntervalMESA");
+		if (!f) f = (swapfunc)glXGetProcAddress((const GLubyte *)"glXSwapIntervalSGI");
+		if (f) {
+			f(interval);
+		} else {
+			printf("vsync control not available\n");
+		}
+	#elif defined AV_WINDOWS
+		typedef BOOL (WINAPI *swapfunc)(int);
+		swapfunc f = (swapfunc)wglGetProcAddress("wglSwapIntervalEXT");
+		if (f) {
+			f(interval);
+		} else {
+			printf("vsync control not available\n");
+		}
+	#endif
+}
+
+void timerfunc(int id);
+
+void schedule() {
+	double period = 1.0/(win.fps > 0 ? win.fps : 60);
+	double now = av_monotonic_time();
+	if (win.is_vsync) {
+		// the swap already waited for the display:
+		frame_deadline = now;
+		glutTimerFunc(0, timerfunc, 0);
+		return;
+	}
+	frame_deadline += period;
+	if (frame_deadline < now - FRAME_RESYNC*period) {
+		// far behind; start again from here:
+		frame_deadline = now;
 	}
+	// GLUT timers are in whole milliseconds, so aim low and sleep the rest:
+	double wait = frame_deadline - now;
+	glutTimerFunc(wait > 0 ? (unsigned int)(wait * 1000.) : 0, timerfunc, 0);
+}
+
+// measures the period, and does the frame's work up to the buffer swap:
+void frame(double t0) {
+	if (frame_start > 0) {
+		win.frametime = t0 - frame_start;
+		if (frame_average == 0) frame_average = win.frametime;
+		win.jitter += 0.05 * (fabs(win.frametime - frame_average) - win.jitter);
+		frame_average += 0.05 * (win.frametime - frame_average);
+	}
+	frame_start = t0;
+	
+	// drain filewatching etc:
+	av_trace_begin("tick");
+	av_tick();
+	av_trace_end();
 	
 	// update window:
 	if (win.reload && win.oncreate) {
+		av_TraceScope scope("create");
 		(win.oncreate)(&win);
 		win.reload = false;
 	}
@@ -175,20 +252,58 @@ void timerfunc(int id) {
 	// ortho2d here?
 	
 	if (win.ondraw) {
+		av_TraceScope scope("draw");
 		(win.ondraw)(&win);
 	}	
+}
+
+void timerfunc(int id) {
+	double t0 = av_monotonic_time();
+	if (!win.is_vsync && frame_deadline > t0) {
+		av_sleep(frame_deadline - t0);
+		t0 = av_monotonic_time();
+	}
+	
+	av_trace_begin("frame");
+	frame(t0);
+	av_trace_begin("swap");
 	glutSwapBuffers();
+	av_trace_end();
 	glutPostRedisplay();
+	av_trace_end();
+	
+	win.framecost = av_monotonic_time() - t0;
 	
 	// reschedule:
-	glutTimerFunc((unsigned int)(1000.0/win.fps), timerfunc, 0);
+	schedule();
+}
+
+// headless frames run back to back, for the given count (or forever if 0):
+void headless_run(int frames) {
+	double start = av_monotonic_time();
+	int n = 0;
+	while (frames <= 0 || n < frames) {
+		double t0 = av_monotonic_time();
+		av_TraceScope scope("frame");
+		frame(t0);
+		// finish, so that the frame can be read back and its cost is real:
+		av_trace_begin("finish");
+		glFinish();
+		av_trace_end();
+		win.framecost = av_monotonic_time() - t0;
+		n++;
+	}
+	double seconds = av_monotonic_time() - start;
+	printf("headless: %d frames in %.3f seconds (%.1f fps)\n", n, seconds, n / seconds);
 }
 
 void av_window_settitle(av_Window * self, const char * name) {
+	if (win.is_headless) return;
 	glutSetWindowTitle(name);
 }
 
 void av_window_setfullscreen(av_Window * self, int b) {
+	if (win.is_headless) return;
 	win.reload = true;
 	win.is_fullscreen = b;
 	if (b) {
@@ -201,7 +316,21 @@ void av_window_setfullscreen(av_Window * self, int b) {
 }
 
 
+void av_window_setvsync(av_Window * self, int b) {
+	win.is_vsync = b ? 1 : 0;
+	if (win.is_headless) return;
+	setswapinterval(win.is_vsync);
+}
+
 void av_window_setdim(av_Window * self, int x, int y) {
+	if (win.is_headless) {
+		if (av_headless_resize(x, y)) {
+			win.width = x;
+			win.height = y;
+			if (win.onresize) (win.onresize)(&win, x, y);
+		}
+		return;
+	}
 	glutReshapeWindow(x, y);
 	glutPostRedisplay();
 }
@@ -210,8 +339,69 @@ av_Window * av_window_create() {
 	return &win;
 }
 
+// input events wait here for the next frame:
+av_WindowEvent events[AV_WINDOW_EVENTS_MAX];
+int nevents = 0;
+
+av_WindowEvent * av_window_events(av_Window * self, int * count) {
+	// (the GLUT callbacks run on this thread too, so nothing is added until the next frame)
+	*count = nevents;
+	nevents = 0;
+	return events;
+}
+
+static int ismotion(int type) {
+	return type == AV_EVENT_MOUSEDRAG || type == AV_EVENT_MOUSEMOVE;
+}
+
+void pushevent(int type, int key, int x, int y) {
+	// motion only matters where it got to:
+	if (ismotion(type) && nevents 
+		&& events[nevents-1].type == type && events[nevents-1].key == key) {
+		av_WindowEvent& e = events[nevents-1];
+		e.t = av_monotonic_time();
+		e.x = x;
+		e.y = y;
+		return;
+	}
+	if (nevents == AV_WINDOW_EVENTS_MAX) {
+		// a lost key or button release would leave it stuck, so make room by losing the oldest motion:
+		int i = 0;
+		while (i < nevents && !ismotion(events[i].type)) i++;
+		win.events_dropped++;
+		if (i == nevents) return;
+		memmove(events + i, events + i + 1, sizeof(av_WindowEvent) * (nevents - i - 1));
+		nevents--;
+	}
+	av_WindowEvent& e = events[nevents++];
+	e.t = av_monotonic_time();
+	e.type = type;
+	e.key = key;
+	e.x = x;
+	e.y = y;
+	e.shift = win.shift;
+	e.alt = win.alt;
+	e.ctrl = win.ctrl;
+}
+
+void keyevent(int type, int key) {
+	pushevent(type, key, 0, 0);
+	// (the old per-event callback, if a script still sets one)
+	if (win.onkey) {
+		(win.onkey)(&win, type, key);
+	}
+}
+
+void mouseevent(int type, int x, int y) {
+	pushevent(type, win.button, x, y);
+	if (win.onmouse) {
+		(win.onmouse)(&win, type - AV_EVENT_MOUSEDOWN, win.button, x, y);
+	}
+}
+
 void av_state_reset(void * self) {
 	win.reset();
+	nevents = 0;
 }
 
 void getmodifiers() {
@@ -235,18 +425,14 @@ void onkeydown(unsigned char k, int x, int y) {
 			return;
 		default: {
 			//printf("k %d s %d a %d c %d\n", k, win.shift, win.alt, win.ctrl);
-			if (win.onkey) {
-				(win.onkey)(&win, 1, k);
-			}
+			keyevent(AV_EVENT_KEYDOWN, k);
 		}
 	}
 }
 
 void onkeyup(unsigned char k, int x, int y) {
 	getmodifiers();
-	if (win.onkey) {
-		(win.onkey)(&win, 2, k);
-	}
+	keyevent(AV_EVENT_KEYUP, k);
 }
 
 void onspecialkeydown(int key, int x, int y) {
@@ -265,9 +451,7 @@ void onspecialkeydown(int key, int x, int y) {
 	}
 	#undef CS
 	
-	if (win.onkey) {
-		(win.onkey)(&win, 1, key);
-	}
+	keyevent(AV_EVENT_KEYDOWN, key);
 }
 
 void onspecialkeyup(int key, int x, int y) {
@@ -285,29 +469,21 @@ void onspecialkeyup(int key, int x, int y) {
 	}
 	#undef CS
 	
-	if (win.onkey) {
-		(win.onkey)(&win, 2, key);
-	}
+	keyevent(AV_EVENT_KEYUP, key);
 }
 
 void onmouse(int button, int state, int x, int y) {
 	getmodifiers();
 	win.button = button;
-	if (win.onmouse) {
-		(win.onmouse)(&win, state, win.button, x, y);
-	}
+	mouseevent(state == GLUT_DOWN ? AV_EVENT_MOUSEDOWN : AV_EVENT_MOUSEUP, x, y);
 }
 
 void onmotion(int x, int y) {
-	if (win.onmouse) {
-		(win.onmouse)(&win, 2, win.button, x, y);
-	}
+	mouseevent(AV_EVENT_MOUSEDRAG, x, y);
 }
 
 void onpassivemotion(int x, int y) {
-	if (win.onmouse) {
-		(win.onmouse)(&win, 3, win.button, x, y);
-	}
+	mouseevent(AV_EVENT_MOUSEMOVE, x, y);
 }
 
 void onvisibility(int state) {
@@ -328,75 +504,6 @@ void onreshape(int w, int h) {
 	glutPostRedisplay();
 }
 
-#ifdef AV_WINDOWS
-	#include < time.h >
-	#if defined(_MSC_VER) || defined(_MSC_EXTENSIONS)
-	  #define DELTA_EPOCH_IN_MICROSECS  11644473600000000Ui64
-	#else
-	  #define DELTA_EPOCH_IN_MICROSECS  11644473600000000ULL
-	#endif
-	 
-	struct timezone 
-	{
-	  int  tz_minuteswest; /* minutes W of Greenwich */
-	  int  tz_dsttime;     /* type of dst correction */
-	};
-	 
-	int gettimeofday(struct timeval *tv, struct timezone *tz)
-	{
-	  FILETIME ft;
-	  unsigned __int64 tmpres = 0;
-	  static int tzflag;
-	 
-	  if (NULL != tv)
-	  {
-		GetSystemTimeAsFileTime(&ft);
-	 
-		tmpres |= ft.dwHighDateTime;
-		tmpres <<= 32;
-		tmpres |= ft.dwLowDateTime;
-	 
-		/*converting file time to unix epoch*/
-		tmpres -= DELTA_EPOCH_IN_MICROSECS; 
-		tmpres /= 10;  /*convert into microseconds*/
-		tv->tv_sec = (long)(tmpres / 1000000UL);
-		tv->tv_usec = (long)(tmpres % 1000000UL);
-	  }
-	 
-	  if (NULL != tz)
-	  {
-		if (!tzflag)
-		{
-		  _tzset();
-		  tzflag++;
-		}
-		tz->tz_minuteswest = _timezone / 60;
-		tz->tz_dsttime = _daylight;
-	  }
-	 
-	  return 0;
-	}
-#endif
-
-double av_time() {
-		timeval t;
-		gettimeofday(&t, NULL);
-		return (double)t.tv_sec + (((double)t.tv_usec) * 1.0e-6);
-}	
-
-void av_sleep(double seconds) {
-	#ifdef AV_WINDOWS
-		Sleep((DWORD)(seconds * 1.0e3));
-	#else
-		time_t sec = (time_t)seconds;
-		long long int nsec = 1.0e9 * (seconds - (double)sec);
-		timespec tspec = { sec, nsec };
-		while (nanosleep(&tspec, &tspec) == -1) {
-			continue;
-		}
-	#endif
-}
-
 #ifdef AV_WINDOWS
 	time_t TimeFromSystemTime(const SYSTEMTIME * pTime) {
 		struct tm tm;
@@ -467,65 +574,40 @@ int av_clang_visit(CXCursor cursor, CXCursor parent, void * ud) {
 	}
 }
 
-#include "av_ffi_header.cpp"
-
-int luaopen_builtin(lua_State * L) {
-
-	static struct luaL_reg lib[] = {
-		// { "name", func },
-		{ NULL, NULL },
-	};
-	luaL_register(L, "builtin", lib);
-	
-	if (luaL_loadstring(L, av_ffi_header)) {	
-		printf("error loading ffi header %s\n", lua_tostring(L, -1));
-	}
-	if (lua_pcall(L, 0, 1, 0)) {
-		printf("error loading ffi header %s\n", lua_tostring(L, -1));
-	}
-	lua_setfield(L, -2, "header");
-	
-	return 1;
-}
-
-lua_State * av_init_lua() {
-	lua_State * L = lua_open();
-	luaL_openlibs(L);
-
-	lua_getglobal(L, "package");
-	lua_getfield(L, -1, "preload");
-		lua_pushcfunction(L, luaopen_builtin);
-		lua_setfield(L, -2, "builtin");
-		lua_pushcfunction(L, luaopen_lpeg);
-		lua_setfield(L, -2, "lpeg");
-	lua_pop(L, 2);
-	
-	lua_getglobal(L, "debug");
-	lua_pushliteral(L, "traceback");
-	lua_gettable(L, -2);
-	lua_setfield(L, LUA_REGISTRYINDEX, "debug.traceback");
-	
-	luaL_dostring(L, "package.path = './modules/?.lua;./modules/?/init.lua;'..package.path");
-	lua_settop(L, 0); // clean stack
-	return L;
-} 
-
 void gluterr( const char *fmt, va_list ap) {
 
 }
 
 int main(int argc, char * argv[]) {
-	
-	// configure GLUT:
-	glutInit(&argc, argv);
+	av_trace_thread("main");
 	
 	// parse any special arguments:
 	int firstarg = 1;
+	int frames = 0;
+	// whether the command line chose vsync on or off (else the platform default applies):
+	int vsyncarg = 0;
 	while (firstarg < argc) {
 		if (strcmp(argv[firstarg], "stereo") == 0) {
 			printf("enabling stereo\n");
 			win.is_stereo = 1;
 			firstarg++;
+		} else if (strcmp(argv[firstarg], "vsync") == 0) {
+			printf("enabling vsync\n");
+			win.is_vsync = 1;
+			vsyncarg = 1;
+			firstarg++;
+		} else if (strcmp(argv[firstarg], "novsync") == 0) {
+			printf("disabling vsync\n");
+			win.is_vsync = 0;
+			vsyncarg = 1;
+			firstarg++;
+		} else if (strcmp(argv[firstarg], "headless") == 0) {
+			printf("rendering offscreen\n");
+			win.is_headless = 1;
+			firstarg++;
+		} else if (strncmp(argv[firstarg], "frames=", 7) == 0) {
+			frames = atoi(argv[firstarg] + 7);
+			firstarg++;
 		} else {
 			break;
 		}
@@ -567,43 +649,50 @@ int main(int argc, char * argv[]) {
 	printf("Launched executable %s\n", exepath);
 	//chdir(startpath);
 	
-//	screen_width = glutGet(GLUT_SCREEN_WIDTH);
-//	screen_height = glutGet(GLUT_SCREEN_HEIGHT);
-	if (win.is_stereo) {
-		glutInitDisplayString("rgb double depth>=16 alpha samples<=4 stereo");
-	} else {	
-		glutInitDisplayString("rgb double depth>=16 alpha samples<=4");
-	}
-	//glutInitDisplayMode(GLUT_RGBA | GLUT_DOUBLE | GLUT_DEPTH); // | GLUT_MULTISAMPLE);
-	glutInitWindowSize(win.width, win.height);
-	glutInitWindowPosition(0, 0);
+	if (win.is_headless) {
+		// no display, no GLUT:
+		if (!av_headless_create(win.width, win.height)) return 0;
+		win.framebuffer = av_headless_framebuffer();
+	} else {
+		// configure GLUT:
+		glutInit(&argc, argv);
+		
+//		screen_width = glutGet(GLUT_SCREEN_WIDTH);
+//		screen_height = glutGet(GLUT_SCREEN_HEIGHT);
+		if (win.is_stereo) {
+			glutInitDisplayString("rgb double depth>=16 alpha samples<=4 stereo");
+		} else {	
+			glutInitDisplayString("rgb double depth>=16 alpha samples<=4");
+		}
+		//glutInitDisplayMode(GLUT_RGBA | GLUT_DOUBLE | GLUT_DEPTH); // | GLUT_MULTISAMPLE);
+		glutInitWindowSize(win.width, win.height);
+		glutInitWindowPosition(0, 0);
 	
-	win.id = glutCreateWindow("");
-	glutSetWindow(win.id);
+		win.id = glutCreateWindow("");
+		glutSetWindow(win.id);
 	
-	// Force VSYNC on.
-	#if defined AV_OSX
-		GLint VBL = 1;
-		CGLContextObj ctx = CGLGetCurrentContext();
-		CGLSetParameter(ctx, kCGLCPSwapInterval, &VBL);
-	#elif defined AV_LINUX
-	#elif defined AV_WINDOWS
-	#endif
+		// OSX forces its default; elsewhere the driver's setting stands unless asked otherwise:
+		#ifdef AV_OSX
+		setswapinterval(win.is_vsync);
+		#else
+		if (vsyncarg) setswapinterval(win.is_vsync);
+		#endif
 
 	
-//	glutIgnoreKeyRepeat(1);
-//	glutSetCursor(GLUT_CURSOR_NONE);
+//		glutIgnoreKeyRepeat(1);
+//		glutSetCursor(GLUT_CURSOR_NONE);
 
-	glutKeyboardFunc(onkeydown);
-	glutKeyboardUpFunc(onkeyup);
-	glutMouseFunc(onmouse);
-	glutMotionFunc(onmotion);
-	glutPassiveMotionFunc(onpassivemotion);
-	glutSpecialFunc(onspecialkeydown);
-	glutSpecialUpFunc(onspecialkeyup);
-	glutVisibilityFunc(onvisibility);
-	glutReshapeFunc(onreshape);
-	glutDisplayFunc(ondisplay);
+		glutKeyboardFunc(onkeydown);
+		glutKeyboardUpFunc(onkeyup);
+		glutMouseFunc(onmouse);
+		glutMotionFunc(onmotion);
+		glutPassiveMotionFunc(onpassivemotion);
+		glutSpecialFunc(onspecialkeydown);
+		glutSpecialUpFunc(onspecialkeyup);
+		glutVisibilityFunc(onvisibility);
+		glutReshapeFunc(onreshape);
+		glutDisplayFunc(ondisplay);
+	}
 	
 	L = av_init_lua();
 	
@@ -627,7 +716,14 @@ int main(int argc, char * argv[]) {
 	}
 	
 	// start it up:
-	glutTimerFunc((unsigned int)(1000.0/win.fps), timerfunc, 0);
+	if (win.is_headless) {
+		headless_run(frames);
+		lua_close(L);
+		av_headless_destroy();
+		return 0;
+	}
+	frame_deadline = av_monotonic_time();
+	schedule();
 	//atexit(terminate);
 	glutMainLoop();
 	
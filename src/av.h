@@ -17,6 +17,49 @@ AV_EXPORT double av_time();
 AV_EXPORT double av_filetime(const char * filename);
 AV_EXPORT void av_reload();
 
+// file watching (see av_filewatch.cpp):
+#define AV_FILEWATCH_PATH_MAX 512
+
+enum {
+	AV_FILE_CREATED = 1,
+	AV_FILE_MODIFIED,
+	AV_FILE_DELETED,
+	AV_FILE_RESCAN		// changes were lost; treat everything under the watch as modified
+};
+
+typedef struct av_FileEvent {
+	int watch;		// as returned by av_filewatch_add
+	int kind;
+	char path[AV_FILEWATCH_PATH_MAX];	// the watched directory (as given) joined with the file's path
+} av_FileEvent;
+
+// watch a file (which need not exist yet) or a directory, optionally with its subdirectories.
+// returns a watch id, or -1 on failure:
+AV_EXPORT int av_filewatch_add(const char * path, int recursive);
+AV_EXPORT void av_filewatch_remove(int id);
+// copies up to max settled changes into events, returning how many:
+// (call once per frame; changes are released once a file has been quiet for 50ms)
+AV_EXPORT int av_filewatch_poll(av_FileEvent * events, int max);
+// 1 if changes are notified by the OS, 0 if the watched paths are polled:
+AV_EXPORT int av_filewatch_native();
+
+// scoped timers, exported as Chrome trace-event JSON (see av_trace.cpp).
+// recording does nothing until enabled; names must persist (see av_trace_intern):
+AV_EXPORT void av_trace_enable(int enable);
+AV_EXPORT int av_trace_enabled();
+AV_EXPORT void av_trace_begin(const char * name);
+AV_EXPORT void av_trace_end();
+// names the calling thread in the trace:
+AV_EXPORT void av_trace_thread(const char * name);
+// lets a later thread of this name take over the ring of one that has finished:
+AV_EXPORT void av_trace_retire(const char * name);
+// a persistent copy of a name:
+AV_EXPORT const char * av_trace_intern(const char * name);
+// forget what has been recorded so far:
+AV_EXPORT void av_trace_clear();
+// writes what the rings hold as JSON, returning the number of events (or -1):
+AV_EXPORT int av_trace_write(const char * path);
+
 enum {
 	// Standard ASCII non-printable characters 
 	AV_KEY_ENTER		=3,		
@@ -36,14 +79,43 @@ enum {
 	AV_KEY_END, AV_KEY_HOME
 };
 
+// input events, queued as they arrive and drained once per frame (see av_window_events):
+enum {
+	AV_EVENT_KEYDOWN = 1,
+	AV_EVENT_KEYUP,
+	AV_EVENT_MOUSEDOWN,
+	AV_EVENT_MOUSEUP,
+	AV_EVENT_MOUSEDRAG,
+	AV_EVENT_MOUSEMOVE	// (consecutive motion events are merged into one)
+};
+
+#define AV_WINDOW_EVENTS_MAX 256
+
+typedef struct av_WindowEvent {
+	double t;		// when it arrived, on the monotonic clock (for intervals between events)
+	int type;
+	int key;		// the key, or the mouse button
+	int x, y;		// mouse position, in pixels from the top left
+	int shift, alt, ctrl;
+} av_WindowEvent;
+
 typedef struct av_Window {
 	int width, height;
 	int is_fullscreen;
 	int button;
 	int shift, alt, ctrl;
 	int is_stereo;
+	int is_vsync;		// frames locked to the display refresh, rather than paced to fps (default on OSX)
+	int is_headless;	// rendering offscreen, as fast as possible
+	unsigned int framebuffer;	// the GL framebuffer standing in for the screen (0 unless headless)
 	double fps;
 	
+	// measured by the frame scheduler (seconds):
+	double frametime;	// period of the last frame
+	double framecost;	// work time of the last frame (tick, draw and swap)
+	double jitter;		// smoothed deviation of the period from its average
+	int events_dropped;	// input events lost to a full queue (see av_window_events)
+	
 	void (*oncreate)(struct av_Window * self);
 	void (*onresize)(struct av_Window * self, int w, int h);
 	void (*onvisible)(struct av_Window * self, int state);
@@ -61,6 +133,14 @@ enum {
 	AV_AUDIO_CMD_VOICE_REMOVE,
 	AV_AUDIO_CMD_VOICE_PARAM,
 	AV_AUDIO_CMD_VOICE_CODE,
+	AV_AUDIO_CMD_VOICE_KERNEL,
+	AV_AUDIO_CMD_VOICE_POSITION,
+	AV_AUDIO_CMD_LISTENER,
+	AV_AUDIO_CMD_DECODER,
+	AV_AUDIO_CMD_STREAM_CLOSE,
+	AV_AUDIO_CMD_VOICE_BYTECODE,
+	AV_AUDIO_CMD_REVERB,
+	AV_AUDIO_CMD_PARAMS,
 	
 	AV_AUDIO_CMD_SKIP = 255
 };
@@ -70,10 +150,254 @@ typedef struct av_msg_param {
 	double value;
 } av_msg_param;
 
-typedef struct av_msgbuffer {
-	int read, write, size, unused;
+enum {
+	AV_AUDIO_RAMP_LINEAR,
+	// approaches the value like a one-pole filter (to within 60dB over the time), then jumps to it:
+	AV_AUDIO_RAMP_EXP
+};
+
+// one change in an AV_AUDIO_CMD_PARAMS message: parameter pid of voice id moves to value
+// over time seconds (0 sets it at once, and cancels any ramp under way).
+// ramps advance a block (or message segment) at a time, so one finishes at the end of 
+// the block in which its time runs out.
+typedef struct av_param_ramp {
+	int id, pid;
+	double value;
+	float time;
+	int shape;
+} av_param_ramp;
+
+// count av_param_ramp follow this header directly:
+typedef struct av_msg_params {
+	int count, unused;
+} av_msg_params;
+
+#define AV_AUDIO_PARAMS_MAX 4096	// ramps per message
+
+// a precompiled Lua chunk (string.dump) follows this header directly.
+// the chunk is called with the audio system table, like AV_AUDIO_CMD_VOICE_CODE;
+// voices it replaces crossfade from their old perform function over fade seconds.
+typedef struct av_msg_bytecode {
+	uint32_t size;
+	float fade;
+} av_msg_bytecode;
+
+typedef struct av_msg_kernel {
+	int id, kernel;
+} av_msg_kernel;
+
+#define AV_AMBI_ORDER_MAX 3
+#define AV_AMBI_CHANNELS_MAX 16
+#define AV_AMBI_SPEAKERS_MAX 64
+
+// world position of a voice (same axes as the view: x right, y up, -z forward).
+// spatial voices are encoded into the ambisonic bus rather than mixed to the outputs.
+typedef struct av_msg_position {
+	int id, spatial;
+	double pos[3];
+} av_msg_position;
+
+typedef struct av_msg_listener {
+	double pos[3];
+	double quat[4];		// x, y, z, w
+	double near;		// sources nearer than this are not louder, and blend to omni
+} av_msg_listener;
+
+// ambisonic decoder: matrix[s][k] is the gain from ambisonic channel k (ACN) to speaker s,
+// and speaker s plays on output channel s.
+typedef struct av_msg_decoder {
+	int order, speakers;
+	float matrix[AV_AMBI_SPEAKERS_MAX][AV_AMBI_CHANNELS_MAX];
+} av_msg_decoder;
+
+#define AV_AUDIO_REVERB_CHANNELS_MAX 64
+#define AV_CONVOLVERS_MAX 256
+
+// convolution reverb on the output bus: output channel c is replaced by 
+// dry * c + wet * (c convolved with convolver[c]), for c below channels.
+// channels = -1 only changes the levels (ramped over a block); otherwise the previous 
+// convolvers are destroyed and replaced (channels = 0 removes the reverb).
+typedef struct av_Convolver av_Convolver;
+typedef struct av_msg_reverb {
+	int channels;
+	float dry, wet;
+	av_Convolver * convolver[AV_AUDIO_REVERB_CHANNELS_MAX];
+} av_msg_reverb;
+
+// every message in the queue starts with this header; the body follows it directly.
+// messages are 8-byte aligned and never wrap around the end of the queue.
+typedef struct av_msg {
+	uint32_t cmd;
+	uint32_t size;		// body size in bytes
+	double t;			// when to apply it, in seconds on the av_Audio.time clock
+} av_msg;
+
+// single-producer (main thread), single-consumer (audio thread) message queue.
+// read/write are free-running byte counters; each side owns its own cache line.
+typedef struct av_msgqueue {
 	unsigned char * data;
-} av_msgbuffer;
+	uint32_t size, mask;
+	char pad0[48];
+	
+	// producer side:
+	uint32_t write;		// published to the consumer (release)
+	uint32_t reserved;	// written but not yet committed
+	uint32_t readcache;	// producer's last view of read
+	uint32_t unused0;
+	char pad1[48];
+	
+	// consumer side:
+	uint32_t read;		// published to the producer (release)
+	uint32_t pending;	// drained but not yet released
+	uint32_t deferred_used, deferred_taken, deferred_last;
+	uint32_t unused1;
+	unsigned char * deferred;	// messages due later, sorted by time (size bytes)
+	char pad2[32];
+} av_msgqueue;
+
+#define AV_AUDIO_VOICES_MAX 4096
+#define AV_AUDIO_VOICE_PARAMS 32
+#define AV_RAMPS_MAX 16384		// parameters ramping at once (a multiple of 4)
+
+// fixed-capacity voice storage shared by the main thread and audio thread.
+// voice id 0 is never allocated: it is the sentinel of the active list.
+typedef struct av_VoicePool {
+	int capacity, params;
+	double samplerate;
+	
+	// audio thread only:
+	int count;		// number of active voices
+	// native kernel index of each voice (0 for none):
+	int kernel[AV_AUDIO_VOICES_MAX];
+	// whether each voice is spatialised, and its world position as position[axis][id]:
+	int spatial[AV_AUDIO_VOICES_MAX];
+	double position[3][AV_AUDIO_VOICES_MAX];
+	// intrusive circular list of active voices, indexed by voice id:
+	int next[AV_AUDIO_VOICES_MAX];
+	int prev[AV_AUDIO_VOICES_MAX];
+	// incremented each time a voice id is (re)activated:
+	uint32_t serial[AV_AUDIO_VOICES_MAX];
+	// structure-of-arrays parameter storage, indexed as param[pid][id]:
+	double param[AV_AUDIO_VOICE_PARAMS][AV_AUDIO_VOICES_MAX];
+	// while a parameter ramps, its change per frame over the current segment (else 0), 
+	// so that kernels can interpolate param + slope * i within the segment:
+	float slope[AV_AUDIO_VOICE_PARAMS][AV_AUDIO_VOICES_MAX];
+	
+	// main thread only:
+	int freecount;
+	int freelist[AV_AUDIO_VOICES_MAX];
+	// whether each id is handed out (so that freeing it twice is harmless):
+	unsigned char allocated[AV_AUDIO_VOICES_MAX];
+} av_VoicePool;
+
+// native voice kernels add frames of output for voice id into the planar bus out 
+// (channel c at out + c*stride). they may run on any audio worker thread, in parallel with 
+// other voices, so must only touch their own voice's parameters (and never call into Lua).
+typedef void (*av_voice_kernel)(av_VoicePool * pool, int id, float * out, int stride, int channels, int frames);
+
+#define AV_AUDIO_KERNELS_MAX 64
+
+// built-in native kernels:
+enum {
+	AV_AUDIO_KERNEL_NONE,
+	// params: 0 frequency (Hz), 1 amplitude, 2 pan (0..1), 3 phase (state)
+	AV_AUDIO_KERNEL_SINE,
+	// params: 0 stream id, 1 amplitude, 2 pan (0..1, mono files only)
+	// (multichannel files play channel c on output c; files at other rates are resampled)
+	AV_AUDIO_KERNEL_STREAM,
+	
+	AV_AUDIO_KERNEL_BUILTIN_COUNT
+};
+
+#define AV_AUDIO_STATS_BINS 64
+
+// audio callback instrumentation. 
+// only the audio thread writes it (each field is a single word), so it can be read at any time.
+typedef struct av_AudioStats {
+	uint32_t callbacks;
+	uint32_t underflows;	// output xruns reported by the device
+	uint32_t overflows;		// input xruns reported by the device
+	uint32_t late;			// messages that arrived after their scheduled time
+	uint32_t queue_used;	// message queue bytes pending at the start of the last block
+	uint32_t queue_max;
+	uint32_t reset;			// set non-zero to ask the audio thread to clear the stats
+	uint32_t lua_alloc;		// bytes allocated by the audio Lua state during the last block
+	uint32_t lua_alloc_max;
+	uint32_t lua_fallbacks;	// allocations the preallocated pool could not serve
+	uint32_t lua_kb;		// audio Lua heap size
+	uint32_t stream_underruns;	// sound file streams that ran dry before their end
+	
+	double block_time;		// processing time of the last block, in seconds
+	double block_max;		// worst-case processing time
+	double load;			// processing time of the last block / block duration
+	double load_avg;		// smoothed load
+	double gc_time;			// time spent collecting garbage in the last block
+	
+	// counts of blocks by load; bin i covers loads from 2*i/BINS up to 2*(i+1)/BINS, 
+	// and the last bin also counts everything beyond:
+	uint32_t histogram[AV_AUDIO_STATS_BINS];
+} av_AudioStats;
+
+#define AV_AUDIO_STREAMS_MAX 64
+
+typedef struct av_AudioStreamInfo {
+	int channels, samplerate;
+	uint32_t frames;		// length of the file
+	uint32_t played;		// frames played so far (including loops)
+	uint32_t underruns;		// blocks in which the stream ran dry
+	int finished;			// a non-looping stream has played to its end
+} av_AudioStreamInfo;
+
+#define AV_AUDIO_CAPTURE_CHANNELS_MAX 8
+#define AV_AUDIO_CAPTURE_SECONDS 4
+
+// the audio thread publishes its input into this ring for the main thread to read in place.
+// each channel is stored twice in a row (data + c * 2 * frames, mirrored at + frames), 
+// so any span of up to frames - blocksize frames is contiguous in memory.
+typedef struct av_AudioCapture {
+	float * data;
+	uint32_t frames;		// capacity per channel (a power of two)
+	uint32_t channels;		// the first input channels, up to AV_AUDIO_CAPTURE_CHANNELS_MAX
+	volatile uint32_t write;	// frames captured so far (free-running, so it wraps; published after each block)
+	volatile double time;	// audio clock time of frame write (stored before write; see av_audio_capture_time)
+} av_AudioCapture;
+
+#define AV_ANALYSIS_MAX 4
+#define AV_ANALYSIS_SIZE_MAX 8192
+#define AV_ANALYSIS_BINS_MAX (AV_ANALYSIS_SIZE_MAX / 2 + 1)
+#define AV_ANALYSIS_BANDS 24
+
+// a short-time spectral analysis of one input channel or of the output, 
+// updated by the analysis thread every hop frames.
+// sequence is odd while an update is being written: read it before and after 
+// copying what you need, and read again if it changed or was odd.
+typedef struct av_Analysis {
+	volatile uint32_t sequence;
+	int source;				// input channel, or -1 for the output
+	int size;				// window length in frames (Hann window)
+	int hop;				// frames between analyses
+	int bins;				// size / 2 + 1
+	uint32_t frames;		// analyses completed
+	uint32_t onsets;		// onsets detected so far
+	uint32_t dropped;		// hops skipped because the analysis fell behind the ring
+	double time;			// audio clock time at the end of the latest window
+	float rms;				// of the (unwindowed) frames in the window
+	float flux;				// positive spectral flux: the summed increase in magnitude
+	float onset;			// 1 if the latest analysis detected an onset, else 0
+	float centroid;			// in Hz
+	float bands[AV_ANALYSIS_BANDS];			// in dB (0 is a full-scale sine), log-spaced from 40 Hz to Nyquist
+	float magnitude[AV_ANALYSIS_BINS_MAX];	// per bin, scaled so that a full-scale sine peaks near 1
+	float phase[AV_ANALYSIS_BINS_MAX];		// per bin, in radians
+} av_Analysis;
+
+// the state of the current (or last) recording:
+typedef struct av_AudioRecordInfo {
+	int recording;			// until the file has been completed
+	int channels;			// outputs, then inputs if they are recorded
+	double frames;			// frames written to disk so far
+	uint32_t dropped;		// blocks lost because the writer thread fell behind
+	int failed;				// the disk refused a write; nothing more is written
+} av_AudioRecordInfo;
 
 typedef struct av_Audio {
 	unsigned int blocksize;
@@ -83,9 +407,18 @@ typedef struct av_Audio {
 	
 	double time;		// in seconds
 	double samplerate;
-	double lag;			// in seconds
+	double lag;			// in seconds; how far ahead of time the main thread schedules messages
+	double latency;		// in seconds; length of the main-thread generation ring
+	double gcbudget;	// fraction of each block's spare time the audio Lua state may spend collecting garbage
+	// the rate to open the devices at (0 for samplerate, or the nearest rate they support);
+	// audio is resampled between it and samplerate at the device boundary:
+	double devicerate;
+	double hardwarerate;	// the rate the devices are running at
+	int resamplequality;	// AV_RESAMPLE_FAST, _MEDIUM or _BEST, for the devices and file streams
 	
-	av_msgbuffer msgbuffer;
+	av_msgqueue msgqueue;
+	av_VoicePool * voices;
+	av_AudioStats stats;
 	
 	// a big buffer for main-thread audio generation
 	float * buffer;
@@ -93,8 +426,25 @@ typedef struct av_Audio {
 	int blocks, blockread, blockwrite, blockstep;
 	
 	// only access from audio thread:
+	// planar processing buses, with channel c starting at input/output + c * busstride.
+	// devices and files are interleaved; conversion happens only at that boundary.
+	// (buses always have at least two channels)
 	float * input;
-	float * output;	
+	float * output;
+	int busstride;
+	// recent input, for the main thread (see av_audio_capture_read):
+	av_AudioCapture capture;
+	// recent output, mixed down to one channel (published after each block):
+	av_AudioCapture monitor;
+	
+	// a two-channel bus for Lua voices to render spatial voices into; 
+	// pass it to av_audio_ambi_encode() afterwards:
+	float * spatial;
+	// buses for Lua voices to crossfade kernels in: the old kernel renders into the first, 
+	// and the new into the second at fade + fadechannels * busstride.
+	// each has as many channels as output (at least two):
+	float * fade;
+	int fadechannels;
 	void (*onframes)(struct av_Audio * self, double sampletime, float * inputs, float * outputs, int frames);
 	
 } av_Audio;
@@ -104,6 +454,11 @@ AV_EXPORT av_Window * av_window_create();
 AV_EXPORT void av_window_setfullscreen(av_Window * self, int b);
 AV_EXPORT void av_window_settitle(av_Window * self, const char * name);
 AV_EXPORT void av_window_setdim(av_Window * self, int x, int y);
+AV_EXPORT void av_window_setvsync(av_Window * self, int b);
+// the events since the last call, oldest first, as a contiguous array (valid until the 
+// next frame). beyond AV_WINDOW_EVENTS_MAX per frame, mouse motion gives way to keys and 
+// buttons, and what still doesn't fit is dropped (and counted in events_dropped):
+AV_EXPORT av_WindowEvent * av_window_events(av_Window * self, int * count);
 
 // called to reset state before a script closes, e.g. removing callbacks:
 AV_EXPORT void av_state_reset(void * state);
@@ -113,6 +468,256 @@ AV_EXPORT av_Audio * av_audio_get();
 // only use from main thread:
 AV_EXPORT void av_audio_start(); 
 
+// only use from main thread:
+// reopens the stream with a new geometry, keeping voices, pending messages and the audio clock.
+// arguments of zero keep the current setting (except inchannels, where 0 means no input, 
+// and -1 keeps it); channel counts are limited to what the devices offer, and the device 
+// may adjust the blocksize. latency sets the length of the main-thread generation ring.
+// returns 1 on success; on failure the previous geometry is restored.
+AV_EXPORT int av_audio_reconfigure(double samplerate, int blocksize, int inchannels, int outchannels, double latency);
+
+// only use from main thread:
+// the number of input frames captured so far (modulo 2^32; about 27 hours at 44.1kHz):
+AV_EXPORT uint32_t av_audio_capture_count();
+// a pointer to frames contiguous samples of captured input channel, starting at frame start,
+// or NULL if they have not been captured yet or may already be overwritten.
+// the memory is read in place: check av_audio_capture_valid(start) again after using it.
+AV_EXPORT const float * av_audio_capture_read(int channel, uint32_t start, uint32_t frames);
+// whether frame start is still in the ring (not yet being overwritten):
+AV_EXPORT int av_audio_capture_valid(uint32_t start);
+// the audio clock time of a frame of a capture ring (input or monitor), which must be 
+// within 2^31 frames of its write position (any thread):
+AV_EXPORT double av_audio_capture_time(const av_AudioCapture * cap, uint32_t frame);
+
+// only use from main thread:
+// starts analysing input channel source (or the output, if source is -1) on the analysis 
+// thread, with windows of size frames (even, up to AV_ANALYSIS_SIZE_MAX) every hop frames.
+// returns NULL if the arguments are not supported or AV_ANALYSIS_MAX analyses are running.
+AV_EXPORT av_Analysis * av_audio_analysis_start(int source, int size, int hop);
+// the analysis is no longer updated after this returns:
+AV_EXPORT void av_audio_analysis_stop(av_Analysis * analysis);
+
+// only use from main thread:
+// records 32-bit float output (followed by the inputs, if input is non-zero) to path, as 
+// Wave64 (.w64), CAF (.caf) or otherwise WAV (RF64 beyond 4GB). returns 0 on failure.
+AV_EXPORT int av_audio_record_start(const char * path, int input);
+// the file is completed in the background:
+AV_EXPORT void av_audio_record_stop();
+// returns info->recording:
+AV_EXPORT int av_audio_record_info(av_AudioRecordInfo * info);
+
+// only use from main thread:
+// runs the audio callback as fast as possible, without a device, using the current
+// samplerate, blocksize and channel counts (input is silent). stops any running stream.
+// the interleaved output is written to a 32-bit float file at path, in the format its 
+// extension names as for av_audio_record_start (WAV, RF64 past 4GB), and/or copied 
+// into buffer (frames * outchannels floats); either may be NULL. 
+// returns the number of frames rendered, or -1 on error (e.g. the file could not be written).
+AV_EXPORT int av_audio_render(const char * path, float * buffer, int frames);
+
+// only use from main thread:
+// adds a native kernel (e.g. from a loaded library), returning its index, or 0 if full:
+AV_EXPORT int av_audio_kernel_register(av_voice_kernel kernel);
+// number of worker threads that render native kernels alongside the audio thread 
+// (0 renders everything on the audio thread). restarts a running stream.
+AV_EXPORT void av_audio_setworkers(int n);
+
+// only use from main thread:
+// fills the body of an AV_AUDIO_CMD_DECODER message with a decoder of the given order for 
+// speakers at the given directions (in degrees; azimuth counter-clockwise from the front, 
+// elevation up from the horizon). returns 0 if the layout is not supported.
+AV_EXPORT int av_ambi_decoder_design(av_msg_decoder * decoder, int order, int speakers, const double * azimuth, const double * elevation);
+
+// only use from audio thread:
+// encodes the sum of left and right (right may be NULL) for spatial voice id into the 
+// ambisonic bus, at the start of the current onframes segment:
+AV_EXPORT void av_audio_ambi_encode(int id, const float * left, const float * right, int frames);
+
+// only use from main thread:
+// opens a WAV or AIFF file for streaming playback by one AV_AUDIO_KERNEL_STREAM voice,
+// returning a stream id, or 0 on failure. send AV_AUDIO_CMD_STREAM_CLOSE (with the id)
+// to close it once no voice plays it.
+AV_EXPORT int av_audio_stream_open(const char * path, int loop);
+// returns 0 if the stream is not open:
+AV_EXPORT int av_audio_stream_info(int id, av_AudioStreamInfo * info);
+
+// only use from main thread:
+// reads a whole WAV or AIFF file into interleaved floats (release with av_audio_sound_free),
+// or returns NULL. info may be NULL.
+AV_EXPORT float * av_audio_sound_load(const char * path, av_AudioStreamInfo * info);
+AV_EXPORT void av_audio_sound_free(float * data);
+
+// only use from main thread:
+// fills the convolvers of an AV_AUDIO_CMD_REVERB message for outchannels outputs, from an 
+// interleaved impulse response of frames * irchannels samples (output c uses channel 
+// c % irchannels). returns 0 on failure, leaving channels = -1.
+AV_EXPORT int av_audio_reverb_design(av_msg_reverb * msg, const float * ir, int frames, int irchannels, int outchannels);
+
+// only use from main thread:
+// returns a free voice id, or 0 if all voices are in use.
+AV_EXPORT int av_audio_voice_alloc();
+// recycle an id after sending AV_AUDIO_CMD_VOICE_REMOVE (ids already free are ignored):
+AV_EXPORT void av_audio_voice_free(int id);
+// recycle all ids after sending AV_AUDIO_CMD_CLEAR:
+AV_EXPORT void av_audio_voice_freeall();
+
+// size is rounded up to a power of two:
+AV_EXPORT int av_msgqueue_init(av_msgqueue * q, uint32_t size);
+
+// producer (main thread) only:
+// returns a pointer to size bytes of message body, or NULL if the queue is full.
+// the audio thread applies the message at time t (with sample accuracy), 
+// or immediately if t has already passed. messages with equal times apply in the order sent;
+// a message for the future does not hold back the messages after it.
+AV_EXPORT void * av_msgqueue_reserve(av_msgqueue * q, uint32_t cmd, uint32_t size, double t);
+// makes all reserved messages visible to the consumer:
+AV_EXPORT void av_msgqueue_commit(av_msgqueue * q);
+
+// consumer (audio thread) only:
+// fills msgs with up to max committed messages due before time until, in time order; 
+// returns the count. messages due later are set aside in the deferred store for a later drain.
+// the messages remain valid until av_msgqueue_release().
+AV_EXPORT int av_msgqueue_drain(av_msgqueue * q, av_msg ** msgs, int max, double until);
+// hands all drained messages back to the producer:
+AV_EXPORT void av_msgqueue_release(av_msgqueue * q);
+
+// bytes committed but not yet released (safe from either thread):
+AV_EXPORT uint32_t av_msgqueue_used(av_msgqueue * q);
+
+// block unit generators. 
+// state lives in plain structs owned by the caller (e.g. ffi.new in a Lua voice, 
+// or a native kernel's own storage). each call processes frames samples, 
+// and may be used from any audio thread.
+
+// oscillators: phase in cycles [0, 1), incr in cycles per sample:
+typedef struct av_Osc {
+	double phase, incr;
+} av_Osc;
+
+AV_EXPORT void av_osc_setfreq(av_Osc * self, double freq, double samplerate);
+AV_EXPORT void av_osc_sine(av_Osc * self, float * out, int frames);
+// band-limited (polyBLEP) waveforms:
+AV_EXPORT void av_osc_saw(av_Osc * self, float * out, int frames);
+AV_EXPORT void av_osc_square(av_Osc * self, float * out, int frames);
+AV_EXPORT void av_osc_triangle(av_Osc * self, float * out, int frames);
+// linearly interpolated wavetable; size must be a power of two:
+AV_EXPORT void av_osc_table(av_Osc * self, const float * table, int size, float * out, int frames);
+
+enum {
+	AV_BIQUAD_LOWPASS,
+	AV_BIQUAD_HIGHPASS,
+	AV_BIQUAD_BANDPASS,
+	AV_BIQUAD_NOTCH,
+	AV_BIQUAD_PEAK,
+	AV_BIQUAD_LOWSHELF,
+	AV_BIQUAD_HIGHSHELF
+};
+
+typedef struct av_Biquad {
+	float b0, b1, b2, a1, a2;
+	float z1, z2;
+} av_Biquad;
+
+// gain (in dB) only applies to peak and shelf filters:
+AV_EXPORT void av_biquad_set(av_Biquad * self, int type, double freq, double q, double gain, double samplerate);
+// out may be the same as in:
+AV_EXPORT void av_biquad_process(av_Biquad * self, const float * in, float * out, int frames);
+
+// trapezoidal state-variable filter, stable under fast modulation:
+typedef struct av_SVF {
+	float k, a1, a2, a3;
+	float ic1, ic2;
+} av_SVF;
+
+AV_EXPORT void av_svf_set(av_SVF * self, double freq, double q, double samplerate);
+// any of the outputs may be NULL:
+AV_EXPORT void av_svf_process(av_SVF * self, const float * in, float * low, float * band, float * high, int frames);
+
+// linear ADSR envelope; times are stored in samples:
+typedef struct av_Env {
+	int stage;
+	float value, rate;
+	float attack, decay, sustain, release;
+} av_Env;
+
+AV_EXPORT void av_env_set(av_Env * self, double attack, double decay, double sustain, double release, double samplerate);
+AV_EXPORT void av_env_gate(av_Env * self, int on);
+// returns 0 once the envelope has finished releasing:
+AV_EXPORT int av_env_process(av_Env * self, float * out, int frames);
+
+// fractional delay line over a caller-provided buffer; size must be a power of two:
+typedef struct av_Delay {
+	float * buffer;
+	int size, write;
+} av_Delay;
+
+// delay is in samples (at least 1, less than size); out may be the same as in:
+AV_EXPORT void av_delay_process(av_Delay * self, const float * in, float * out, int frames, float delay, float feedback);
+
+typedef struct av_Noise {
+	uint32_t seed;
+	float pink[7];
+} av_Noise;
+
+AV_EXPORT void av_noise_white(av_Noise * self, float * out, int frames);
+AV_EXPORT void av_noise_pink(av_Noise * self, float * out, int frames);
+
+// block arithmetic:
+// out[i] *= in[i]
+AV_EXPORT void av_block_mul(float * out, const float * in, int frames);
+// out[i] *= gain
+AV_EXPORT void av_block_scale(float * out, float gain, int frames);
+// out[i] += in[i] * gain
+AV_EXPORT void av_block_mix(float * out, const float * in, float gain, int frames);
+// out[i] += in[i] * (gain ramping linearly from gain0 towards gain1)
+AV_EXPORT void av_block_mixramp(float * out, const float * in, float gain0, float gain1, int frames);
+
+// real FFT plans. sizes must be even, with size / 2 having no prime factor above 31 
+// (any power of two, or e.g. 3 * 2^k, 5 * 2^k); plans precompute their twiddles and hold
+// their own work arrays, so one plan should only be used by one thread at a time.
+typedef struct av_FFT av_FFT;
+
+// returns NULL if the size is not supported:
+AV_EXPORT av_FFT * av_fft_create(int size);
+AV_EXPORT void av_fft_destroy(av_FFT * self);
+AV_EXPORT int av_fft_size(const av_FFT * self);
+// size real samples to size / 2 + 1 complex bins (unnormalised):
+AV_EXPORT void av_fft_forward(av_FFT * self, const float * in, float * re, float * im);
+// size / 2 + 1 complex bins to size real samples, scaled so that it inverts av_fft_forward:
+AV_EXPORT void av_fft_inverse(av_FFT * self, const float * re, const float * im, float * out);
+
+enum {
+	AV_RESAMPLE_FAST,		// 16 taps
+	AV_RESAMPLE_MEDIUM,		// 32 taps
+	AV_RESAMPLE_BEST		// 64 taps
+};
+
+// sample rate conversion of interleaved frames, by any ratio (a polyphase Kaiser-windowed sinc).
+// returns NULL if the arguments are not supported.
+typedef struct av_Resampler av_Resampler;
+AV_EXPORT av_Resampler * av_resampler_create(double inrate, double outrate, int channels, int quality);
+AV_EXPORT void av_resampler_destroy(av_Resampler * self);
+// consumes all of the inframes (in may be NULL for silence), writing the output frames that 
+// are now complete into out; returns how many. out needs room for av_resampler_maxout(inframes).
+AV_EXPORT int av_resampler_process(av_Resampler * self, const float * in, int inframes, float * out);
+AV_EXPORT int av_resampler_maxout(av_Resampler * self, int inframes);
+// input frames of lookahead: process this many silent frames to flush the end of a signal:
+AV_EXPORT int av_resampler_latency(av_Resampler * self);
+AV_EXPORT void av_resampler_reset(av_Resampler * self);
+
+// FFT convolution with an impulse response of any length, in low-latency partitions
+// of the given size (even; a power of two is fastest). the head of the response is 
+// convolved in av_convolver_process, which adds no latency; the tail is convolved by a 
+// background thread. one channel of an interleaved response is used.
+// returns NULL if the arguments are not supported.
+AV_EXPORT av_Convolver * av_convolver_create(const float * ir, int frames, int channels, int channel, int partition);
+// may be called from any thread, once nothing will process it again:
+AV_EXPORT void av_convolver_destroy(av_Convolver * self);
+// one thread at a time (e.g. the audio thread); out may be the same as in:
+AV_EXPORT void av_convolver_process(av_Convolver * self, const float * in, float * out, int frames);
+// blocks for which the background thread was too late, so the tail was left out:
+AV_EXPORT uint32_t av_convolver_late(av_Convolver * self);
+
 // Stupid hack for clang CIndex module because of pass-by-value callback:
 typedef struct {
 	int kind;
@@ -44,6 +44,224 @@
 #endif
 
 
+// monotonic clock in seconds, for measuring intervals (unaffected by system clock changes):
+#if defined(AV_WINDOWS)
+	inline double av_monotonic_time() {
+		static double period = 0;
+		LARGE_INTEGER t;
+		if (period == 0) {
+			LARGE_INTEGER f;
+			QueryPerformanceFrequency(&f);
+			period = 1. / (double)f.QuadPart;
+		}
+		QueryPerformanceCounter(&t);
+		return t.QuadPart * period;
+	}
+#elif defined(AV_OSX)
+	#include <mach/mach_time.h>
+	inline double av_monotonic_time() {
+		static double period = 0;
+		if (period == 0) {
+			mach_timebase_info_data_t tb;
+			mach_timebase_info(&tb);
+			period = 1e-9 * tb.numer / tb.denom;
+		}
+		return mach_absolute_time() * period;
+	}
+#else
+	inline double av_monotonic_time() {
+		timespec t;
+		clock_gettime(CLOCK_MONOTONIC, &t);
+		return t.tv_sec + t.tv_nsec * 1e-9;
+	}
+#endif
+
+// acquire/release primitives for state shared with the audio thread:
+#ifdef AV_WINDOWS
+	#include <intrin.h>
+	template<typename T> inline T av_atomic_load_acquire(volatile T * p) {
+		T v = *p; 
+		_ReadWriteBarrier(); 
+		return v;
+	}
+	template<typename T> inline void av_atomic_store_release(volatile T * p, T v) {
+		_ReadWriteBarrier(); 
+		*p = v;
+	}
+	// sequentially consistent versions, for Dekker-style handshakes:
+	inline long av_atomic_load(volatile long * p) {
+		return InterlockedCompareExchange(p, 0, 0);
+	}
+	inline void av_atomic_store(volatile long * p, long v) {
+		InterlockedExchange(p, v);
+	}
+	inline long av_atomic_add(volatile long * p, long v) {
+		return InterlockedExchangeAdd(p, v) + v;
+	}
+	inline long av_atomic_exchange(volatile long * p, long v) {
+		return InterlockedExchange(p, v);
+	}
+	inline bool av_atomic_cas(volatile long * p, long expected, long desired) {
+		return InterlockedCompareExchange(p, desired, expected) == expected;
+	}
+	inline void av_atomic_fence() { MemoryBarrier(); }
+	inline void av_cpu_pause() { YieldProcessor(); }
+#else
+	template<typename T> inline T av_atomic_load_acquire(volatile T * p) {
+		return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+	}
+	template<typename T> inline void av_atomic_store_release(volatile T * p, T v) {
+		__atomic_store_n(p, v, __ATOMIC_RELEASE);
+	}
+	// sequentially consistent versions, for Dekker-style handshakes:
+	inline long av_atomic_load(volatile long * p) {
+		return __atomic_load_n(p, __ATOMIC_SEQ_CST);
+	}
+	inline void av_atomic_store(volatile long * p, long v) {
+		__atomic_store_n(p, v, __ATOMIC_SEQ_CST);
+	}
+	// returns the new value:
+	inline long av_atomic_add(volatile long * p, long v) {
+		return __atomic_add_fetch(p, v, __ATOMIC_SEQ_CST);
+	}
+	inline long av_atomic_exchange(volatile long * p, long v) {
+		return __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST);
+	}
+	inline bool av_atomic_cas(volatile long * p, long expected, long desired) {
+		return __atomic_compare_exchange_n(p, &expected, desired, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	}
+	inline void av_atomic_fence() { __atomic_thread_fence(__ATOMIC_SEQ_CST); }
+	#if defined(__i386__) || defined(__x86_64__)
+		inline void av_cpu_pause() { __builtin_ia32_pause(); }
+	#else
+		inline void av_cpu_pause() {}
+	#endif
+#endif
+
+// threads and semaphores, for helper threads that work alongside the audio thread:
+#if defined(AV_WINDOWS)
+	#define AV_THREAD_LOCAL __declspec(thread)
+#else
+	#define AV_THREAD_LOCAL __thread
+#endif
+#if defined(AV_WINDOWS)
+	#include <process.h>
+	typedef HANDLE av_thread;
+	typedef HANDLE av_semaphore;
+	struct av_thread_start { void * (*fn)(void *); void * arg; };
+	inline unsigned __stdcall av_thread_trampoline(void * p) {
+		av_thread_start s = *(av_thread_start *)p;
+		delete (av_thread_start *)p;
+		s.fn(s.arg);
+		return 0;
+	}
+	inline int av_thread_create(av_thread * t, void * (*fn)(void *), void * arg) {
+		av_thread_start * s = new av_thread_start;
+		s->fn = fn;
+		s->arg = arg;
+		*t = (HANDLE)_beginthreadex(NULL, 0, av_thread_trampoline, s, 0, NULL);
+		return *t ? 0 : -1;
+	}
+	inline void av_thread_join(av_thread t) { WaitForSingleObject(t, INFINITE); CloseHandle(t); }
+	inline av_thread av_thread_self() { return GetCurrentThread(); }
+	inline void av_thread_pin(av_thread t, int core) { SetThreadAffinityMask(t, (DWORD_PTR)1 << core); }
+	// give thread t the calling thread's priority:
+	inline void av_thread_match_priority(av_thread t) { SetThreadPriority(t, GetThreadPriority(GetCurrentThread())); }
+	inline void av_thread_yield() { SwitchToThread(); }
+	inline void av_semaphore_init(av_semaphore * s) { *s = CreateSemaphore(NULL, 0, 0x7fffffff, NULL); }
+	inline void av_semaphore_destroy(av_semaphore * s) { CloseHandle(*s); }
+	inline void av_semaphore_post(av_semaphore * s) { ReleaseSemaphore(*s, 1, NULL); }
+	inline void av_semaphore_wait(av_semaphore * s) { WaitForSingleObject(*s, INFINITE); }
+	inline int av_cpu_count() { SYSTEM_INFO si; GetSystemInfo(&si); return si.dwNumberOfProcessors; }
+#else
+	#include <pthread.h>
+	#include <sched.h>
+	typedef pthread_t av_thread;
+	inline int av_thread_create(av_thread * t, void * (*fn)(void *), void * arg) {
+		return pthread_create(t, NULL, fn, arg);
+	}
+	inline void av_thread_join(av_thread t) { pthread_join(t, NULL); }
+	inline av_thread av_thread_self() { return pthread_self(); }
+	inline void av_thread_yield() { sched_yield(); }
+	inline int av_cpu_count() { return (int)sysconf(_SC_NPROCESSORS_ONLN); }
+	#if defined(AV_OSX)
+		#include <mach/mach.h>
+		#include <mach/thread_policy.h>
+		typedef semaphore_t av_semaphore;
+		// OSX has no hard affinity; threads with different tags are kept on different cores:
+		inline void av_thread_pin(av_thread t, int core) {
+			thread_affinity_policy_data_t policy = { core + 1 };
+			thread_policy_set(pthread_mach_thread_np(t), THREAD_AFFINITY_POLICY, (thread_policy_t)&policy, THREAD_AFFINITY_POLICY_COUNT);
+		}
+		// give thread t the calling thread's priority (CoreAudio's IO thread is time-constrained):
+		inline void av_thread_match_priority(av_thread t) {
+			thread_time_constraint_policy_data_t policy;
+			mach_msg_type_number_t count = THREAD_TIME_CONSTRAINT_POLICY_COUNT;
+			boolean_t isdefault = FALSE;
+			if (thread_policy_get(pthread_mach_thread_np(pthread_self()), THREAD_TIME_CONSTRAINT_POLICY, (thread_policy_t)&policy, &count, &isdefault) == KERN_SUCCESS && !isdefault) {
+				thread_policy_set(pthread_mach_thread_np(t), THREAD_TIME_CONSTRAINT_POLICY, (thread_policy_t)&policy, THREAD_TIME_CONSTRAINT_POLICY_COUNT);
+			}
+			int sched;
+			struct sched_param param;
+			if (pthread_getschedparam(pthread_self(), &sched, &param) == 0) pthread_setschedparam(t, sched, &param);
+		}
+		inline void av_semaphore_init(av_semaphore * s) { semaphore_create(mach_task_self(), s, SYNC_POLICY_FIFO, 0); }
+		inline void av_semaphore_destroy(av_semaphore * s) { semaphore_destroy(mach_task_self(), *s); }
+		inline void av_semaphore_post(av_semaphore * s) { semaphore_signal(*s); }
+		inline void av_semaphore_wait(av_semaphore * s) { semaphore_wait(*s); }
+	#else
+		#include <semaphore.h>
+		typedef sem_t av_semaphore;
+		inline void av_thread_pin(av_thread t, int core) {
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			CPU_SET(core, &set);
+			pthread_setaffinity_np(t, sizeof(set), &set);
+		}
+		// give thread t the calling thread's scheduling policy and priority:
+		inline void av_thread_match_priority(av_thread t) {
+			int policy;
+			struct sched_param param;
+			if (pthread_getschedparam(pthread_self(), &policy, &param) == 0) pthread_setschedparam(t, policy, &param);
+		}
+		inline void av_semaphore_init(av_semaphore * s) { sem_init(s, 0, 0); }
+		inline void av_semaphore_destroy(av_semaphore * s) { sem_destroy(s); }
+		inline void av_semaphore_post(av_semaphore * s) { sem_post(s); }
+		inline void av_semaphore_wait(av_semaphore * s) { while (sem_wait(s) != 0) {} }
+	#endif
+#endif
+
+// cache-line aligned buffers for SIMD processing:
+#define AV_ALIGN 64
+#ifdef AV_WINDOWS
+	#include <malloc.h>
+	inline void * av_aligned_alloc(size_t size) { return _aligned_malloc(size, AV_ALIGN); }
+	inline void av_aligned_free(void * p) { _aligned_free(p); }
+#else
+	#include <stdlib.h>
+	inline void * av_aligned_alloc(size_t size) { 
+		void * p = 0;
+		return posix_memalign(&p, AV_ALIGN, size) ? 0 : p; 
+	}
+	inline void av_aligned_free(void * p) { free(p); }
+#endif
+
+// times the enclosing scope (see av_trace.cpp):
+struct av_TraceScope {
+	av_TraceScope(const char * name) { av_trace_begin(name); }
+	~av_TraceScope() { av_trace_end(); }
+};
+
+// offscreen rendering without a window (see av_headless.cpp); returns 0 on failure:
+int av_headless_create(int width, int height);
+int av_headless_resize(int width, int height);
+unsigned int av_headless_framebuffer();
+void av_headless_destroy();
+
+// generated by h2ffi.lua into av_ffi_header.cpp, which is built as part of av_host.cpp:
+extern const char * av_ffi_header;
+extern const char * av_main;
+
 extern "C" {
 	#include "lua.h"
 	#include "lualib.h"
@@ -52,6 +270,8 @@ extern "C" {
 	int luaopen_builtin(lua_State * L);
 	
 	lua_State * av_init_lua();
+	// as av_init_lua, but with a custom allocator; may return NULL:
+	lua_State * av_init_lua_alloc(lua_Alloc alloc, void * ud);
 }
 
 #endif // AV_HPP
\ No newline at end of file
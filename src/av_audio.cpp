@@ -1,9 +1,15 @@
-#include "av.hpp"
+#include "av_audio.hpp"
 //#include "portaudio.h"
 #include "RtAudio.h"
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <math.h>
 
-#define AV_AUDIO_MSGBUFFER_SIZE_DEFAULT (1024 * 1024)
+#define AV_AUDIO_MSGQUEUE_SIZE_DEFAULT (4 * 1024 * 1024)
+
+// messages are padded to keep bodies 8-byte aligned:
+#define AV_MSG_ALIGN(n) (((n) + 7) & ~7)
 
 // the FFI exposed object:
 static av_Audio audio;
@@ -11,100 +17,1268 @@ static av_Audio audio;
 // the internal object:
 static RtAudio rta;
 
-// the audio-thread Lua state:
+// the audio-thread Lua state, and its preallocated memory:
 static lua_State * AL = 0;
+static av_Arena * arena = 0;
 
-int av_rtaudio_callback(void *outputBuffer, 
-						void *inputBuffer, 
-						unsigned int frames,
-						double streamTime, 
-						RtAudioStreamStatus status, 
-						void *data) {
+#define AV_AUDIO_LUA_ARENA_SIZE (32 * 1024 * 1024)
+
+// voice storage (large, so not embedded in av_Audio):
+static av_VoicePool pool;
+
+// buses have at least two planes, so that stereo kernels work on mono devices:
+#define AV_AUDIO_BUSCHANNELS(n) ((n) < 2 ? 2 : (n))
+
+// messages are drained in batches of up to this many:
+#define AV_AUDIO_DRAIN_MAX 256
+
+// native kernels, and the voices using them in the current segment:
+static av_voice_kernel kernels[AV_AUDIO_KERNELS_MAX];
+static int nkernels = 0;
+static int nativeids[AV_AUDIO_VOICES_MAX];
+static int nativecount = 0;
+static unsigned int nativeframes = 0;
+
+// parallel rendering deals out this many voices per chunk:
+#define AV_AUDIO_CHUNK_VOICES 8
+#define AV_AUDIO_WORKERS_DEFAULT 4
+
+// one planar scratch bus per participant in parallel rendering:
+static float * scratch[AV_AUDIO_WORKERS_MAX + 1];
+static int scratch_used[AV_AUDIO_WORKERS_MAX + 1];
+
+// spatial voices are encoded into the ambisonic bus, and decoded at the end of each block.
+// each participant renders spatial voices into its own two-channel bus first, 
+// and encodes into its own ambisonic bus:
+static float * ambibus = 0;
+static int ambi_active = 0;
+static float * ambiscratch[AV_AUDIO_WORKERS_MAX + 1];
+static int ambiscratch_used[AV_AUDIO_WORKERS_MAX + 1];
+static float * spatialscratch[AV_AUDIO_WORKERS_MAX + 1];
+// start frame of the current segment:
+static unsigned int segment_start = 0;
+
+// convolution reverb on the output bus (AV_AUDIO_CMD_REVERB):
+static av_Convolver * reverb[AV_AUDIO_REVERB_CHANNELS_MAX];
+static int reverb_channels = 0;
+static float reverb_dry = 1.f, reverb_wet = 0.f;	// levels for the next block
+static float reverb_drynow = 1.f, reverb_wetnow = 0.f;	// levels at the end of the last block
+
+int av_msgqueue_init(av_msgqueue * q, uint32_t size) {
+	uint32_t pow2 = 64;
+	while (pow2 < size) pow2 <<= 1;
+	
+	memset(q, 0, sizeof(av_msgqueue));
+	q->data = (unsigned char *)calloc(pow2, 1);
+	q->deferred = (unsigned char *)calloc(pow2, 1);
+	if (!q->data || !q->deferred) return -1;
+	q->size = pow2;
+	q->mask = pow2 - 1;
+	return 0;
+}
+
+void * av_msgqueue_reserve(av_msgqueue * q, uint32_t cmd, uint32_t size, double t) {
+	uint32_t total = AV_MSG_ALIGN(sizeof(av_msg) + size);
+	uint32_t w = q->reserved;
+	uint32_t offset = w & q->mask;
+	uint32_t tail = q->size - offset;
+	
+	// a message that doesn't fit before the end of the buffer 
+	// must skip the tail and start again at the beginning:
+	uint32_t required = (tail < total) ? tail + total : total;
+	if (required > q->size) return NULL;
+	
+	// only touch the consumer's cache line if our cached view says we are full:
+	if (q->size - (w - q->readcache) < required) {
+		q->readcache = av_atomic_load_acquire(&q->read);
+		if (q->size - (w - q->readcache) < required) return NULL;
+	}
+	
+	if (tail < total) {
+		av_msg * skip = (av_msg *)(q->data + offset);
+		skip->cmd = AV_AUDIO_CMD_SKIP;
+		skip->size = tail - sizeof(av_msg);
+		skip->t = 0;
+		w += tail;
+		offset = 0;
+	}
+	
+	av_msg * m = (av_msg *)(q->data + offset);
+	m->cmd = cmd;
+	m->size = size;
+	m->t = t;
+	q->reserved = w + total;
+	return m + 1;
+}
+
+void av_msgqueue_commit(av_msgqueue * q) {
+	av_atomic_store_release(&q->write, q->reserved);
+}
+
+// copy a message due later into the deferred store, after any due no later than it.
+// returns 0 if the store is full:
+static int av_msgqueue_defer(av_msgqueue * q, av_msg * m) {
+	uint32_t total = AV_MSG_ALIGN(sizeof(av_msg) + m->size);
+	if (q->deferred_used + total > q->size) return 0;
+	// usually times increase, and it goes at the end:
+	uint32_t at = q->deferred_used;
+	if (q->deferred_used > q->deferred_taken && ((av_msg *)(q->deferred + q->deferred_last))->t > m->t) {
+		// (messages already drained are due before until, so they never move)
+		at = q->deferred_taken;
+		while (((av_msg *)(q->deferred + at))->t <= m->t) {
+			at += AV_MSG_ALIGN(sizeof(av_msg) + ((av_msg *)(q->deferred + at))->size);
+		}
+		memmove(q->deferred + at + total, q->deferred + at, q->deferred_used - at);
+		q->deferred_last += total;
+	} else {
+		q->deferred_last = at;
+	}
+	memcpy(q->deferred + at, m, total);
+	q->deferred_used += total;
+	return 1;
+}
+
+int av_msgqueue_drain(av_msgqueue * q, av_msg ** msgs, int max, double until) {
+	int n = 0;
+	// those set aside by earlier drains that are due now:
+	while (q->deferred_taken < q->deferred_used && n < max) {
+		av_msg * m = (av_msg *)(q->deferred + q->deferred_taken);
+		if (m->t >= until) break;
+		msgs[n++] = m;
+		q->deferred_taken += AV_MSG_ALIGN(sizeof(av_msg) + m->size);
+	}
+	uint32_t r = q->pending;
+	uint32_t w = av_atomic_load_acquire(&q->write);
+	while (r != w && n < max) {
+		av_msg * m = (av_msg *)(q->data + (r & q->mask));
+		if (m->cmd != AV_AUDIO_CMD_SKIP) {
+			if (m->t < until) {
+				msgs[n++] = m;
+			} else if (!av_msgqueue_defer(q, m)) {
+				// the store is full; leave this and all after it in the queue:
+				break;
+			}
+		}
+		r += AV_MSG_ALIGN(sizeof(av_msg) + m->size);
+	}
+	q->pending = r;
+	// merge into time order; stable, so that messages for the same time apply in the order sent:
+	for (int i = 1; i < n; i++) {
+		av_msg * m = msgs[i];
+		int j = i;
+		while (j > 0 && msgs[j-1]->t > m->t) {
+			msgs[j] = msgs[j-1];
+			j--;
+		}
+		msgs[j] = m;
+	}
+	return n;
+}
+
+void av_msgqueue_release(av_msgqueue * q) {
+	av_atomic_store_release(&q->read, q->pending);
+	// drop the deferred messages that were drained:
+	if (q->deferred_taken) {
+		uint32_t rest = q->deferred_used - q->deferred_taken;
+		memmove(q->deferred, q->deferred + q->deferred_taken, rest);
+		q->deferred_last = rest ? q->deferred_last - q->deferred_taken : 0;
+		q->deferred_used = rest;
+		q->deferred_taken = 0;
+	}
+}
+
+uint32_t av_msgqueue_used(av_msgqueue * q) {
+	return av_atomic_load_acquire(&q->write) - av_atomic_load_acquire(&q->read);
+}
+
+int av_audio_voice_alloc() {
+	if (pool.freecount <= 0) return 0;
+	int id = pool.freelist[--pool.freecount];
+	pool.allocated[id] = 1;
+	return id;
+}
+
+void av_audio_voice_free(int id) {
+	// ignore ids out of range, or already free:
+	if (id > 0 && id < pool.capacity && pool.allocated[id]) {
+		pool.allocated[id] = 0;
+		pool.freelist[pool.freecount++] = id;
+	}
+}
+
+void av_audio_voice_freeall() {
+	// hand out low ids first:
+	pool.freecount = 0;
+	for (int id = pool.capacity - 1; id > 0; id--) {
+		pool.allocated[id] = 0;
+		pool.freelist[pool.freecount++] = id;
+	}
+}
+
+int av_audio_kernel_register(av_voice_kernel kernel) {
+	if (nkernels >= AV_AUDIO_KERNELS_MAX) return 0;
+	kernels[nkernels] = kernel;
+	return nkernels++;
+}
+
+static void av_kernel_sine(av_VoicePool * pool, int id, float * out, int stride, int channels, int frames) {
+	double freq = pool->param[0][id];
+	double amp = pool->param[1][id];
+	double pan = pool->param[2][id];
+	double phase = pool->param[3][id];
+	double incr = freq / pool->samplerate;
+	const double twopi = 6.283185307179586;
+	float l = (float)(amp * (1. - pan));
+	float r = (float)(amp * pan);
+	float * outl = out;
+	float * outr = out + stride;
+	// ramping parameters change per frame:
+	double dincr = pool->slope[0][id] / pool->samplerate;
+	float damp = pool->slope[1][id], dpan = pool->slope[2][id];
+	float dl = (float)(damp * (1. - pan) - amp * dpan);
+	float dr = (float)(damp * pan + amp * dpan);
+	for (int i = 0; i < frames; i++) {
+		float v = (float)sin(phase * twopi);
+		outl[i] += l * v;
+		outr[i] += r * v;
+		phase += incr;
+		if (phase >= 1.) phase -= 1.;
+		incr += dincr;
+		l += dl;
+		r += dr;
+	}
+	pool->param[3][id] = phase;
+}
+
+// audio thread only:
+static void voice_activate(int id) {
+	if (pool.next[id] >= 0) return;	// already active
+	// append before the sentinel:
+	int last = pool.prev[0];
+	pool.next[last] = id;
+	pool.prev[id] = last;
+	pool.next[id] = 0;
+	pool.prev[0] = id;
+	pool.serial[id]++;
+	av_ramp_cancel(&pool, id);
+	pool.kernel[id] = AV_AUDIO_KERNEL_NONE;
+	pool.spatial[id] = 0;
+	for (int a = 0; a < 3; a++) pool.position[a][id] = 0;
+	for (int p = 0; p < AV_AUDIO_VOICE_PARAMS; p++) {
+		pool.param[p][id] = 0;
+	}
+	pool.count++;
+}
+
+static void voice_deactivate(int id) {
+	if (pool.next[id] < 0) return;	// not active
+	av_ramp_cancel(&pool, id);
+	pool.next[pool.prev[id]] = pool.next[id];
+	pool.prev[pool.next[id]] = pool.prev[id];
+	pool.next[id] = pool.prev[id] = -1;
+	pool.count--;
+}
+
+static void voice_pool_init() {
+	pool.capacity = AV_AUDIO_VOICES_MAX;
+	pool.params = AV_AUDIO_VOICE_PARAMS;
+	pool.count = 0;
+	pool.next[0] = pool.prev[0] = 0;
+	for (int id = 1; id < pool.capacity; id++) {
+		pool.next[id] = pool.prev[id] = -1;
+		pool.serial[id] = 0;
+		pool.kernel[id] = AV_AUDIO_KERNEL_NONE;
+		pool.spatial[id] = 0;
+	}
+	av_audio_voice_freeall();
+	av_ramp_clear(&pool);
+	
+	nkernels = 0;
+	av_audio_kernel_register(0);	// AV_AUDIO_KERNEL_NONE
+	av_audio_kernel_register(av_kernel_sine);
+	av_audio_kernel_register(av_kernel_stream);
+}
+
+// messages the native side doesn't understand are passed to Lua's handlemessage():
+static void av_audio_lua_message(av_msg * m) {
+	lua_getglobal(AL, "handlemessage");
+	lua_pushinteger(AL, m->cmd);
+	lua_pushlightuserdata(AL, m + 1);
+	if (lua_pcall(AL, 2, 0, 0)) {
+		printf("error: %s\n", lua_tostring(AL, -1));
+		lua_pop(AL, 1);
+	}
+}
+
+// load precompiled voice code without parsing it on the audio thread,
+// and hand the chunk to Lua's installcode(chunk, fade):
+static void av_audio_lua_bytecode(av_msg * m) {
+	av_msg_bytecode * b = (av_msg_bytecode *)(m + 1);
+	if (sizeof(av_msg_bytecode) + b->size > m->size) return;
+	if (luaL_loadbuffer(AL, (const char *)(b + 1), b->size, "=voice")) {
+		printf("error: %s\n", lua_tostring(AL, -1));
+		lua_pop(AL, 1);
+		return;
+	}
+	lua_getglobal(AL, "installcode");
+	lua_insert(AL, -2);
+	lua_pushnumber(AL, b->fade);
+	if (lua_pcall(AL, 2, 0, 0)) {
+		printf("error: %s\n", lua_tostring(AL, -1));
+		lua_pop(AL, 1);
+	}
+}
+
+static void av_audio_handlemessage(av_msg * m) {
+	switch (m->cmd) {
+		case AV_AUDIO_CMD_VOICE_ADD: {
+			int id = *(int *)(m + 1);
+			if (id > 0 && id < pool.capacity) voice_activate(id);
+		} break;
+		case AV_AUDIO_CMD_VOICE_REMOVE: {
+			int id = *(int *)(m + 1);
+			if (id > 0 && id < pool.capacity) voice_deactivate(id);
+		} break;
+		case AV_AUDIO_CMD_VOICE_PARAM: {
+			av_msg_param * p = (av_msg_param *)(m + 1);
+			if (p->id > 0 && p->id < pool.capacity && p->pid >= 0 && p->pid < AV_AUDIO_VOICE_PARAMS) {
+				av_ramp_set(&pool, p->id, p->pid, p->value, 0., AV_AUDIO_RAMP_LINEAR);
+			}
+		} break;
+		case AV_AUDIO_CMD_PARAMS: {
+			av_msg_params * h = (av_msg_params *)(m + 1);
+			const av_param_ramp * r = (const av_param_ramp *)(h + 1);
+			if (sizeof(av_msg_params) + h->count * sizeof(av_param_ramp) > m->size) break;
+			for (int i = 0; i < h->count; i++) {
+				if (r[i].id > 0 && r[i].id < pool.capacity && r[i].pid >= 0 && r[i].pid < AV_AUDIO_VOICE_PARAMS) {
+					av_ramp_set(&pool, r[i].id, r[i].pid, r[i].value, r[i].time * audio.samplerate, r[i].shape);
+				}
+			}
+		} break;
+		case AV_AUDIO_CMD_VOICE_KERNEL: {
+			av_msg_kernel * k = (av_msg_kernel *)(m + 1);
+			if (k->id > 0 && k->id < pool.capacity && k->kernel >= 0 && k->kernel < nkernels) {
+				pool.kernel[k->id] = k->kernel;
+			}
+		} break;
+		case AV_AUDIO_CMD_VOICE_POSITION: {
+			av_msg_position * p = (av_msg_position *)(m + 1);
+			if (p->id > 0 && p->id < pool.capacity) {
+				for (int a = 0; a < 3; a++) pool.position[a][p->id] = p->pos[a];
+				// a voice becoming spatial starts at its new position:
+				if (p->spatial && !pool.spatial[p->id]) av_ambi_voice_reset(p->id);
+				pool.spatial[p->id] = p->spatial;
+			}
+		} break;
+		case AV_AUDIO_CMD_LISTENER: {
+			av_ambi_set_listener((av_msg_listener *)(m + 1));
+		} break;
+		case AV_AUDIO_CMD_DECODER: {
+			av_ambi_set_decoder((av_msg_decoder *)(m + 1));
+		} break;
+		case AV_AUDIO_CMD_VOICE_BYTECODE: {
+			av_audio_lua_bytecode(m);
+		} break;
+		case AV_AUDIO_CMD_REVERB: {
+			av_msg_reverb * r = (av_msg_reverb *)(m + 1);
+			if (r->channels >= 0) {
+				for (int c = 0; c < reverb_channels; c++) av_convolver_destroy(reverb[c]);
+				reverb_channels = r->channels < AV_AUDIO_REVERB_CHANNELS_MAX ? r->channels : AV_AUDIO_REVERB_CHANNELS_MAX;
+				for (int c = 0; c < reverb_channels; c++) reverb[c] = r->convolver[c];
+			}
+			reverb_dry = r->dry;
+			reverb_wet = r->wet;
+		} break;
+		case AV_AUDIO_CMD_STREAM_CLOSE: {
+			av_audio_stream_close(*(int *)(m + 1));
+		} break;
+		case AV_AUDIO_CMD_CLEAR: {
+			while (pool.next[0] != 0) voice_deactivate(pool.next[0]);
+			av_audio_lua_message(m);
+		} break;
+		default:
+			av_audio_lua_message(m);
+	}
+}
+
+// planar (channel c at src + c*stride) to interleaved:
+static void av_audio_interleave(float * dst, const float * src, int stride, int channels, int frames) {
+	int c = 0;
+	int i = 0;
+	#ifdef AV_AUDIO_SSE
+	if (channels == 2) {
+		const float * l = src;
+		const float * r = src + stride;
+		for (; i + 4 <= frames; i += 4) {
+			__m128 a = _mm_loadu_ps(l + i);
+			__m128 b = _mm_loadu_ps(r + i);
+			_mm_storeu_ps(dst + i*2, _mm_unpacklo_ps(a, b));
+			_mm_storeu_ps(dst + i*2 + 4, _mm_unpackhi_ps(a, b));
+		}
+		for (; i < frames; i++) {
+			dst[i*2] = l[i];
+			dst[i*2+1] = r[i];
+		}
+		return;
+	}
+	// transpose groups of four channels at a time:
+	for (; c + 4 <= channels; c += 4) {
+		const float * s0 = src + c * stride;
+		const float * s1 = s0 + stride;
+		const float * s2 = s1 + stride;
+		const float * s3 = s2 + stride;
+		for (i = 0; i + 4 <= frames; i += 4) {
+			__m128 a = _mm_loadu_ps(s0 + i);
+			__m128 b = _mm_loadu_ps(s1 + i);
+			__m128 d = _mm_loadu_ps(s2 + i);
+			__m128 e = _mm_loadu_ps(s3 + i);
+			_MM_TRANSPOSE4_PS(a, b, d, e);
+			float * out = dst + i * channels + c;
+			_mm_storeu_ps(out, a);
+			_mm_storeu_ps(out + channels, b);
+			_mm_storeu_ps(out + channels*2, d);
+			_mm_storeu_ps(out + channels*3, e);
+		}
+		for (; i < frames; i++) {
+			float * out = dst + i * channels + c;
+			out[0] = s0[i];
+			out[1] = s1[i];
+			out[2] = s2[i];
+			out[3] = s3[i];
+		}
+	}
+	#endif
+	// remaining channels:
+	for (; c < channels; c++) {
+		const float * in = src + c * stride;
+		for (i = 0; i < frames; i++) {
+			dst[i * channels + c] = in[i];
+		}
+	}
+}
+
+// interleaved to planar (channel c at dst + c*stride):
+static void av_audio_deinterleave(float * dst, int stride, const float * src, int channels, int frames) {
+	int c = 0;
+	int i = 0;
+	#ifdef AV_AUDIO_SSE
+	if (channels == 2) {
+		float * l = dst;
+		float * r = dst + stride;
+		for (; i + 4 <= frames; i += 4) {
+			__m128 a = _mm_loadu_ps(src + i*2);
+			__m128 b = _mm_loadu_ps(src + i*2 + 4);
+			_mm_storeu_ps(l + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+			_mm_storeu_ps(r + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+		}
+		for (; i < frames; i++) {
+			l[i] = src[i*2];
+			r[i] = src[i*2+1];
+		}
+		return;
+	}
+	for (; c + 4 <= channels; c += 4) {
+		float * d0 = dst + c * stride;
+		float * d1 = d0 + stride;
+		float * d2 = d1 + stride;
+		float * d3 = d2 + stride;
+		for (i = 0; i + 4 <= frames; i += 4) {
+			const float * in = src + i * channels + c;
+			__m128 a = _mm_loadu_ps(in);
+			__m128 b = _mm_loadu_ps(in + channels);
+			__m128 d = _mm_loadu_ps(in + channels*2);
+			__m128 e = _mm_loadu_ps(in + channels*3);
+			_MM_TRANSPOSE4_PS(a, b, d, e);
+			_mm_storeu_ps(d0 + i, a);
+			_mm_storeu_ps(d1 + i, b);
+			_mm_storeu_ps(d2 + i, d);
+			_mm_storeu_ps(d3 + i, e);
+		}
+		for (; i < frames; i++) {
+			const float * in = src + i * channels + c;
+			d0[i] = in[0];
+			d1[i] = in[1];
+			d2[i] = in[2];
+			d3[i] = in[3];
+		}
+	}
+	#endif
+	for (; c < channels; c++) {
+		float * out = dst + c * stride;
+		for (i = 0; i < frames; i++) {
+			out[i] = src[i * channels + c];
+		}
+	}
+}
+
+static size_t av_audio_lua_bytes() {
+	if (arena) return arena->allocated;
+	// without the arena, approximate by heap growth:
+	return lua_gc(AL, LUA_GCCOUNT, 0) * 1024 + lua_gc(AL, LUA_GCCOUNTB, 0);
+}
+
+// the audio Lua state's collector is stopped; instead it is stepped incrementally 
+// after each block, for as long as the block's spare time allows.
+// like Lua's own pause, a new cycle only starts once the heap has doubled:
+static int gc_running = 0;
+static int gc_threshold_kb = 0;
+
+static double av_audio_gc(double t0, double period, size_t allocated) {
+	double t1 = av_monotonic_time();
+	if (!gc_running) {
+		if (lua_gc(AL, LUA_GCCOUNT, 0) < gc_threshold_kb) return 0;
+		gc_running = 1;
+	}
+	// whatever the budget, pay for what the block allocated,
+	// so that blocks without spare time can't outrun the collector:
+	// (returns 1 at the end of a cycle)
+	int done = lua_gc(AL, LUA_GCSTEP, (int)(allocated >> 10));
+	double deadline = t1 + (period - (t1 - t0)) * audio.gcbudget;
+	while (!done && av_monotonic_time() < deadline) {
+		done = lua_gc(AL, LUA_GCSTEP, 0);
+	}
+	if (done) {
+		gc_running = 0;
+		gc_threshold_kb = lua_gc(AL, LUA_GCCOUNT, 0) * 2;
+	}
+	// stepping re-arms the automatic collector; keep it out of the callback:
+	lua_gc(AL, LUA_GCSTOP, 0);
+	return av_monotonic_time() - t1;
+}
+
+static void av_audio_stats_update(av_AudioStats& stats, double elapsed, double period, uint32_t queue_used) {
+	if (stats.reset) {
+		memset(&stats, 0, sizeof(av_AudioStats));
+	}
+	double load = elapsed / period;
+	stats.callbacks++;
+	stats.block_time = elapsed;
+	if (elapsed > stats.block_max) stats.block_max = elapsed;
+	stats.load = load;
+	stats.load_avg += 0.05 * (load - stats.load_avg);
+	stats.queue_used = queue_used;
+	if (queue_used > stats.queue_max) stats.queue_max = queue_used;
+	int bin = (int)(load * (AV_AUDIO_STATS_BINS / 2));
+	if (bin >= AV_AUDIO_STATS_BINS) bin = AV_AUDIO_STATS_BINS - 1;
+	stats.histogram[bin]++;
+}
+
+// render a native spatial voice in two channels, and encode their sum:
+static void av_audio_render_spatial(int id, float * tmp, float * ambi, int frames) {
+	memset(tmp, 0, sizeof(float) * frames);
+	memset(tmp + audio.busstride, 0, sizeof(float) * frames);
+	(kernels[pool.kernel[id]])(&pool, id, tmp, audio.busstride, 2, frames);
+	av_ambi_encode(&pool, id, tmp, tmp + audio.busstride, frames, ambi, audio.busstride);
+}
+
+static void av_audio_render_chunk(void * ud, int chunk, int participant) {
+	int channels = AV_AUDIO_BUSCHANNELS(audio.outchannels);
+	float * bus = scratch[participant];
+	float * ambi = ambiscratch[participant];
+	int first = chunk * AV_AUDIO_CHUNK_VOICES;
+	int last = first + AV_AUDIO_CHUNK_VOICES;
+	if (last > nativecount) last = nativecount;
+	for (int i = first; i < last; i++) {
+		int id = nativeids[i];
+		if (pool.spatial[id]) {
+			if (!ambiscratch_used[participant]) {
+				memset(ambi, 0, sizeof(float) * audio.busstride * AV_AMBI_CHANNELS_MAX);
+				ambiscratch_used[participant] = 1;
+			}
+			av_audio_render_spatial(id, spatialscratch[participant], ambi, nativeframes);
+		} else {
+			if (!scratch_used[participant]) {
+				memset(bus, 0, sizeof(float) * audio.busstride * channels);
+				scratch_used[participant] = 1;
+			}
+			(kernels[pool.kernel[id]])(&pool, id, bus, audio.busstride, channels, nativeframes);
+		}
+	}
+}
+
+static void av_audio_mix(float * dst, const float * src, int channels, unsigned int frames) {
+	for (int c = 0; c < channels; c++) {
+		const float * s = src + c * audio.busstride;
+		float * d = dst + c * audio.busstride;
+		for (unsigned int i = 0; i < frames; i++) d[i] += s[i];
+	}
+}
+
+// render the voices with native kernels, spread over the worker threads:
+static void av_audio_render_native(unsigned int start, unsigned int frames) {
+	nativecount = 0;
+	for (int id = pool.next[0]; id != 0; id = pool.next[id]) {
+		if (pool.kernel[id]) nativeids[nativecount++] = id;
+	}
+	if (nativecount == 0) return;
+	
+	int channels = AV_AUDIO_BUSCHANNELS(audio.outchannels);
+	int chunks = (nativecount + AV_AUDIO_CHUNK_VOICES - 1) / AV_AUDIO_CHUNK_VOICES;
+	if (av_audio_workers_count() == 0 || chunks < 2) {
+		// not worth distributing:
+		for (int i = 0; i < nativecount; i++) {
+			int id = nativeids[i];
+			if (pool.spatial[id]) {
+				av_audio_render_spatial(id, spatialscratch[0], ambibus + start, frames);
+				ambi_active = 1;
+			} else {
+				(kernels[pool.kernel[id]])(&pool, id, audio.output + start, audio.busstride, channels, frames);
+			}
+		}
+		return;
+	}
+	
+	nativeframes = frames;
+	memset(scratch_used, 0, sizeof(scratch_used));
+	memset(ambiscratch_used, 0, sizeof(ambiscratch_used));
+	av_audio_parallel(av_audio_render_chunk, 0, chunks);
+	
+	// mix down the scratch buses:
+	for (int p = 0; p <= AV_AUDIO_WORKERS_MAX; p++) {
+		if (scratch_used[p]) av_audio_mix(audio.output + start, scratch[p], channels, frames);
+		if (ambiscratch_used[p]) {
+			av_audio_mix(ambibus + start, ambiscratch[p], av_ambi_channels(), frames);
+			ambi_active = 1;
+		}
+	}
+}
+
+void av_audio_ambi_encode(int id, const float * left, const float * right, int frames) {
+	if (id <= 0 || id >= pool.capacity || !pool.spatial[id]) return;
+	if (segment_start + frames > audio.frames) return;
+	av_ambi_encode(&pool, id, left, right, frames, ambibus + segment_start, audio.busstride);
+	ambi_active = 1;
+}
+
+// copy the first channels of a planar bus into a mirrored capture ring, then publish them.
+// end is the audio clock time just after the block:
+static void av_audio_capture_write(av_AudioCapture& cap, const float * bus, unsigned int frames, double end) {
+	if (!cap.data) return;
+	uint32_t write = cap.write;
+	uint32_t index = write & (cap.frames - 1);
+	// the part before the end of the first copy is mirrored after it, the rest before it:
+	uint32_t first = frames < cap.frames - index ? frames : cap.frames - index;
+	for (unsigned int c = 0; c < cap.channels; c++) {
+		const float * src = bus + c * audio.busstride;
+		float * dst = cap.data + c * 2 * cap.frames;
+		memcpy(dst + index, src, sizeof(float) * frames);
+		memcpy(dst + index + cap.frames, src, sizeof(float) * first);
+		memcpy(dst, src + first, sizeof(float) * (frames - first));
+	}
+	cap.time = end;
+	av_atomic_store_release(&cap.write, write + frames);
+}
+
+// the output bus mixed down to one channel, into the monitor ring:
+static void av_audio_monitor_write(unsigned int frames, double end) {
+	if (!audio.monitor.data) return;
+	float * mix = audio.spatial;	// free again once the block has been rendered
+	memcpy(mix, audio.output, sizeof(float) * frames);
+	for (unsigned int c = 1; c < audio.outchannels; c++) {
+		av_block_mix(mix, audio.output + c * audio.busstride, 1.f, frames);
+	}
+	if (audio.outchannels > 1) av_block_scale(mix, 1.f / audio.outchannels, frames);
+	av_audio_capture_write(audio.monitor, mix, frames, end);
+}
+
+uint32_t av_audio_capture_count() {
+	return av_atomic_load_acquire(&audio.capture.write);
+}
+
+int av_audio_capture_valid(uint32_t start) {
+	av_AudioCapture& cap = audio.capture;
+	// the block being captured next may overwrite the oldest blocksize frames:
+	return av_atomic_load_acquire(&cap.write) - start <= cap.frames - audio.blocksize;
+}
+
+double av_audio_capture_time(const av_AudioCapture * cap, uint32_t frame) {
+	// (the time that belongs to the write position is read between two reads of it that agree;
+	// timing by the wrapped difference from there survives the counter wrapping)
+	for (;;) {
+		uint32_t write = av_atomic_load_acquire(&cap->write);
+		double t = cap->time;
+		av_atomic_fence();
+		if (av_atomic_load_acquire(&cap->write) == write) {
+			return t - (int32_t)(write - frame) / audio.samplerate;
+		}
+	}
+}
+
+const float * av_audio_capture_read(int channel, uint32_t start, uint32_t frames) {
+	av_AudioCapture& cap = audio.capture;
+	if (!cap.data || channel < 0 || (uint32_t)channel >= cap.channels) return 0;
+	uint32_t write = av_atomic_load_acquire(&cap.write);
+	uint32_t age = write - start;
+	if (frames > age || age > cap.frames - audio.blocksize) return 0;
+	return cap.data + channel * 2 * cap.frames + (start & (cap.frames - 1));
+}
+
+// replace the output with its mix with the reverb, ramping the levels over the block:
+static void av_audio_reverb(unsigned int frames) {
+	float * wet = audio.spatial;	// free again once the block has been rendered
+	int channels = reverb_channels < (int)audio.outchannels ? reverb_channels : (int)audio.outchannels;
+	float d0 = reverb_drynow, w0 = reverb_wetnow;
+	float dd = (reverb_dry - d0) / frames, dw = (reverb_wet - w0) / frames;
+	for (int c = 0; c < channels; c++) {
+		float * out = audio.output + c * audio.busstride;
+		av_convolver_process(reverb[c], out, wet, frames);
+		for (unsigned int i = 0; i < frames; i++) {
+			out[i] = (d0 + dd * i) * out[i] + (w0 + dw * i) * wet[i];
+		}
+	}
+	reverb_drynow = reverb_dry;
+	reverb_wetnow = reverb_wet;
+}
+
+int av_audio_reverb_design(av_msg_reverb * msg, const float * ir, int frames, int irchannels, int outchannels) {
+	msg->channels = -1;
+	if (!ir || frames < 1 || irchannels < 1 || outchannels < 0 || outchannels > AV_AUDIO_REVERB_CHANNELS_MAX) return 0;
+	// partitions of a block or more cost one transform pair per callback:
+	int partition = 64;
+	while (partition < (int)audio.blocksize && partition < 4096) partition <<= 1;
+	for (int c = 0; c < outchannels; c++) {
+		msg->convolver[c] = av_convolver_create(ir, frames, irchannels, c % irchannels, partition);
+		if (!msg->convolver[c]) {
+			while (c-- > 0) av_convolver_destroy(msg->convolver[c]);
+			return 0;
+		}
+	}
+	msg->channels = outchannels;
+	return 1;
+}
+
+// render part of the current block, from frame start up to frame end:
+static void av_audio_process_segment(unsigned int start, unsigned int end) {
+	if (end <= start) return;
+	segment_start = start;
+	av_ramp_begin(&pool, end - start);
+	av_audio_render_native(start, end - start);
+	
+	// this calls back into Lua via FFI:
+	if (audio.onframes && end > start) {
+		(audio.onframes)(&audio, 
+			audio.time + start / audio.samplerate, 
+			audio.input + start, 
+			audio.output + start, 
+			end - start);
+	}
+	av_ramp_end(&pool);
+}
+
+// the shared processing path of all audio drivers.
+// input and output are the driver's interleaved buffers.
+static void av_audio_process(float * input, float * output, unsigned int frames) {
+	av_trace_thread("audio");
+	av_TraceScope scope("audio block");
+	
+	double t0 = av_monotonic_time();
+	uint32_t queue_used = av_msgqueue_used(&audio.msgqueue);
+	size_t lua_bytes = av_audio_lua_bytes();
 	
-	audio.input = (float *)inputBuffer;
-	audio.output = (float *)outputBuffer;
 	audio.frames = frames;
 	
 	double newtime = audio.time + frames / audio.samplerate;
 	
-	size_t size = sizeof(float) * frames;
-	
-	// zero outbuffers:
-	//memset(outputBuffer, 0, size);
+	if (input) {
+		av_audio_deinterleave(audio.input, audio.busstride, input, audio.inchannels, frames);
+	} else {
+		memset(audio.input, 0, sizeof(float) * audio.busstride * AV_AUDIO_BUSCHANNELS(audio.inchannels));
+	}
+	av_audio_capture_write(audio.capture, audio.input, frames, newtime);
 	
-	// copy in the buffers:
-	float * dst = audio.output;
-	float * src = audio.buffer + audio.blockread * audio.blocksize * audio.outchannels;
-	memcpy(dst, src, size * audio.outchannels);
+	// start the output bus with the main-thread generated block:
+	float * src = audio.buffer + audio.blockread * audio.blockstep;
+	memset(audio.output, 0, sizeof(float) * audio.busstride * AV_AUDIO_BUSCHANNELS(audio.outchannels));
+	av_audio_deinterleave(audio.output, audio.busstride, src, audio.outchannels, frames);
 	// advance the read head:
 	audio.blockread++;
 	if (audio.blockread >= audio.blocks) audio.blockread = 0;
 	
-	// this calls back into Lua via FFI:
-	if (audio.onframes) {
-		(audio.onframes)(&audio, newtime, audio.input, audio.output, frames);
+	// apply messages due in this block at their sample offsets,
+	// splitting the block at each message boundary:
+	av_trace_begin("render");
+	av_msg * msgs[AV_AUDIO_DRAIN_MAX];
+	unsigned int pos = 0;
+	int n;
+	do {
+		n = av_msgqueue_drain(&audio.msgqueue, msgs, AV_AUDIO_DRAIN_MAX, newtime);
+		for (int i=0; i<n; i++) {
+			av_msg * m = msgs[i];
+			// nearest frame; late messages are applied as soon as possible:
+			double offset = (m->t - audio.time) * audio.samplerate + 0.5;
+			if (offset < 0) audio.stats.late++;
+			if (offset >= pos + 1) {
+				unsigned int end = offset < frames ? (unsigned int)offset : frames;
+				av_audio_process_segment(pos, end);
+				pos = end;
+			}
+			av_audio_handlemessage(m);
+		}
+	} while (n == AV_AUDIO_DRAIN_MAX);
+	av_msgqueue_release(&audio.msgqueue);
+	
+	av_audio_process_segment(pos, frames);
+	av_trace_end();
+	
+	if (ambi_active) {
+		av_ambi_decode(ambibus, audio.busstride, audio.output, audio.busstride, audio.outchannels, frames);
+		memset(ambibus, 0, sizeof(float) * audio.busstride * AV_AMBI_CHANNELS_MAX);
+		ambi_active = 0;
+	}
+	if (reverb_channels) {
+		av_TraceScope scope("reverb");
+		av_audio_reverb(frames);
 	}
 	
+	av_audio_monitor_write(frames, newtime);
+	av_audio_analysis_notify();
+	av_audio_interleave(output, audio.output, audio.busstride, audio.outchannels, frames);
+	av_audio_record_write(&audio, frames);
+	
 	audio.time = newtime;
 	
+	av_AudioStats& stats = audio.stats;
+	double period = frames / audio.samplerate;
+	size_t allocated = av_audio_lua_bytes() - lua_bytes;
+	av_trace_begin("gc");
+	stats.gc_time = av_audio_gc(t0, period, allocated);
+	av_trace_end();
+	av_audio_stats_update(stats, av_monotonic_time() - t0, period, queue_used);
+	stats.lua_alloc = (uint32_t)allocated;
+	if (stats.lua_alloc > stats.lua_alloc_max) stats.lua_alloc_max = stats.lua_alloc;
+	stats.lua_kb = lua_gc(AL, LUA_GCCOUNT, 0);
+	stats.stream_underruns += av_audio_stream_underruns();
+	if (arena) stats.lua_fallbacks = arena->fallbacks;
+}
+
+// when the devices run at another rate, the callback resamples at the boundary:
+// input is converted into a FIFO at samplerate, whole blocks are processed from it,
+// and their output is converted into a FIFO at the device rate. (interleaved frames)
+static av_Resampler * boundary_in = 0, * boundary_out = 0;
+static float * boundary_infifo = 0, * boundary_outfifo = 0, * boundary_block = 0;
+static int boundary_infill = 0, boundary_outfill = 0, boundary_incap = 0;
+
+static void av_audio_boundary_free() {
+	av_resampler_destroy(boundary_in);
+	av_resampler_destroy(boundary_out);
+	free(boundary_infifo);
+	free(boundary_outfifo);
+	free(boundary_block);
+	boundary_in = boundary_out = 0;
+	boundary_infifo = boundary_outfifo = boundary_block = 0;
+}
+
+// main thread, while no stream is running; devframes is the most the device asks for at once:
+static void av_audio_boundary_create(double rate, unsigned int devframes) {
+	av_audio_boundary_free();
+	if (rate == audio.samplerate) return;
+	int blocksize = audio.blocksize;
+	boundary_out = av_resampler_create(audio.samplerate, rate, audio.outchannels, audio.resamplequality);
+	if (!boundary_out) return;
+	boundary_outfifo = (float *)malloc(sizeof(float) * (devframes + av_resampler_maxout(boundary_out, blocksize)) * audio.outchannels);
+	boundary_block = (float *)malloc(sizeof(float) * blocksize * audio.outchannels);
+	boundary_outfill = 0;
+	if (audio.inchannels) {
+		boundary_in = av_resampler_create(rate, audio.samplerate, audio.inchannels, audio.resamplequality);
+		boundary_incap = av_resampler_maxout(boundary_in, devframes) + 2 * blocksize;
+		boundary_infifo = (float *)malloc(sizeof(float) * boundary_incap * audio.inchannels);
+		boundary_infill = 0;
+	}
+}
+
+static void av_audio_process_boundary(const float * input, float * output, unsigned int frames) {
+	const int blocksize = audio.blocksize;
+	const int inchannels = audio.inchannels, outchannels = audio.outchannels;
+	if (boundary_in && input) {
+		int n = av_resampler_maxout(boundary_in, frames);
+		if (boundary_infill + n > boundary_incap) {
+			// the device delivered more input than was consumed: lose the oldest
+			int drop = boundary_infill + n - boundary_incap;
+			if (drop > boundary_infill) drop = boundary_infill;
+			memmove(boundary_infifo, boundary_infifo + drop * inchannels, sizeof(float) * (boundary_infill - drop) * inchannels);
+			boundary_infill -= drop;
+			audio.stats.overflows++;
+		}
+		boundary_infill += av_resampler_process(boundary_in, input, frames, boundary_infifo + boundary_infill * inchannels);
+	}
+	while (boundary_outfill < (int)frames) {
+		// until enough input has been converted, the block's input is silent:
+		float * in = boundary_in && boundary_infill >= blocksize ? boundary_infifo : 0;
+		av_audio_process(in, boundary_block, blocksize);
+		if (in) {
+			boundary_infill -= blocksize;
+			memmove(boundary_infifo, boundary_infifo + blocksize * inchannels, sizeof(float) * boundary_infill * inchannels);
+		}
+		boundary_outfill += av_resampler_process(boundary_out, boundary_block, blocksize, boundary_outfifo + boundary_outfill * outchannels);
+	}
+	memcpy(output, boundary_outfifo, sizeof(float) * frames * outchannels);
+	boundary_outfill -= frames;
+	memmove(boundary_outfifo, boundary_outfifo + frames * outchannels, sizeof(float) * boundary_outfill * outchannels);
+}
+
+int av_rtaudio_callback(void *outputBuffer, 
+						void *inputBuffer, 
+						unsigned int frames,
+						double streamTime, 
+						RtAudioStreamStatus status, 
+						void *data) {
+	av_audio_workers_attach();
+	if (status & RTAUDIO_OUTPUT_UNDERFLOW) audio.stats.underflows++;
+	if (status & RTAUDIO_INPUT_OVERFLOW) audio.stats.overflows++;
+	if (boundary_out) {
+		av_audio_process_boundary((const float *)inputBuffer, (float *)outputBuffer, frames);
+	} else {
+		av_audio_process((float *)inputBuffer, (float *)outputBuffer, frames);
+	}
 	return 0;
 }
 
-void av_audio_start() {
+static void av_audio_closestream() {
 	if (rta.isStreamRunning()) {
 		rta.stopStream();
 	}
 	if (rta.isStreamOpen()) {
-		// close it:
 		rta.closeStream();
-	}	
+	}
+	// the callback thread is gone:
+	av_trace_retire("audio");
+}
+
+// everything sized by the stream geometry. a complete new set is built before the old
+// one is swapped out and released, so a failed reconfiguration never leaves half a geometry.
+struct av_AudioBuffers {
+	float * input, * output, * spatial, * fade, * ambibus, * buffer;
+	av_AudioCapture capture, monitor;
+	float * scratch[AV_AUDIO_WORKERS_MAX + 1];
+	float * ambiscratch[AV_AUDIO_WORKERS_MAX + 1];
+	float * spatialscratch[AV_AUDIO_WORKERS_MAX + 1];
+	int busstride, fadechannels, blocks, blockstep;
+};
+
+static float * av_audio_bus(int stride, int channels) {
+	float * bus = (float *)av_aligned_alloc(sizeof(float) * stride * channels);
+	memset(bus, 0, sizeof(float) * stride * channels);
+	return bus;
+}
+
+static void av_audio_buffers_create(av_AudioBuffers& b) {
+	// planes are padded to whole cache lines:
+	int stride = (audio.blocksize + 15) & ~15;
+	int outchannels = AV_AUDIO_BUSCHANNELS(audio.outchannels);
+	b.busstride = stride;
+	b.input = av_audio_bus(stride, AV_AUDIO_BUSCHANNELS(audio.inchannels));
+	b.output = av_audio_bus(stride, outchannels);
+	b.spatial = av_audio_bus(stride, 2);
+	b.fade = av_audio_bus(stride, 2 * outchannels);
+	b.fadechannels = outchannels;
+	b.ambibus = av_audio_bus(stride, AV_AMBI_CHANNELS_MAX);
+	for (int p = 0; p <= AV_AUDIO_WORKERS_MAX; p++) {
+		b.scratch[p] = av_audio_bus(stride, outchannels);
+		b.ambiscratch[p] = av_audio_bus(stride, AV_AMBI_CHANNELS_MAX);
+		b.spatialscratch[p] = av_audio_bus(stride, 2);
+	}
 	
-	unsigned int devices = rta.getDeviceCount();
-	if (devices < 1) {
-		printf("No audio devices found\n");
-		return;
+	// the main-thread generation ring holds latency seconds (at least two blocks):
+	int blocks = (int)ceil(audio.latency * audio.samplerate / audio.blocksize);
+	b.blocks = (blocks < 1 ? 1 : blocks) + 1;
+	b.blockstep = audio.blocksize * audio.outchannels;
+	b.buffer = (float *)calloc(b.blockstep * b.blocks, sizeof(float));
+	
+	// a few seconds of input, mirrored:
+	av_AudioCapture& cap = b.capture;
+	cap.channels = audio.inchannels < AV_AUDIO_CAPTURE_CHANNELS_MAX ? audio.inchannels : AV_AUDIO_CAPTURE_CHANNELS_MAX;
+	cap.frames = 1;
+	while (cap.frames < AV_AUDIO_CAPTURE_SECONDS * audio.samplerate) cap.frames <<= 1;
+	cap.data = cap.channels ? av_audio_bus(2 * cap.frames, cap.channels) : 0;
+	cap.write = 0;
+	cap.time = audio.time;
+	// and of the output mix:
+	b.monitor = cap;
+	b.monitor.channels = 1;
+	b.monitor.data = av_audio_bus(2 * cap.frames, 1);
+}
+
+static void av_audio_buffers_free(av_AudioBuffers& b) {
+	av_aligned_free(b.input);
+	av_aligned_free(b.output);
+	av_aligned_free(b.spatial);
+	av_aligned_free(b.fade);
+	av_aligned_free(b.ambibus);
+	for (int p = 0; p <= AV_AUDIO_WORKERS_MAX; p++) {
+		av_aligned_free(b.scratch[p]);
+		av_aligned_free(b.ambiscratch[p]);
+		av_aligned_free(b.spatialscratch[p]);
+	}
+	free(b.buffer);
+	av_aligned_free(b.capture.data);
+	av_aligned_free(b.monitor.data);
+	memset(&b, 0, sizeof(b));
+}
+
+// exchange b with the buffers in use:
+static void av_audio_buffers_swap(av_AudioBuffers& b) {
+	av_AudioBuffers old;
+	old.input = audio.input;
+	old.output = audio.output;
+	old.spatial = audio.spatial;
+	old.fade = audio.fade;
+	old.fadechannels = audio.fadechannels;
+	old.ambibus = ambibus;
+	old.buffer = audio.buffer;
+	old.capture = audio.capture;
+	old.monitor = audio.monitor;
+	old.busstride = audio.busstride;
+	old.blocks = audio.blocks;
+	old.blockstep = audio.blockstep;
+	for (int p = 0; p <= AV_AUDIO_WORKERS_MAX; p++) {
+		old.scratch[p] = scratch[p];
+		old.ambiscratch[p] = ambiscratch[p];
+		old.spatialscratch[p] = spatialscratch[p];
 	}
 	
-	RtAudio::DeviceInfo info;
-	RtAudio::StreamParameters iParams, oParams;
+	audio.input = b.input;
+	audio.output = b.output;
+	audio.spatial = b.spatial;
+	audio.fade = b.fade;
+	audio.fadechannels = b.fadechannels;
+	ambibus = b.ambibus;
+	audio.buffer = b.buffer;
+	audio.capture = b.capture;
+	audio.monitor = b.monitor;
+	audio.busstride = b.busstride;
+	audio.blocks = b.blocks;
+	audio.blockstep = b.blockstep;
+	for (int p = 0; p <= AV_AUDIO_WORKERS_MAX; p++) {
+		scratch[p] = b.scratch[p];
+		ambiscratch[p] = b.ambiscratch[p];
+		spatialscratch[p] = b.spatialscratch[p];
+	}
+	b = old;
+}
+
+// (re)allocate the main-thread generation ring and the processing buses for the current geometry.
+// never call while a stream is running.
+static void av_audio_allocbuffer() {
+	av_AudioBuffers b;
+	av_audio_buffers_create(b);
+	// the analysis thread reads the capture rings:
+	av_audio_analysis_suspend();
+	av_audio_buffers_swap(b);
+	av_audio_analysis_resume();
+	av_audio_buffers_free(b);
 	
-	printf("Available audio devices:\n");
-	for (unsigned int i=0; i<devices; i++) {
-		info = rta.getDeviceInfo(i);
-		printf("Device %d: %dx%d (%d) %s\n", i, info.inputChannels, info.outputChannels, info.duplexChannels, info.name.c_str());
+	ambi_active = 0;
+	audio.blockread = 0;
+	audio.blockwrite = 0;
+	av_ambi_init(audio.outchannels);
+	pool.samplerate = audio.samplerate;
+}
+
+// the offline driver's buffers (device-free input is silence):
+static float * null_input = 0;
+static float * null_output = 0;
+
+void av_audio_null_begin() {
+	// the device and the offline driver cannot share the callback path:
+	av_audio_closestream();
+	av_audio_allocbuffer();
+	null_input = (float *)calloc(audio.blocksize * AV_AUDIO_BUSCHANNELS(audio.inchannels), sizeof(float));
+	null_output = (float *)calloc(audio.blocksize * audio.outchannels, sizeof(float));
+}
+
+const float * av_audio_null_process(unsigned int frames) {
+	if (frames > audio.blocksize) frames = audio.blocksize;
+	av_audio_process(null_input, null_output, frames);
+	return null_output;
+}
+
+void av_audio_null_end() {
+	free(null_input);
+	free(null_output);
+	null_input = 0;
+	null_output = 0;
+}
+
+int av_audio_render(const char * path, float * buffer, int frames) {
+	FILE * file = 0;
+	if (path) {
+		file = fopen(path, "wb");
+		if (!file) {
+			fprintf(stderr, "could not open %s for writing\n", path);
+			return -1;
+		}
+	}
+	av_audio_null_begin();
+	// (the same writer as recordings, so that long renders get 64-bit sizes)
+	uint64_t bytes = 0;
+	int failed = file && !av_audio_file_header(file, path, audio.outchannels, audio.samplerate, 0);
+	
+	double t0 = av_time();
+	int done = 0;
+	while (done < frames) {
+		unsigned int n = audio.blocksize;
+		if (n > (unsigned int)(frames - done)) n = frames - done;
+		const float * output = av_audio_null_process(n);
+		if (buffer) {
+			memcpy(buffer + done * audio.outchannels, output, n * audio.outchannels * sizeof(float));
+		}
+		if (file && !failed) {
+			size_t count = n * audio.outchannels;
+			if (fwrite(output, sizeof(float), count, file) == count) {
+				bytes += count * sizeof(float);
+			} else {
+				failed = 1;
+			}
+		}
+		done += n;
 	}
+	double elapsed = av_time() - t0;
 	
+	if (file) {
+		int header = failed ? 0 : av_audio_file_header(file, path, audio.outchannels, audio.samplerate, bytes);
+		fclose(file);
+		if (!header) {
+			fprintf(stderr, "error writing %s\n", path);
+			failed = 1;
+		} else if (header == 2) {
+			printf("%s passed 4GB, so it was written as RF64\n", path);
+		}
+	}
+	av_audio_null_end();
+	
+	double seconds = done / audio.samplerate;
+	printf("rendered %.3fs of audio in %.3fs (%.1fx realtime)\n", seconds, elapsed, elapsed > 0 ? seconds / elapsed : 0.);
+	return failed ? -1 : done;
+}
+
+// open and start the current devices with up to the requested channel counts, 
+// at the current samplerate and blocksize (which the device may adjust).
+static bool av_audio_openstream(unsigned int inchannels, unsigned int outchannels) {
+	av_audio_closestream();
+	
+	RtAudio::DeviceInfo info;
+	RtAudio::StreamParameters iParams, oParams;
 	
 	info = rta.getDeviceInfo(audio.indevice);
 	printf("Using audio input %d: %dx%d (%d) %s\n", audio.indevice, info.inputChannels, info.outputChannels, info.duplexChannels, info.name.c_str());
-	
-	audio.inchannels = info.inputChannels;
+	if (inchannels > info.inputChannels) inchannels = info.inputChannels;
 	
 	iParams.deviceId = audio.indevice;
-	iParams.nChannels = audio.inchannels;
+	iParams.nChannels = inchannels;
 	iParams.firstChannel = 0;
 	
 	info = rta.getDeviceInfo(audio.outdevice);
 	printf("Using audio output %d: %dx%d (%d) %s\n", audio.outdevice, info.inputChannels, info.outputChannels, info.duplexChannels, info.name.c_str());
-	
-	audio.outchannels = info.outputChannels;
+	if (outchannels > info.outputChannels) outchannels = info.outputChannels;
 	
 	oParams.deviceId = audio.outdevice;
-	oParams.nChannels = audio.outchannels;
+	oParams.nChannels = outchannels;
 	oParams.firstChannel = 0;
 
+	// the device stays interleaved; av_audio_process converts to and from the planar buses:
 	RtAudio::StreamOptions options;
-	//options.flags |= RTAUDIO_NONINTERLEAVED;
 	options.streamName = "av";
 	
+	// a rate the output device supports, if samplerate is not one:
+	double rate = audio.devicerate > 0 ? audio.devicerate : audio.samplerate;
+	if (audio.devicerate <= 0 && !info.sampleRates.empty()) {
+		double nearest = info.sampleRates[0];
+		for (size_t i = 0; i < info.sampleRates.size(); i++) {
+			if (fabs(info.sampleRates[i] - audio.samplerate) < fabs(nearest - audio.samplerate)) nearest = info.sampleRates[i];
+		}
+		rate = nearest;
+	}
+	
+	// at another rate, device buffers last about as long as a block:
+	unsigned int blocksize = rate == audio.samplerate ? audio.blocksize : (unsigned int)ceil(audio.blocksize * rate / audio.samplerate);
+	try {
+		rta.openStream( &oParams, inchannels ? &iParams : NULL, RTAUDIO_FLOAT32, (unsigned int)rate, &blocksize, &av_rtaudio_callback, NULL, &options );
+	}
+	catch ( RtError& e ) {
+		fprintf(stderr, "%s\n", e.getMessage().c_str());
+		return false;
+	}
+	
+	// the device may have changed the blocksize (which is only the block size if the 
+	// rates match); nothing is running now, so the buffers can be replaced:
+	audio.inchannels = inchannels;
+	audio.outchannels = outchannels;
+	if (rate == audio.samplerate) audio.blocksize = blocksize;
+	audio.hardwarerate = rate;
+	av_audio_allocbuffer();
+	av_audio_boundary_create(rate, blocksize);
+	
 	try {
-		rta.openStream( &oParams, &iParams, RTAUDIO_FLOAT32, audio.samplerate, &audio.blocksize, &av_rtaudio_callback, NULL, &options );
 		rta.startStream();
-		printf("Audio started\n");
 	}
 	catch ( RtError& e ) {
 		fprintf(stderr, "%s\n", e.getMessage().c_str());
+		rta.closeStream();
+		return false;
+	}
+	printf("Audio started: %.0fHz, %d frames, %dx%d channels\n", audio.samplerate, audio.blocksize, audio.inchannels, audio.outchannels);
+	if (boundary_out) printf("Audio devices running at %.0fHz, resampled\n", rate);
+	return true;
+}
+
+void av_audio_start() {
+	av_audio_closestream();
+	
+	unsigned int devices = rta.getDeviceCount();
+	if (devices < 1) {
+		printf("No audio devices found\n");
+		return;
+	}
+	
+	RtAudio::DeviceInfo info;
+	printf("Available audio devices:\n");
+	for (unsigned int i=0; i<devices; i++) {
+		info = rta.getDeviceInfo(i);
+		printf("Device %d: %dx%d (%d) %s\n", i, info.inputChannels, info.outputChannels, info.duplexChannels, info.name.c_str());
+	}
+	
+	// use all of the devices' channels:
+	av_audio_openstream(rta.getDeviceInfo(audio.indevice).inputChannels, rta.getDeviceInfo(audio.outdevice).outputChannels);
+}
+
+int av_audio_reconfigure(double samplerate, int blocksize, int inchannels, int outchannels, double latency) {
+	double oldsamplerate = audio.samplerate;
+	unsigned int oldblocksize = audio.blocksize;
+	unsigned int oldinchannels = audio.inchannels;
+	unsigned int oldoutchannels = audio.outchannels;
+	double oldlatency = audio.latency;
+	
+	if (samplerate > 0) audio.samplerate = samplerate;
+	if (blocksize > 0) audio.blocksize = blocksize;
+	if (latency > 0) audio.latency = latency;
+	if (inchannels < 0) inchannels = oldinchannels;
+	if (outchannels <= 0) outchannels = oldoutchannels;
+	
+	if (rta.getDeviceCount() == 0) {
+		// nothing to open; the new geometry applies to offline rendering:
+		av_audio_closestream();
+		audio.inchannels = inchannels;
+		audio.outchannels = outchannels;
+		av_audio_allocbuffer();
+		return 1;
 	}
+	if (av_audio_openstream(inchannels, outchannels)) return 1;
+	
+	// fall back to the previous geometry:
+	printf("unable to reconfigure audio, restoring the previous settings\n");
+	audio.samplerate = oldsamplerate;
+	audio.blocksize = oldblocksize;
+	audio.latency = oldlatency;
+	av_audio_openstream(oldinchannels, oldoutchannels);
+	return 0;
+}
+
+void av_audio_setworkers(int n) {
+	// the workers may only change while the callback is not running:
+	bool running = rta.isStreamRunning();
+	if (running) rta.stopStream();
+	av_audio_workers_start(n);
+	if (running) rta.startStream();
 }
 
 av_Audio * av_audio_get() {
@@ -121,31 +1295,52 @@ av_Audio * av_audio_get() {
 		audio.outchannels = 2;
 		audio.time = 0;
 		audio.lag = 0.04;
+		audio.latency = 1.;
 		audio.indevice = rta.getDefaultInputDevice();
 		audio.outdevice = rta.getDefaultOutputDevice();
-		audio.msgbuffer.size = AV_AUDIO_MSGBUFFER_SIZE_DEFAULT;
-		audio.msgbuffer.read = 0;
-		audio.msgbuffer.write = 0;
-		audio.msgbuffer.data = (unsigned char *)malloc(audio.msgbuffer.size);
+		av_msgqueue_init(&audio.msgqueue, AV_AUDIO_MSGQUEUE_SIZE_DEFAULT);
+		voice_pool_init();
+		audio.voices = &pool;
+		
+		int cores = av_cpu_count();
+		av_audio_workers_start(cores > AV_AUDIO_WORKERS_DEFAULT ? AV_AUDIO_WORKERS_DEFAULT : cores - 1);
 		
 		audio.onframes = 0;
+		memset(&audio.stats, 0, sizeof(av_AudioStats));
 		
-		// one second of ringbuffer:
-		int blockspersecond = audio.samplerate / audio.blocksize;
-		audio.blocks = blockspersecond + 1;
-		audio.blockstep = audio.blocksize * audio.outchannels;
-		int len = audio.blockstep * audio.blocks;
-		audio.buffer = (float *)calloc(len, sizeof(float));
-		audio.blockread = 0;
-		audio.blockwrite = 0;
+		audio.buffer = 0;
+		audio.input = 0;
+		audio.output = 0;
+		av_audio_allocbuffer();
 		
-		AL = av_init_lua();
+		audio.gcbudget = 0.5;
+		audio.devicerate = 0;
+		audio.hardwarerate = audio.samplerate;
+		audio.resamplequality = AV_RESAMPLE_MEDIUM;
+		
+		// the arena is only touched once the Lua state has accepted it:
+		arena = av_arena_create(AV_AUDIO_LUA_ARENA_SIZE);
+		AL = arena ? av_init_lua_alloc(av_arena_lua_alloc, arena) : 0;
+		if (AL) {
+			av_arena_prefault(arena);
+		} else {
+			// e.g. LuaJIT x64, which only supports its own allocator:
+			printf("audio Lua state is using the default allocator\n");
+			if (arena) {
+				av_arena_destroy(arena);
+				arena = 0;
+			}
+			AL = av_init_lua();
+		}
 		
 		// unique to audio thread:
 		if (luaL_dostring(AL, "require 'audioprocess'")) {
 			printf("error: %s\n", lua_tostring(AL, -1));
 			initialized = false;
 		} 
+		
+		// from now on, garbage is only collected in the time left over after each block:
+		lua_gc(AL, LUA_GCSTOP, 0);
 	}
 	return &audio;
 }
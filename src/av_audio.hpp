@@ -0,0 +1,124 @@
+#ifndef AV_AUDIO_HPP
+#define AV_AUDIO_HPP
+
+// internal declarations shared by the audio translation units (not part of the FFI header)
+
+#include "av.hpp"
+
+#include <stdio.h>
+
+#if defined(__SSE__) || defined(_M_X64)
+	#include <xmmintrin.h>
+	#define AV_AUDIO_SSE 1
+#endif
+
+// a preallocated pool for the audio-thread Lua state, so that it never calls malloc/free
+// from the audio callback. small blocks come from segregated size-class free lists carved 
+// out of one arena; requests the arena cannot serve fall back to the system allocator 
+// (and are counted).
+#define AV_ARENA_CLASSES 39
+
+struct av_Arena {
+	char * base;
+	size_t size;
+	size_t top;
+	void * freelists[AV_ARENA_CLASSES];
+	
+	// counters (only touched by the thread that owns the Lua state):
+	size_t allocated;	// total bytes handed out
+	size_t live;		// bytes currently in use
+	uint32_t fallbacks;	// allocations served by the system allocator
+};
+
+// the arena's pages are only reserved; prefault touches those not yet handed out, 
+// so that the audio thread never faults them in (call once the arena is known to be used):
+av_Arena * av_arena_create(size_t size);
+void av_arena_prefault(av_Arena * a);
+void av_arena_destroy(av_Arena * a);
+void * av_arena_lua_alloc(void * ud, void * ptr, size_t osize, size_t nsize);
+
+// a fork-join pool of pinned worker threads that help the audio thread finish a block.
+// the audio thread (participant 0) deals chunks of work round-robin onto per-participant
+// deques, wakes the workers, and works alongside them; participants pop their own deque
+// and steal from the others when it runs dry. workers spin briefly between blocks, then park.
+#define AV_AUDIO_WORKERS_MAX 15
+#define AV_AUDIO_CHUNKS_MAX 1024
+
+typedef void (*av_audio_job)(void * ud, int chunk, int participant);
+
+// main thread only (stream stopped); n = 0 renders everything on the audio thread:
+void av_audio_workers_start(int n);
+int av_audio_workers_count();
+// device callback thread only (not offline rendering, which runs on the main thread): 
+// gives the workers the calling thread's priority, and pins it to the core they leave free:
+void av_audio_workers_attach();
+// audio thread only; returns when all chunks have been run:
+void av_audio_parallel(av_audio_job job, void * ud, int chunks);
+
+// higher-order ambisonics (ACN channel order, SN3D normalisation) for spatial voices.
+// voices are encoded into a planar ambisonic bus, which is decoded to the speakers once per block.
+
+// main thread only (stream stopped); installs a horizontal ring decoder for the outputs
+// unless a decoder has been sent:
+void av_ambi_init(int outchannels);
+// audio thread only:
+void av_ambi_set_decoder(const av_msg_decoder * decoder);
+void av_ambi_set_listener(const av_msg_listener * listener);
+// number of ambisonic channels the current decoder uses:
+int av_ambi_channels();
+// the next encode of voice id starts at its current direction (no gain ramp):
+void av_ambi_voice_reset(int id);
+// adds the sum of left and right (right may be NULL) for voice id into the ambisonic bus, 
+// ramping from the voice's previous direction to its current position. 
+// voices may be encoded concurrently on different threads, into different buses.
+void av_ambi_encode(const av_VoicePool * pool, int id, const float * left, const float * right, int frames, float * bus, int stride);
+// adds the decoded ambisonic bus into the planar output bus:
+void av_ambi_decode(const float * bus, int stride, float * out, int outstride, int outchannels, int frames);
+
+// native parameter ramps (AV_AUDIO_CMD_PARAMS); audio thread only.
+// set moves param[pid][id] to value over frames (immediately if frames < 1);
+// begin computes every ramp's slope for a segment of frames, and end advances them past it:
+void av_ramp_set(av_VoicePool * pool, int id, int pid, double value, double frames, int shape);
+void av_ramp_begin(av_VoicePool * pool, int frames);
+void av_ramp_end(av_VoicePool * pool);
+// stops the ramps of voice id, where they are:
+void av_ramp_cancel(av_VoicePool * pool, int id);
+void av_ramp_clear(av_VoicePool * pool);
+
+// streaming sound file playback. a background I/O thread decodes WAV/AIFF files into 
+// per-stream rings of float frames, so the audio thread never touches the filesystem.
+#define AV_AUDIO_STREAM_FRAMES 32768	// ring capacity (a power of two)
+#define AV_AUDIO_STREAM_CHUNK 4096		// frames per file read
+#define AV_AUDIO_STREAM_CHANNELS_MAX 64
+
+// the AV_AUDIO_KERNEL_STREAM native kernel:
+void av_kernel_stream(av_VoicePool * pool, int id, float * out, int stride, int channels, int frames);
+// audio thread only (AV_AUDIO_CMD_STREAM_CLOSE):
+void av_audio_stream_close(int id);
+// audio thread only; returns and clears the count of ring underruns:
+uint32_t av_audio_stream_underruns();
+
+// the offline driver behind av_audio_render, one block at a time (main thread only).
+// begin stops any stream and allocates buffers for the current geometry; process runs the
+// callback for up to blocksize frames of silent input, returning the interleaved output.
+void av_audio_null_begin();
+const float * av_audio_null_process(unsigned int frames);
+void av_audio_null_end();
+
+// spectral analysis (av_audio_analysis_start) on a helper thread that reads the capture 
+// and monitor rings in place.
+// audio thread only; wakes the analysis thread if any analysis is running:
+void av_audio_analysis_notify();
+// main thread only; suspend returns once the analysis thread has stopped reading the rings, 
+// and resume restarts the analyses on the current rings:
+void av_audio_analysis_suspend();
+void av_audio_analysis_resume();
+
+// disk recording (av_audio_record_start); audio thread only, after the block is complete:
+void av_audio_record_write(const av_Audio * audio, unsigned int frames);
+// (re)writes the header of a sound file of bytes of interleaved float data, leaving f at its end;
+// the format follows the extension of path as for recordings (WAV, which is RF64 past 4GB, .w64 or .caf).
+// returns 0 on failure, 2 if the data needed 64-bit sizes, else 1:
+int av_audio_file_header(FILE * f, const char * path, int channels, double samplerate, uint64_t bytes);
+
+#endif // AV_AUDIO_HPP
@@ -0,0 +1,111 @@
+#include "av_audio.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// size classes: 16-byte steps up to 512 bytes, then powers of two up to 64k:
+#define AV_ARENA_SMALL_MAX 512
+#define AV_ARENA_LARGE_MAX 65536
+
+static int arena_class(size_t n) {
+	if (n <= AV_ARENA_SMALL_MAX) return n ? (int)((n + 15) >> 4) - 1 : 0;
+	if (n > AV_ARENA_LARGE_MAX) return -1;
+	int c = AV_ARENA_SMALL_MAX / 16;
+	size_t size = 1024;
+	while (size < n) {
+		size <<= 1;
+		c++;
+	}
+	return c;
+}
+
+static size_t arena_classsize(int c) {
+	if (c < AV_ARENA_SMALL_MAX / 16) return (c + 1) * 16;
+	return (size_t)1024 << (c - AV_ARENA_SMALL_MAX / 16);
+}
+
+av_Arena * av_arena_create(size_t size) {
+	av_Arena * a = (av_Arena *)calloc(1, sizeof(av_Arena));
+	a->base = (char *)av_aligned_alloc(size);
+	if (!a->base) {
+		free(a);
+		return 0;
+	}
+	a->size = size;
+	return a;
+}
+
+void av_arena_prefault(av_Arena * a) {
+	// (blocks are carved from the bottom up, so everything above top is still unused)
+	memset(a->base + a->top, 0, a->size - a->top);
+}
+
+void av_arena_destroy(av_Arena * a) {
+	av_aligned_free(a->base);
+	free(a);
+}
+
+static inline bool arena_owns(av_Arena * a, void * ptr) {
+	return (char *)ptr >= a->base && (char *)ptr < a->base + a->size;
+}
+
+static void * arena_alloc(av_Arena * a, size_t n) {
+	int c = arena_class(n);
+	if (c >= 0) {
+		size_t size = arena_classsize(c);
+		void * p = a->freelists[c];
+		if (p) {
+			a->freelists[c] = *(void **)p;
+		} else if (a->top + size <= a->size) {
+			p = a->base + a->top;
+			a->top += size;
+		}
+		if (p) {
+			a->allocated += size;
+			a->live += size;
+			return p;
+		}
+	}
+	a->fallbacks++;
+	a->allocated += n;
+	return malloc(n);
+}
+
+static void arena_free(av_Arena * a, void * ptr, size_t n) {
+	if (arena_owns(a, ptr)) {
+		int c = arena_class(n);
+		// (blocks in the arena all have a class; a wrong size is dropped rather than corrupt a free list)
+		if (c < 0) return;
+		*(void **)ptr = a->freelists[c];
+		a->freelists[c] = ptr;
+		a->live -= arena_classsize(c);
+	} else {
+		free(ptr);
+	}
+}
+
+// lua_Alloc interface; Lua always passes the exact old size of a block:
+void * av_arena_lua_alloc(void * ud, void * ptr, size_t osize, size_t nsize) {
+	av_Arena * a = (av_Arena *)ud;
+	if (nsize == 0) {
+		if (ptr) arena_free(a, ptr, osize);
+		return 0;
+	} else if (ptr == 0) {
+		return arena_alloc(a, nsize);
+	} else if (arena_owns(a, ptr)) {
+		// still fits the same class?
+		int c = arena_class(osize);
+		if (c >= 0 && c == arena_class(nsize)) return ptr;
+	} else if (arena_class(nsize) < 0) {
+		// large blocks live in the system allocator either way:
+		a->allocated += nsize;
+		return realloc(ptr, nsize);
+	}
+	void * p = arena_alloc(a, nsize);
+	if (p) {
+		memcpy(p, ptr, osize < nsize ? osize : nsize);
+		arena_free(a, ptr, osize);
+	}
+	return p;
+}
@@ -0,0 +1,269 @@
+#include "av_audio.hpp"
+
+#include <math.h>
+#include <string.h>
+
+struct av_AmbiDecoder {
+	int order, channels, speakers;
+	float matrix[AV_AMBI_SPEAKERS_MAX][AV_AMBI_CHANNELS_MAX];
+};
+
+// audio thread only (or main thread while stopped):
+static av_AmbiDecoder decoder;
+static int decoder_custom = 0;
+static av_msg_listener listener = { { 0, 0, 0 }, { 0, 0, 0, 1 }, 1 };
+
+// the weights each voice was last encoded with, so that moving voices ramp smoothly:
+static float voice_weights[AV_AUDIO_VOICES_MAX][AV_AMBI_CHANNELS_MAX];
+static char voice_fresh[AV_AUDIO_VOICES_MAX];
+
+static const double deg2rad = 0.017453292519943295;
+
+// real spherical harmonics up to third order, in ACN order with SN3D normalisation,
+// for the unit direction x (front), y (left), z (up):
+static void ambi_harmonics(double x, double y, double z, double * h) {
+	const double sqrt3 = 1.7320508075688772;
+	const double sqrt15 = 3.872983346207417;
+	const double sqrt3_8 = 0.6123724356957945;
+	const double sqrt5_8 = 0.7905694150420949;
+	double x2 = x*x, y2 = y*y, z2 = z*z;
+	h[0] = 1.;
+	h[1] = y;
+	h[2] = z;
+	h[3] = x;
+	h[4] = sqrt3 * x * y;
+	h[5] = sqrt3 * y * z;
+	h[6] = 0.5 * (3.*z2 - 1.);
+	h[7] = sqrt3 * x * z;
+	h[8] = 0.5 * sqrt3 * (x2 - y2);
+	h[9] = sqrt5_8 * y * (3.*x2 - y2);
+	h[10] = sqrt15 * x * y * z;
+	h[11] = sqrt3_8 * y * (5.*z2 - 1.);
+	h[12] = 0.5 * z * (5.*z2 - 3.);
+	h[13] = sqrt3_8 * x * (5.*z2 - 1.);
+	h[14] = 0.5 * sqrt15 * z * (x2 - y2);
+	h[15] = sqrt5_8 * x * (x2 - 3.*y2);
+}
+
+// invert the n x n matrix a (row stride AV_AMBI_CHANNELS_MAX) into inv, by Gauss-Jordan elimination:
+static int ambi_invert(double a[][AV_AMBI_CHANNELS_MAX], double inv[][AV_AMBI_CHANNELS_MAX], int n) {
+	for (int r = 0; r < n; r++) {
+		for (int c = 0; c < n; c++) inv[r][c] = (r == c) ? 1. : 0.;
+	}
+	for (int c = 0; c < n; c++) {
+		int pivot = c;
+		for (int r = c + 1; r < n; r++) {
+			if (fabs(a[r][c]) > fabs(a[pivot][c])) pivot = r;
+		}
+		if (fabs(a[pivot][c]) < 1e-12) return 0;
+		if (pivot != c) {
+			for (int k = 0; k < n; k++) {
+				double t = a[c][k]; a[c][k] = a[pivot][k]; a[pivot][k] = t;
+				t = inv[c][k]; inv[c][k] = inv[pivot][k]; inv[pivot][k] = t;
+			}
+		}
+		double scale = 1. / a[c][c];
+		for (int k = 0; k < n; k++) {
+			a[c][k] *= scale;
+			inv[c][k] *= scale;
+		}
+		for (int r = 0; r < n; r++) {
+			if (r == c) continue;
+			double f = a[r][c];
+			if (f == 0.) continue;
+			for (int k = 0; k < n; k++) {
+				a[r][k] -= f * a[c][k];
+				inv[r][k] -= f * inv[c][k];
+			}
+		}
+	}
+	return 1;
+}
+
+// mode-matching decoder: the (regularised) pseudo-inverse of the speakers' harmonics,
+// so that re-encoding the speaker feeds reproduces the ambisonic field.
+// the regularisation keeps degenerate layouts (e.g. a horizontal ring, which cannot
+// represent height) well-behaved: components a layout cannot reproduce are dropped.
+int av_ambi_decoder_design(av_msg_decoder * d, int order, int speakers, const double * azimuth, const double * elevation) {
+	if (order < 1 || order > AV_AMBI_ORDER_MAX) return 0;
+	if (speakers < 1 || speakers > AV_AMBI_SPEAKERS_MAX) return 0;
+	int channels = (order + 1) * (order + 1);
+
+	double Y[AV_AMBI_SPEAKERS_MAX][AV_AMBI_CHANNELS_MAX];
+	for (int s = 0; s < speakers; s++) {
+		double az = azimuth[s] * deg2rad;
+		double el = elevation ? elevation[s] * deg2rad : 0.;
+		ambi_harmonics(cos(az) * cos(el), sin(az) * cos(el), sin(el), Y[s]);
+	}
+
+	double G[AV_AMBI_CHANNELS_MAX][AV_AMBI_CHANNELS_MAX];
+	double Ginv[AV_AMBI_CHANNELS_MAX][AV_AMBI_CHANNELS_MAX];
+	double trace = 0.;
+	for (int a = 0; a < channels; a++) {
+		for (int b = 0; b < channels; b++) {
+			double sum = 0.;
+			for (int s = 0; s < speakers; s++) sum += Y[s][a] * Y[s][b];
+			G[a][b] = sum;
+		}
+		trace += G[a][a];
+	}
+	double lambda = 1e-6 * trace / channels;
+	for (int a = 0; a < channels; a++) G[a][a] += lambda;
+	if (!ambi_invert(G, Ginv, channels)) return 0;
+
+	memset(d->matrix, 0, sizeof(d->matrix));
+	for (int s = 0; s < speakers; s++) {
+		for (int k = 0; k < channels; k++) {
+			double sum = 0.;
+			for (int a = 0; a < channels; a++) sum += Y[s][a] * Ginv[a][k];
+			d->matrix[s][k] = (float)sum;
+		}
+	}
+	d->order = order;
+	d->speakers = speakers;
+	return 1;
+}
+
+void av_ambi_set_decoder(const av_msg_decoder * d) {
+	if (d->order < 1 || d->order > AV_AMBI_ORDER_MAX) return;
+	if (d->speakers < 1 || d->speakers > AV_AMBI_SPEAKERS_MAX) return;
+	decoder.order = d->order;
+	decoder.channels = (d->order + 1) * (d->order + 1);
+	decoder.speakers = d->speakers;
+	memcpy(decoder.matrix, d->matrix, sizeof(decoder.matrix));
+	decoder_custom = 1;
+}
+
+void av_ambi_init(int outchannels) {
+	if (decoder_custom) return;
+	// an evenly spaced horizontal ring, clockwise from the front-left:
+	int speakers = outchannels < 2 ? 2 : outchannels;
+	if (speakers > AV_AMBI_SPEAKERS_MAX) speakers = AV_AMBI_SPEAKERS_MAX;
+	int order = (speakers - 1) / 2;
+	if (order < 1) order = 1;
+	if (order > AV_AMBI_ORDER_MAX) order = AV_AMBI_ORDER_MAX;
+	double azimuth[AV_AMBI_SPEAKERS_MAX];
+	for (int s = 0; s < speakers; s++) azimuth[s] = (180. - 360. * s) / speakers;
+
+	av_msg_decoder d;
+	if (av_ambi_decoder_design(&d, order, speakers, azimuth, 0)) {
+		av_ambi_set_decoder(&d);
+		decoder_custom = 0;
+	}
+}
+
+void av_ambi_set_listener(const av_msg_listener * l) {
+	listener = *l;
+}
+
+int av_ambi_channels() {
+	return decoder.channels;
+}
+
+void av_ambi_voice_reset(int id) {
+	voice_fresh[id] = 1;
+}
+
+// the encoding weights for a voice, from its position relative to the listener:
+static void ambi_voice_weights(const av_VoicePool * pool, int id, float * w) {
+	double rel[3];
+	for (int a = 0; a < 3; a++) rel[a] = pool->position[a][id] - listener.pos[a];
+
+	// rotate into the listener's frame (by the conjugate of its orientation):
+	double qx = -listener.quat[0], qy = -listener.quat[1], qz = -listener.quat[2], qw = listener.quat[3];
+	double tx = 2. * (qy*rel[2] - qz*rel[1]);
+	double ty = 2. * (qz*rel[0] - qx*rel[2]);
+	double tz = 2. * (qx*rel[1] - qy*rel[0]);
+	double vx = rel[0] + qw*tx + (qy*tz - qz*ty);
+	double vy = rel[1] + qw*ty + (qz*tx - qx*tz);
+	double vz = rel[2] + qw*tz + (qx*ty - qy*tx);
+
+	double d = sqrt(vx*vx + vy*vy + vz*vz);
+	double near = listener.near > 0. ? listener.near : 1e-3;
+	// inverse distance beyond near; within it, no louder but increasingly omnidirectional:
+	double gain = d > near ? near / d : 1.;
+	double spatial = d < near ? d / near : 1.;
+
+	double h[AV_AMBI_CHANNELS_MAX];
+	if (d > 0.) {
+		// view axes (x right, y up, -z forward) to ambisonic axes (x front, y left, z up):
+		ambi_harmonics(-vz / d, -vx / d, vy / d, h);
+	} else {
+		ambi_harmonics(0., 0., 0., h);
+	}
+	w[0] = (float)gain;
+	for (int k = 1; k < AV_AMBI_CHANNELS_MAX; k++) w[k] = (float)(gain * spatial * h[k]);
+}
+
+void av_ambi_encode(const av_VoicePool * pool, int id, const float * left, const float * right, int frames, float * bus, int stride) {
+	int channels = decoder.channels;
+	float target[AV_AMBI_CHANNELS_MAX];
+	ambi_voice_weights(pool, id, target);
+	float * prev = voice_weights[id];
+	if (voice_fresh[id]) {
+		memcpy(prev, target, sizeof(target));
+		voice_fresh[id] = 0;
+	}
+
+	// ramp linearly from the previous weights over the segment:
+	float w[AV_AMBI_CHANNELS_MAX], dw[AV_AMBI_CHANNELS_MAX];
+	float inv = frames > 0 ? 1.f / frames : 0.f;
+	for (int k = 0; k < channels; k++) {
+		w[k] = prev[k];
+		dw[k] = (target[k] - prev[k]) * inv;
+	}
+
+	int i = 0;
+	#ifdef AV_AUDIO_SSE
+	__m128 wv[AV_AMBI_CHANNELS_MAX], dv[AV_AMBI_CHANNELS_MAX];
+	__m128 ramp = _mm_set_ps(3.f, 2.f, 1.f, 0.f);
+	for (int k = 0; k < channels; k++) {
+		wv[k] = _mm_add_ps(_mm_set1_ps(w[k]), _mm_mul_ps(_mm_set1_ps(dw[k]), ramp));
+		dv[k] = _mm_set1_ps(4.f * dw[k]);
+	}
+	for (; i + 4 <= frames; i += 4) {
+		__m128 s = _mm_loadu_ps(left + i);
+		if (right) s = _mm_add_ps(s, _mm_loadu_ps(right + i));
+		for (int k = 0; k < channels; k++) {
+			float * b = bus + k * stride + i;
+			_mm_storeu_ps(b, _mm_add_ps(_mm_loadu_ps(b), _mm_mul_ps(wv[k], s)));
+			wv[k] = _mm_add_ps(wv[k], dv[k]);
+		}
+	}
+	#endif
+	for (; i < frames; i++) {
+		float s = right ? left[i] + right[i] : left[i];
+		for (int k = 0; k < channels; k++) {
+			bus[k * stride + i] += (w[k] + dw[k] * i) * s;
+		}
+	}
+
+	memcpy(prev, target, sizeof(target));
+}
+
+void av_ambi_decode(const float * bus, int stride, float * out, int outstride, int outchannels, int frames) {
+	int channels = decoder.channels;
+	int speakers = decoder.speakers < outchannels ? decoder.speakers : outchannels;
+	for (int s = 0; s < speakers; s++) {
+		const float * row = decoder.matrix[s];
+		float * o = out + s * outstride;
+		int i = 0;
+		#ifdef AV_AUDIO_SSE
+		// buses are cache-aligned and padded, so whole vectors are safe:
+		__m128 g[AV_AMBI_CHANNELS_MAX];
+		for (int k = 0; k < channels; k++) g[k] = _mm_set1_ps(row[k]);
+		for (; i + 4 <= frames; i += 4) {
+			__m128 acc = _mm_load_ps(o + i);
+			for (int k = 0; k < channels; k++) {
+				acc = _mm_add_ps(acc, _mm_mul_ps(g[k], _mm_load_ps(bus + k * stride + i)));
+			}
+			_mm_store_ps(o + i, acc);
+		}
+		#endif
+		for (; i < frames; i++) {
+			float acc = o[i];
+			for (int k = 0; k < channels; k++) acc += row[k] * bus[k * stride + i];
+			o[i] = acc;
+		}
+	}
+}
@@ -0,0 +1,246 @@
+#include "av_audio.hpp"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+// spectral analysis of recent input and output. the audio thread only publishes into the
+// capture and monitor rings and wakes the analysis thread, which reads the rings in place,
+// so none of this work happens in the callback.
+
+static const double twopi = 6.283185307179586;
+
+#define AV_ANALYSIS_BAND_MIN 40.		// Hz
+#define AV_ONSET_RATIO 1.5f				// flux over its running mean that counts as an onset
+#define AV_ONSET_FLOOR 0.01f			// ignores flux from noise in near-silence
+#define AV_ONSET_HOLD 0.05				// seconds before another onset can be reported
+
+struct av_Analyzer {
+	av_Analysis result;
+	volatile long active;
+
+	// analysis thread only:
+	av_FFT * fft;
+	float * window, * frame, * re, * im, * previous;
+	float scale;			// from FFT magnitude to sine amplitude
+	int bandlo[AV_ANALYSIS_BANDS + 1];
+	int started;			// next is valid for the current rings
+	uint32_t next;			// the ring frame at which the next window ends
+	float fluxmean;
+	double lastonset;
+};
+
+static av_Analyzer analyzers[AV_ANALYSIS_MAX];
+static av_Audio * audio = 0;
+static av_thread analysis_thread;
+static av_semaphore analysis_wake;
+static int analysis_started = 0;
+static volatile long running = 0;		// analyses active
+static volatile long wanted = 0;		// a wake-up is pending
+static volatile long busy = 0;			// the thread is reading the rings
+static volatile long suspended = 0;		// the rings are being replaced
+
+// band edges depend on the samplerate, so are set whenever the rings are (re)started:
+static void analysis_reset(av_Analyzer * a) {
+	int size = a->result.size;
+	double nyquist = audio->samplerate * 0.5;
+	double binwidth = audio->samplerate / size;
+	for (int b = 0; b <= AV_ANALYSIS_BANDS; b++) {
+		double f = AV_ANALYSIS_BAND_MIN * pow(nyquist / AV_ANALYSIS_BAND_MIN, (double)b / AV_ANALYSIS_BANDS);
+		int bin = (int)ceil(f / binwidth);
+		// every band gets at least one bin:
+		if (b > 0 && bin <= a->bandlo[b - 1]) bin = a->bandlo[b - 1] + 1;
+		a->bandlo[b] = bin;
+	}
+	a->bandlo[AV_ANALYSIS_BANDS] = a->result.bins;
+	memset(a->previous, 0, sizeof(float) * a->result.bins);
+	a->fluxmean = 0.f;
+	a->lastonset = -1.;
+	a->started = 0;
+}
+
+// analyse the windowed frame (which ended at ring frame a->next), given its rms and end time:
+static void analysis_frame(av_Analyzer * a, float rms, double time) {
+	av_Analysis& r = a->result;
+	const int size = r.size, bins = r.bins;
+	av_fft_forward(a->fft, a->frame, a->re, a->im);
+
+	// an update is being written:
+	av_atomic_store_release(&r.sequence, r.sequence + 1);
+	av_atomic_fence();
+
+	float flux = 0.f;
+	double weighted = 0., total = 0.;
+	double binwidth = audio->samplerate / size;
+	for (int k = 0; k < bins; k++) {
+		float mag = a->scale * sqrtf(a->re[k] * a->re[k] + a->im[k] * a->im[k]);
+		// DC and Nyquist have no mirror image:
+		if (k == 0 || k == bins - 1) mag *= 0.5f;
+		float rise = mag - a->previous[k];
+		if (rise > 0.f) flux += rise;
+		a->previous[k] = mag;
+		r.magnitude[k] = mag;
+		r.phase[k] = atan2f(a->im[k], a->re[k]);
+		weighted += k * binwidth * mag;
+		total += mag;
+	}
+	for (int b = 0; b < AV_ANALYSIS_BANDS; b++) {
+		// a Hann window spreads a sine's power over 1.5 bins:
+		double power = 0.;
+		for (int k = a->bandlo[b]; k < a->bandlo[b + 1] && k < bins; k++) power += r.magnitude[k] * r.magnitude[k];
+		r.bands[b] = (float)(10. * log10(power / 1.5 + 1e-12));
+	}
+
+	r.time = time;
+	r.rms = rms;
+	r.flux = flux;
+	r.centroid = total > 0. ? (float)(weighted / total) : 0.f;
+	// an onset is a jump in flux well above its recent mean:
+	r.onset = 0.f;
+	if (flux > AV_ONSET_RATIO * a->fluxmean + AV_ONSET_FLOOR && r.time - a->lastonset > AV_ONSET_HOLD) {
+		r.onset = 1.f;
+		r.onsets++;
+		a->lastonset = r.time;
+	}
+	// the mean follows over about a quarter second:
+	float coeff = (float)(r.hop / (0.25 * audio->samplerate));
+	a->fluxmean += (coeff < 1.f ? coeff : 1.f) * (flux - a->fluxmean);
+	r.frames++;
+
+	av_atomic_store_release(&r.sequence, r.sequence + 1);
+}
+
+static void analysis_update(av_Analyzer * a) {
+	av_Analysis& r = a->result;
+	const av_AudioCapture& cap = r.source < 0 ? audio->monitor : audio->capture;
+	int channel = r.source < 0 ? 0 : r.source;
+	if (!cap.data || (uint32_t)channel >= cap.channels || (uint32_t)r.size > cap.frames / 2) return;
+	const float * data = cap.data + channel * 2 * cap.frames;
+	// how far back the ring can be read before the next block overwrites it:
+	uint32_t reach = cap.frames - audio->blocksize;
+
+	uint32_t write = av_atomic_load_acquire(&cap.write);
+	if (!a->started) {
+		a->next = write;
+		a->started = 1;
+	} else if ((int32_t)(write - a->next) > (int32_t)(reach - r.size)) {
+		// fell behind: skip to the latest complete window
+		uint32_t skipped = (write - a->next) / r.hop;
+		r.dropped += skipped;
+		a->next += skipped * r.hop;
+	}
+	while ((int32_t)(write - a->next) >= 0) {
+		uint32_t start = a->next - r.size;
+		const float * src = data + (start & (cap.frames - 1));
+		double sum = 0.;
+		for (int i = 0; i < r.size; i++) {
+			sum += src[i] * src[i];
+			a->frame[i] = src[i] * a->window[i];
+		}
+		// the audio thread may have overwritten it while it was read:
+		if (av_atomic_load_acquire(&cap.write) - start <= reach) {
+			analysis_frame(a, (float)sqrt(sum / r.size), av_audio_capture_time(&cap, a->next));
+		} else {
+			r.dropped++;
+		}
+		a->next += r.hop;
+	}
+}
+
+static void * analysis_main(void * ud) {
+	for (;;) {
+		av_semaphore_wait(&analysis_wake);
+		av_atomic_exchange(&wanted, 0);
+		// the main thread waits for busy to clear before replacing the rings:
+		av_atomic_store(&busy, 1);
+		if (!av_atomic_load(&suspended)) {
+			for (int i = 0; i < AV_ANALYSIS_MAX; i++) {
+				if (av_atomic_load_acquire(&analyzers[i].active)) analysis_update(&analyzers[i]);
+			}
+		}
+		av_atomic_store(&busy, 0);
+	}
+	return 0;
+}
+
+void av_audio_analysis_notify() {
+	if (av_atomic_load_acquire(&running) && !av_atomic_exchange(&wanted, 1)) {
+		av_semaphore_post(&analysis_wake);
+	}
+}
+
+void av_audio_analysis_suspend() {
+	av_atomic_store(&suspended, 1);
+	while (av_atomic_load(&busy)) av_thread_yield();
+}
+
+void av_audio_analysis_resume() {
+	for (int i = 0; i < AV_ANALYSIS_MAX; i++) {
+		if (analyzers[i].active) analysis_reset(&analyzers[i]);
+	}
+	av_atomic_store(&suspended, 0);
+}
+
+av_Analysis * av_audio_analysis_start(int source, int size, int hop) {
+	if (size < 2 || size > AV_ANALYSIS_SIZE_MAX || (size & 1) || hop < 1) return 0;
+	audio = av_audio_get();
+	if (source >= AV_AUDIO_CAPTURE_CHANNELS_MAX) return 0;
+	av_Analyzer * a = 0;
+	for (int i = 0; i < AV_ANALYSIS_MAX; i++) {
+		if (!analyzers[i].active) {
+			a = &analyzers[i];
+			break;
+		}
+	}
+	if (!a) return 0;
+	av_FFT * fft = av_fft_create(size);
+	if (!fft) return 0;
+
+	memset(&a->result, 0, sizeof(a->result));
+	a->result.source = source < 0 ? -1 : source;
+	a->result.size = size;
+	a->result.hop = hop;
+	a->result.bins = size / 2 + 1;
+	a->fft = fft;
+	a->window = (float *)av_aligned_alloc(sizeof(float) * size);
+	a->frame = (float *)av_aligned_alloc(sizeof(float) * size);
+	a->re = (float *)av_aligned_alloc(sizeof(float) * a->result.bins);
+	a->im = (float *)av_aligned_alloc(sizeof(float) * a->result.bins);
+	a->previous = (float *)av_aligned_alloc(sizeof(float) * a->result.bins);
+	double sum = 0.;
+	for (int i = 0; i < size; i++) {
+		a->window[i] = (float)(0.5 - 0.5 * cos(twopi * i / size));
+		sum += a->window[i];
+	}
+	a->scale = (float)(2. / sum);
+	analysis_reset(a);
+
+	if (!analysis_started) {
+		av_semaphore_init(&analysis_wake);
+		av_thread_create(&analysis_thread, analysis_main, 0);
+		analysis_started = 1;
+	}
+	av_atomic_store_release(&a->active, 1L);
+	av_atomic_add(&running, 1);
+	return &a->result;
+}
+
+void av_audio_analysis_stop(av_Analysis * analysis) {
+	av_Analyzer * a = 0;
+	for (int i = 0; i < AV_ANALYSIS_MAX; i++) {
+		if (&analyzers[i].result == analysis && analyzers[i].active) a = &analyzers[i];
+	}
+	if (!a) return;
+	av_atomic_store_release(&a->active, 0L);
+	av_atomic_add(&running, -1);
+	// wait until the thread cannot be using it:
+	av_audio_analysis_suspend();
+	av_atomic_store(&suspended, 0L);
+	av_fft_destroy(a->fft);
+	av_aligned_free(a->window);
+	av_aligned_free(a->frame);
+	av_aligned_free(a->re);
+	av_aligned_free(a->im);
+	av_aligned_free(a->previous);
+	a->fft = 0;
+}
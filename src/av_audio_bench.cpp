@@ -0,0 +1,174 @@
+// a standalone benchmark of the audio callback path, without audio hardware.
+// it runs the offline driver (the same av_audio_process as the devices) over every
+// combination of the given settings, with native sine voices, a stream of parameter
+// messages, and the audio Lua state (run it from the repository root, so that
+// modules/audioprocess.lua is found).
+//
+//	./av_audio_bench voices=0,64,256,1024 channels=2,8 blocksizes=64,256,1024 messages=0,100000
+//		seconds=2 workers=-1 spatial=0 samplerate=44100
+//
+// list arguments take comma-separated values; messages is per second of audio, and
+// workers = -1 keeps the default pool. results are printed as tab-separated lines
+// starting with "bench", after a header line of the same form. the host functions the
+// audio code needs (av_time, av_init_lua etc.) come from av_host.cpp, as in the application.
+
+#include "av_audio.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BENCH_LIST_MAX 16
+
+struct bench_list {
+	int n;
+	int v[BENCH_LIST_MAX];
+};
+
+static void bench_parse(bench_list& list, const char * s) {
+	list.n = 0;
+	while (*s && list.n < BENCH_LIST_MAX) {
+		list.v[list.n++] = atoi(s);
+		while (*s && *s != ',') s++;
+		if (*s == ',') s++;
+	}
+}
+
+// reserve a message, running blocks until the queue has room:
+static void * bench_reserve(av_Audio * audio, uint32_t cmd, uint32_t size) {
+	void * body;
+	while (!(body = av_msgqueue_reserve(&audio->msgqueue, cmd, size, 0))) {
+		av_msgqueue_commit(&audio->msgqueue);
+		av_audio_null_process(audio->blocksize);
+	}
+	return body;
+}
+
+static void bench_param(av_Audio * audio, int id, int pid, double value) {
+	av_msg_param * p = (av_msg_param *)bench_reserve(audio, AV_AUDIO_CMD_VOICE_PARAM, sizeof(av_msg_param));
+	p->id = id;
+	p->pid = pid;
+	p->value = value;
+}
+
+static void bench_voices(av_Audio * audio, int voices, int spatial) {
+	for (int i = 0; i < voices; i++) {
+		int id = av_audio_voice_alloc();
+		if (!id) break;
+		*(int *)bench_reserve(audio, AV_AUDIO_CMD_VOICE_ADD, sizeof(int)) = id;
+		av_msg_kernel * k = (av_msg_kernel *)bench_reserve(audio, AV_AUDIO_CMD_VOICE_KERNEL, sizeof(av_msg_kernel));
+		k->id = id;
+		k->kernel = AV_AUDIO_KERNEL_SINE;
+		bench_param(audio, id, 0, 110. + 10. * (i % 100));
+		bench_param(audio, id, 1, 0.5 / voices);
+		bench_param(audio, id, 2, (i % 16) / 15.);
+		if (spatial) {
+			av_msg_position * p = (av_msg_position *)bench_reserve(audio, AV_AUDIO_CMD_VOICE_POSITION, sizeof(av_msg_position));
+			p->id = id;
+			p->spatial = 1;
+			p->pos[0] = (i % 7) - 3.;
+			p->pos[1] = (i % 3) - 1.;
+			p->pos[2] = -2. - (i % 5);
+		}
+	}
+	av_msgqueue_commit(&audio->msgqueue);
+}
+
+static void bench_run(av_Audio * audio, int voices, int channels, int blocksize, int messages, int workers, int spatial, double seconds) {
+	audio->blocksize = blocksize;
+	audio->outchannels = channels;
+	audio->inchannels = 0;
+	if (workers >= 0) av_audio_setworkers(workers);
+	av_audio_null_begin();
+	bench_voices(audio, voices, spatial);
+
+	// let the voices start and the Lua state settle:
+	int warmup = (int)(0.25 * audio->samplerate / blocksize) + 1;
+	for (int b = 0; b < warmup; b++) av_audio_null_process(blocksize);
+	memset(&audio->stats, 0, sizeof(av_AudioStats));
+
+	int blocks = (int)(seconds * audio->samplerate / blocksize) + 1;
+	double permessages = messages * (double)blocksize / audio->samplerate;
+	double owed = 0.;
+	double process = 0., produce = 0., worst = 0.;
+	int sent = 0;
+	for (int b = 0; b < blocks; b++) {
+		double t0 = av_monotonic_time();
+		owed += permessages;
+		while (owed >= 1.) {
+			int id = voices ? 1 + (sent % voices) : 0;
+			bench_param(audio, id, 1, 0.5 / (voices ? voices : 1));
+			owed -= 1.;
+			sent++;
+		}
+		av_msgqueue_commit(&audio->msgqueue);
+		double t1 = av_monotonic_time();
+		av_audio_null_process(blocksize);
+		double t2 = av_monotonic_time();
+		produce += t1 - t0;
+		process += t2 - t1;
+		if (t2 - t1 > worst) worst = t2 - t1;
+	}
+	av_audio_null_end();
+
+	// remove the voices for the next run:
+	bench_reserve(audio, AV_AUDIO_CMD_CLEAR, 0);
+	av_msgqueue_commit(&audio->msgqueue);
+	av_audio_voice_freeall();
+
+	double frames = (double)blocks * blocksize;
+	double period = blocksize / audio->samplerate;
+	printf("bench\t%d\t%d\t%d\t%d\t%d\t%d\t%.0f\t%.2f\t%.3f\t%.2f\t%.2f\t%.4f\t%.1f\t%.1f\n",
+		voices, channels, blocksize, messages, av_audio_workers_count(), spatial, frames,
+		1e9 * process / frames,
+		voices ? 1e9 * process / (frames * voices) : 0.,
+		1e6 * process / blocks,
+		1e6 * worst,
+		process / (blocks * period),
+		process > 0. ? frames / audio->samplerate / process : 0.,
+		sent ? 1e9 * produce / sent : 0.);
+	fflush(stdout);
+}
+
+int main(int argc, char * argv[]) {
+	bench_list voices, channels, blocksizes, messages;
+	bench_parse(voices, "0,64,256,1024");
+	bench_parse(channels, "2,8");
+	bench_parse(blocksizes, "64,256,1024");
+	bench_parse(messages, "0,100000");
+	double seconds = 2.;
+	int workers = -1, spatial = 0;
+	double samplerate = 44100.;
+	for (int i = 1; i < argc; i++) {
+		const char * eq = strchr(argv[i], '=');
+		if (!eq) {
+			printf("usage: %s [voices=a,b,..] [channels=..] [blocksizes=..] [messages=..] [seconds=s] [workers=n] [spatial=0|1] [samplerate=sr]\n", argv[0]);
+			return 1;
+		}
+		const char * value = eq + 1;
+		if (!strncmp(argv[i], "voices=", 7)) bench_parse(voices, value);
+		else if (!strncmp(argv[i], "channels=", 9)) bench_parse(channels, value);
+		else if (!strncmp(argv[i], "blocksizes=", 11)) bench_parse(blocksizes, value);
+		else if (!strncmp(argv[i], "messages=", 9)) bench_parse(messages, value);
+		else if (!strncmp(argv[i], "seconds=", 8)) seconds = atof(value);
+		else if (!strncmp(argv[i], "workers=", 8)) workers = atoi(value);
+		else if (!strncmp(argv[i], "spatial=", 8)) spatial = atoi(value);
+		else if (!strncmp(argv[i], "samplerate=", 11)) samplerate = atof(value);
+		else printf("unknown argument %s\n", argv[i]);
+	}
+
+	av_Audio * audio = av_audio_get();
+	audio->samplerate = samplerate;
+
+	printf("bench\tvoices\tchannels\tblocksize\tmessages\tworkers\tspatial\tframes\tns_per_frame\tns_per_voice_frame\tblock_us\tblock_us_max\tload\trealtime\tns_per_message\n");
+	for (int v = 0; v < voices.n; v++) {
+		for (int c = 0; c < channels.n; c++) {
+			for (int b = 0; b < blocksizes.n; b++) {
+				for (int m = 0; m < messages.n; m++) {
+					bench_run(audio, voices.v[v], channels.v[c], blocksizes.v[b], messages.v[m], workers, spatial, seconds);
+				}
+			}
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,323 @@
+#include "av_audio.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// non-uniformly partitioned FFT convolution in two levels.
+// the head of the impulse response, up to 2L frames, is split into partitions of B frames
+// and convolved on the calling (audio) thread with a frequency-domain delay line.
+// partial blocks are handled by transforming the block filled so far on every call, so the
+// head adds no latency whatever the callback size. the tail, from 2L on, is split into
+// partitions of L = 16B frames and convolved on the convolution thread: each input block
+// of L frames is handed over when complete, and its contribution is first needed two blocks
+// later, which gives the thread a whole block period to compute it.
+
+#define AV_CONVOLVER_TAIL_RATIO 16
+#define AV_CONVOLVER_SLOTS 4		// tail blocks in flight (a power of two)
+
+// slot states:
+enum {
+	CONVOLVER_ACTIVE,
+	CONVOLVER_DEAD			// destroyed; the convolution thread frees it
+};
+
+struct av_Convolver {
+	volatile long state;
+
+	// head, on the audio thread:
+	int partition, segments, bins, stride;
+	av_FFT * fft;
+	float * hr, * hi;		// partition spectra, segments * stride
+	float * xr, * xi;		// spectra of past input blocks (a ring of segments)
+	float * pr, * pi;		// the sum over all but the newest block, for the current block
+	float * sr, * si;		// the current block's spectrum
+	float * ar, * ai;		// accumulator
+	float * input;			// the previous block, then the current block (2 * partition)
+	float * output;			// 2 * partition
+	int pos, head;
+
+	// tail (tail = 0 if the impulse response fits the head):
+	int tail, tailsegments, tailbins, tailstride;
+	float * inslots, * outslots;	// AV_CONVOLVER_SLOTS blocks each, of tail frames
+	// audio thread:
+	uint32_t block;			// the tail block being filled
+	int tailpos;
+	// convolution thread:
+	av_FFT * tailfft;
+	float * thr, * thi, * txr, * txi, * tar, * tai;
+	float * tinput, * toutput;		// 2 * tail
+	int thead;
+	// handover:
+	volatile uint32_t posted;		// input blocks complete
+	volatile uint32_t done;			// input blocks convolved
+	volatile long late;				// tail blocks that were not ready in time
+};
+
+static av_Convolver * volatile convolvers[AV_CONVOLVERS_MAX];
+static av_thread conv_thread;
+static av_semaphore conv_wake;
+static int conv_started = 0;
+static volatile long wanted = 0;
+
+static float * conv_array(int n) {
+	float * a = (float *)av_aligned_alloc(sizeof(float) * n);
+	memset(a, 0, sizeof(float) * n);
+	return a;
+}
+
+// acc += a * b, over n complex values:
+static void conv_mac(float * accr, float * acci, const float * ar, const float * ai, const float * br, const float * bi, int n) {
+	int i = 0;
+	#ifdef AV_AUDIO_SSE
+	for (; i + 4 <= n; i += 4) {
+		__m128 xr = _mm_loadu_ps(ar + i), xi = _mm_loadu_ps(ai + i);
+		__m128 yr = _mm_loadu_ps(br + i), yi = _mm_loadu_ps(bi + i);
+		__m128 re = _mm_sub_ps(_mm_mul_ps(xr, yr), _mm_mul_ps(xi, yi));
+		__m128 im = _mm_add_ps(_mm_mul_ps(xr, yi), _mm_mul_ps(xi, yr));
+		_mm_storeu_ps(accr + i, _mm_add_ps(_mm_loadu_ps(accr + i), re));
+		_mm_storeu_ps(acci + i, _mm_add_ps(_mm_loadu_ps(acci + i), im));
+	}
+	#endif
+	for (; i < n; i++) {
+		accr[i] += ar[i] * br[i] - ai[i] * bi[i];
+		acci[i] += ar[i] * bi[i] + ai[i] * br[i];
+	}
+}
+
+// the spectra of frames of ir in partitions of size, each zero-padded to twice that:
+static void conv_partitions(av_FFT * fft, const float * ir, int irstride, int frames, int size, int segments, int stride, float * hr, float * hi) {
+	float * buf = conv_array(2 * size);
+	for (int k = 0; k < segments; k++) {
+		memset(buf, 0, sizeof(float) * 2 * size);
+		for (int i = 0; i < size && k * size + i < frames; i++) buf[i] = ir[(k * size + i) * irstride];
+		av_fft_forward(fft, buf, hr + k * stride, hi + k * stride);
+	}
+	av_aligned_free(buf);
+}
+
+// the sum over the older blocks of the head, for the block after newest:
+static void conv_premultiply(av_Convolver * self) {
+	memset(self->pr, 0, sizeof(float) * self->stride);
+	memset(self->pi, 0, sizeof(float) * self->stride);
+	for (int k = 1; k < self->segments; k++) {
+		int x = (self->head - k + 1 + self->segments) % self->segments;
+		conv_mac(self->pr, self->pi, self->xr + x * self->stride, self->xi + x * self->stride,
+			self->hr + k * self->stride, self->hi + k * self->stride, self->bins);
+	}
+}
+
+static void conv_free(av_Convolver * self) {
+	av_fft_destroy(self->fft);
+	av_aligned_free(self->hr); av_aligned_free(self->hi);
+	av_aligned_free(self->xr); av_aligned_free(self->xi);
+	av_aligned_free(self->pr); av_aligned_free(self->pi);
+	av_aligned_free(self->sr); av_aligned_free(self->si);
+	av_aligned_free(self->ar); av_aligned_free(self->ai);
+	av_aligned_free(self->input);
+	av_aligned_free(self->output);
+	if (self->tail) {
+		av_fft_destroy(self->tailfft);
+		av_aligned_free(self->inslots); av_aligned_free(self->outslots);
+		av_aligned_free(self->thr); av_aligned_free(self->thi);
+		av_aligned_free(self->txr); av_aligned_free(self->txi);
+		av_aligned_free(self->tar); av_aligned_free(self->tai);
+		av_aligned_free(self->tinput);
+		av_aligned_free(self->toutput);
+	}
+	free(self);
+}
+
+// convolution thread: input block j is complete; its tail contribution plays in block j + 2:
+static void conv_tail_block(av_Convolver * self, uint32_t j) {
+	const int L = self->tail, K = self->tailsegments, stride = self->tailstride;
+	memmove(self->tinput, self->tinput + L, sizeof(float) * L);
+	memcpy(self->tinput + L, self->inslots + (j & (AV_CONVOLVER_SLOTS - 1)) * L, sizeof(float) * L);
+	self->thead = (self->thead + 1) % K;
+	av_fft_forward(self->tailfft, self->tinput, self->txr + self->thead * stride, self->txi + self->thead * stride);
+	memset(self->tar, 0, sizeof(float) * stride);
+	memset(self->tai, 0, sizeof(float) * stride);
+	for (int k = 0; k < K; k++) {
+		int x = (self->thead - k + K) % K;
+		conv_mac(self->tar, self->tai, self->txr + x * stride, self->txi + x * stride,
+			self->thr + k * stride, self->thi + k * stride, self->tailbins);
+	}
+	av_fft_inverse(self->tailfft, self->tar, self->tai, self->toutput);
+	memcpy(self->outslots + ((j + 2) & (AV_CONVOLVER_SLOTS - 1)) * L, self->toutput + L, sizeof(float) * L);
+}
+
+static void * conv_main(void * ud) {
+	for (;;) {
+		av_semaphore_wait(&conv_wake);
+		av_atomic_exchange(&wanted, 0);
+		for (int i = 0; i < AV_CONVOLVERS_MAX; i++) {
+			av_Convolver * c = av_atomic_load_acquire(&convolvers[i]);
+			if (!c) continue;
+			if (av_atomic_load_acquire(&c->state) == CONVOLVER_DEAD) {
+				conv_free(c);
+				av_atomic_store_release(&convolvers[i], (av_Convolver *)0);
+				continue;
+			}
+			if (!c->tail) continue;
+			uint32_t posted = av_atomic_load_acquire(&c->posted);
+			uint32_t done = c->done;
+			if (posted - done > AV_CONVOLVER_SLOTS - 2) {
+				// too far behind to catch up: restart from the latest block
+				av_atomic_add(&c->late, (long)(posted - done - 1));
+				memset(c->txr, 0, sizeof(float) * c->tailsegments * c->tailstride);
+				memset(c->txi, 0, sizeof(float) * c->tailsegments * c->tailstride);
+				done = posted - 1;
+			}
+			for (; done != posted; done++) {
+				conv_tail_block(c, done);
+				av_atomic_store_release(&c->done, done + 1);
+			}
+		}
+	}
+	return 0;
+}
+
+static void conv_wakeup() {
+	if (!av_atomic_exchange(&wanted, 1)) av_semaphore_post(&conv_wake);
+}
+
+av_Convolver * av_convolver_create(const float * ir, int frames, int channels, int channel, int partition) {
+	if (!ir || frames < 1 || channel < 0 || channel >= channels || partition < 2 || (partition & 1)) return 0;
+	int slot = 0;
+	while (slot < AV_CONVOLVERS_MAX && av_atomic_load_acquire(&convolvers[slot])) slot++;
+	if (slot >= AV_CONVOLVERS_MAX) {
+		printf("too many convolvers\n");
+		return 0;
+	}
+	const int B = partition, L = AV_CONVOLVER_TAIL_RATIO * partition;
+	av_FFT * fft = av_fft_create(2 * B);
+	av_FFT * tailfft = frames > 2 * L ? av_fft_create(2 * L) : 0;
+	if (!fft || (frames > 2 * L && !tailfft)) {
+		av_fft_destroy(fft);
+		av_fft_destroy(tailfft);
+		return 0;
+	}
+
+	av_Convolver * self = (av_Convolver *)calloc(1, sizeof(av_Convolver));
+	self->state = CONVOLVER_ACTIVE;
+	self->partition = B;
+	int headframes = frames < 2 * L ? frames : 2 * L;
+	self->segments = (headframes + B - 1) / B;
+	self->bins = B + 1;
+	self->stride = (self->bins + 3) & ~3;
+	self->fft = fft;
+	self->hr = conv_array(self->segments * self->stride);
+	self->hi = conv_array(self->segments * self->stride);
+	self->xr = conv_array(self->segments * self->stride);
+	self->xi = conv_array(self->segments * self->stride);
+	self->pr = conv_array(self->stride);
+	self->pi = conv_array(self->stride);
+	self->sr = conv_array(self->stride);
+	self->si = conv_array(self->stride);
+	self->ar = conv_array(self->stride);
+	self->ai = conv_array(self->stride);
+	self->input = conv_array(2 * B);
+	self->output = conv_array(2 * B);
+	conv_partitions(fft, ir + channel, channels, headframes, B, self->segments, self->stride, self->hr, self->hi);
+
+	if (tailfft) {
+		self->tail = L;
+		self->tailsegments = (frames - 2 * L + L - 1) / L;
+		self->tailbins = L + 1;
+		self->tailstride = (self->tailbins + 3) & ~3;
+		self->tailfft = tailfft;
+		int n = self->tailsegments * self->tailstride;
+		self->thr = conv_array(n);
+		self->thi = conv_array(n);
+		self->txr = conv_array(n);
+		self->txi = conv_array(n);
+		self->tar = conv_array(self->tailstride);
+		self->tai = conv_array(self->tailstride);
+		self->tinput = conv_array(2 * L);
+		self->toutput = conv_array(2 * L);
+		self->inslots = conv_array(AV_CONVOLVER_SLOTS * L);
+		self->outslots = conv_array(AV_CONVOLVER_SLOTS * L);
+		conv_partitions(tailfft, ir + 2 * L * channels + channel, channels, frames - 2 * L, L, self->tailsegments, self->tailstride, self->thr, self->thi);
+	}
+
+	if (!conv_started) {
+		av_semaphore_init(&conv_wake);
+		av_thread_create(&conv_thread, conv_main, 0);
+		conv_started = 1;
+	}
+	av_atomic_store_release(&convolvers[slot], self);
+	return self;
+}
+
+void av_convolver_destroy(av_Convolver * self) {
+	if (!self) return;
+	av_atomic_store_release(&self->state, (long)CONVOLVER_DEAD);
+	conv_wakeup();
+}
+
+uint32_t av_convolver_late(av_Convolver * self) {
+	return (uint32_t)av_atomic_load(&self->late);
+}
+
+void av_convolver_process(av_Convolver * self, const float * in, float * out, int frames) {
+	const int B = self->partition, L = self->tail;
+	int i = 0;
+	while (i < frames) {
+		// never cross the end of a head block (which also never crosses a tail block):
+		int n = frames - i;
+		if (n > B - self->pos) n = B - self->pos;
+		memcpy(self->input + B + self->pos, in + i, sizeof(float) * n);
+
+		// the tail hears the input, and adds what was computed for this block:
+		const float * tailout = 0;
+		if (L) {
+			uint32_t slot = self->block & (AV_CONVOLVER_SLOTS - 1);
+			memcpy(self->inslots + slot * L + self->tailpos, in + i, sizeof(float) * n);
+			if (self->block >= 2) {
+				if ((int32_t)(av_atomic_load_acquire(&self->done) - (self->block - 1)) >= 0) {
+					tailout = self->outslots + slot * L + self->tailpos;
+				} else if (self->tailpos == 0) {
+					av_atomic_add(&self->late, 1);
+				}
+			}
+		}
+
+		// the head, over the block so far (the rest of it is still zero):
+		av_fft_forward(self->fft, self->input, self->sr, self->si);
+		if (self->pos + n == B) {
+			// the block is complete; keep its spectrum:
+			self->head = (self->head + 1) % self->segments;
+			memcpy(self->xr + self->head * self->stride, self->sr, sizeof(float) * self->bins);
+			memcpy(self->xi + self->head * self->stride, self->si, sizeof(float) * self->bins);
+		}
+		memcpy(self->ar, self->pr, sizeof(float) * self->bins);
+		memcpy(self->ai, self->pi, sizeof(float) * self->bins);
+		conv_mac(self->ar, self->ai, self->sr, self->si, self->hr, self->hi, self->bins);
+		av_fft_inverse(self->fft, self->ar, self->ai, self->output);
+
+		const float * y = self->output + B + self->pos;
+		if (tailout) {
+			for (int k = 0; k < n; k++) out[i + k] = y[k] + tailout[k];
+		} else {
+			memcpy(out + i, y, sizeof(float) * n);
+		}
+
+		self->pos += n;
+		if (self->pos == B) {
+			memcpy(self->input, self->input + B, sizeof(float) * B);
+			memset(self->input + B, 0, sizeof(float) * B);
+			self->pos = 0;
+			conv_premultiply(self);
+		}
+		if (L) {
+			self->tailpos += n;
+			if (self->tailpos == L) {
+				self->tailpos = 0;
+				self->block++;
+				av_atomic_store_release(&self->posted, self->block);
+				conv_wakeup();
+			}
+		}
+		i += n;
+	}
+}
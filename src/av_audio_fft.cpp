@@ -0,0 +1,302 @@
+#include "av_audio.hpp"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+// real FFT over a half-length complex FFT. the complex FFT is a Stockham autosort
+// (no bit reversal) over mixed radices, on split real/imaginary arrays. each stage
+// reads x[q + s*(j + r*m)] and writes y[q + s*(p*j + k)], where the innermost q loop
+// runs over s contiguous values sharing a twiddle: those are done four at a time with SSE.
+
+static const double twopi = 6.283185307179586;
+
+#define AV_FFT_STAGES_MAX 32
+#define AV_FFT_RADIX_MAX 31
+
+struct av_FFT {
+	int size;			// real length
+	int n;				// complex length (size / 2)
+	int stages;
+	int radix[AV_FFT_STAGES_MAX];
+	// per stage: (radix - 1) rows of m twiddles, exp(-2 pi i j k / (m * radix)) at row k - 1:
+	float * twr[AV_FFT_STAGES_MAX], * twi[AV_FFT_STAGES_MAX];
+	// per stage of a radix above 4: exp(-2 pi i k / radix), for the direct DFT:
+	float * rootr[AV_FFT_STAGES_MAX], * rooti[AV_FFT_STAGES_MAX];
+	// exp(-2 pi i k / size) for the real-to-complex split, k < n:
+	float * wr, * wi;
+	// work arrays, n each:
+	float * xr, * xi, * yr, * yi;
+};
+
+static float * fft_array(int n) {
+	float * a = (float *)av_aligned_alloc(sizeof(float) * (n < 4 ? 4 : n));
+	memset(a, 0, sizeof(float) * (n < 4 ? 4 : n));
+	return a;
+}
+
+// scalar and four-wide arithmetic, so the butterflies are written once:
+struct fft_scalar {
+	typedef float T;
+	enum { width = 1 };
+	static T load(const float * p) { return *p; }
+	static void store(float * p, T v) { *p = v; }
+	static T set(float f) { return f; }
+	static T add(T a, T b) { return a + b; }
+	static T sub(T a, T b) { return a - b; }
+	static T mul(T a, T b) { return a * b; }
+};
+
+#ifdef AV_AUDIO_SSE
+struct fft_sse {
+	typedef __m128 T;
+	enum { width = 4 };
+	static T load(const float * p) { return _mm_loadu_ps(p); }
+	static void store(float * p, T v) { _mm_storeu_ps(p, v); }
+	static T set(float f) { return _mm_set1_ps(f); }
+	static T add(T a, T b) { return _mm_add_ps(a, b); }
+	static T sub(T a, T b) { return _mm_sub_ps(a, b); }
+	static T mul(T a, T b) { return _mm_mul_ps(a, b); }
+};
+#endif
+
+// one stage of radix p: n = m * p values in s interleaved sequences.
+// P is the radix for the specialised butterflies (so their loops unroll), or 0:
+template<typename V, int P>
+static void fft_stage(const av_FFT * self, int stage, int m, int s,
+	const float * xr, const float * xi, float * yr, float * yi) {
+	typedef typename V::T T;
+	const int p = P ? P : self->radix[stage];
+	const float * twr = self->twr[stage];
+	const float * twi = self->twi[stage];
+	const float * rootr = self->rootr[stage];
+	const float * rooti = self->rooti[stage];
+	const int sm = s * m;
+	T ar[AV_FFT_RADIX_MAX], ai[AV_FFT_RADIX_MAX];
+	T br[AV_FFT_RADIX_MAX], bi[AV_FFT_RADIX_MAX];
+	for (int j = 0; j < m; j++) {
+		for (int q = 0; q < s; q += V::width) {
+			const int in = q + s * j;
+			for (int r = 0; r < p; r++) {
+				ar[r] = V::load(xr + in + r * sm);
+				ai[r] = V::load(xi + in + r * sm);
+			}
+			switch (P) {
+			case 2:
+				br[0] = V::add(ar[0], ar[1]); bi[0] = V::add(ai[0], ai[1]);
+				br[1] = V::sub(ar[0], ar[1]); bi[1] = V::sub(ai[0], ai[1]);
+				break;
+			case 3: {
+				const T half = V::set(0.5f), s3 = V::set(0.8660254037844386f);
+				T t1r = V::add(ar[1], ar[2]), t1i = V::add(ai[1], ai[2]);
+				T t2r = V::sub(ar[0], V::mul(half, t1r)), t2i = V::sub(ai[0], V::mul(half, t1i));
+				// -i * sin(2pi/3) * (a1 - a2):
+				T t3r = V::mul(s3, V::sub(ai[1], ai[2])), t3i = V::mul(s3, V::sub(ar[2], ar[1]));
+				br[0] = V::add(ar[0], t1r); bi[0] = V::add(ai[0], t1i);
+				br[1] = V::add(t2r, t3r); bi[1] = V::add(t2i, t3i);
+				br[2] = V::sub(t2r, t3r); bi[2] = V::sub(t2i, t3i);
+			} break;
+			case 4: {
+				T t0r = V::add(ar[0], ar[2]), t0i = V::add(ai[0], ai[2]);
+				T t1r = V::sub(ar[0], ar[2]), t1i = V::sub(ai[0], ai[2]);
+				T t2r = V::add(ar[1], ar[3]), t2i = V::add(ai[1], ai[3]);
+				// -i * (a1 - a3):
+				T t3r = V::sub(ai[1], ai[3]), t3i = V::sub(ar[3], ar[1]);
+				br[0] = V::add(t0r, t2r); bi[0] = V::add(t0i, t2i);
+				br[1] = V::add(t1r, t3r); bi[1] = V::add(t1i, t3i);
+				br[2] = V::sub(t0r, t2r); bi[2] = V::sub(t0i, t2i);
+				br[3] = V::sub(t1r, t3r); bi[3] = V::sub(t1i, t3i);
+			} break;
+			default:
+				// a direct DFT for other prime radices:
+				for (int k = 0; k < p; k++) {
+					T sr = ar[0], si = ai[0];
+					for (int r = 1; r < p; r++) {
+						int e = (r * k) % p;
+						T cr = V::set(rootr[e]), ci = V::set(rooti[e]);
+						sr = V::add(sr, V::sub(V::mul(ar[r], cr), V::mul(ai[r], ci)));
+						si = V::add(si, V::add(V::mul(ar[r], ci), V::mul(ai[r], cr)));
+					}
+					br[k] = sr; bi[k] = si;
+				}
+				break;
+			}
+			const int out = q + s * p * j;
+			V::store(yr + out, br[0]);
+			V::store(yi + out, bi[0]);
+			for (int k = 1; k < p; k++) {
+				T wr = V::set(twr[(k - 1) * m + j]), wi = V::set(twi[(k - 1) * m + j]);
+				V::store(yr + out + s * k, V::sub(V::mul(br[k], wr), V::mul(bi[k], wi)));
+				V::store(yi + out + s * k, V::add(V::mul(br[k], wi), V::mul(bi[k], wr)));
+			}
+		}
+	}
+}
+
+template<typename V>
+static void fft_pass(const av_FFT * self, int stage, int m, int s,
+	const float * xr, const float * xi, float * yr, float * yi) {
+	switch (self->radix[stage]) {
+	case 2: fft_stage<V, 2>(self, stage, m, s, xr, xi, yr, yi); break;
+	case 3: fft_stage<V, 3>(self, stage, m, s, xr, xi, yr, yi); break;
+	case 4: fft_stage<V, 4>(self, stage, m, s, xr, xi, yr, yi); break;
+	default: fft_stage<V, 0>(self, stage, m, s, xr, xi, yr, yi); break;
+	}
+}
+
+// forward complex FFT of self->xr/xi; returns the arrays holding the result:
+static void fft_complex(av_FFT * self, float ** rr, float ** ri) {
+	float * xr = self->xr, * xi = self->xi, * yr = self->yr, * yi = self->yi;
+	int len = self->n, s = 1;
+	for (int i = 0; i < self->stages; i++) {
+		int m = len / self->radix[i];
+		#ifdef AV_AUDIO_SSE
+		if ((s & 3) == 0) {
+			fft_pass<fft_sse>(self, i, m, s, xr, xi, yr, yi);
+		} else
+		#endif
+		{
+			fft_pass<fft_scalar>(self, i, m, s, xr, xi, yr, yi);
+		}
+		float * t;
+		t = xr; xr = yr; yr = t;
+		t = xi; xi = yi; yi = t;
+		len = m;
+		s *= self->radix[i];
+	}
+	*rr = xr;
+	*ri = xi;
+}
+
+av_FFT * av_fft_create(int size) {
+	if (size < 2 || (size & 1)) return 0;
+	int n = size / 2;
+
+	// factor n, taking fours first (fewest passes), then small primes:
+	int radix[AV_FFT_STAGES_MAX];
+	int stages = 0;
+	int rest = n;
+	while (rest % 4 == 0 && stages < AV_FFT_STAGES_MAX) { radix[stages++] = 4; rest /= 4; }
+	for (int p = 2; p <= AV_FFT_RADIX_MAX && rest > 1 && stages < AV_FFT_STAGES_MAX; ) {
+		if (rest % p == 0) {
+			radix[stages++] = p;
+			rest /= p;
+		} else {
+			p++;
+		}
+	}
+	if (rest != 1) return 0;
+
+	av_FFT * self = (av_FFT *)calloc(1, sizeof(av_FFT));
+	self->size = size;
+	self->n = n;
+	self->stages = stages;
+	int len = n;
+	for (int i = 0; i < stages; i++) {
+		int p = radix[i];
+		int m = len / p;
+		self->radix[i] = p;
+		self->twr[i] = fft_array((p - 1) * m);
+		self->twi[i] = fft_array((p - 1) * m);
+		for (int k = 1; k < p; k++) {
+			for (int j = 0; j < m; j++) {
+				double a = -twopi * j * k / len;
+				self->twr[i][(k - 1) * m + j] = (float)cos(a);
+				self->twi[i][(k - 1) * m + j] = (float)sin(a);
+			}
+		}
+		if (p > 4) {
+			self->rootr[i] = fft_array(p);
+			self->rooti[i] = fft_array(p);
+			for (int k = 0; k < p; k++) {
+				self->rootr[i][k] = (float)cos(-twopi * k / p);
+				self->rooti[i][k] = (float)sin(-twopi * k / p);
+			}
+		}
+		len = m;
+	}
+	self->wr = fft_array(n);
+	self->wi = fft_array(n);
+	for (int k = 0; k < n; k++) {
+		double a = -twopi * k / size;
+		self->wr[k] = (float)cos(a);
+		self->wi[k] = (float)sin(a);
+	}
+	self->xr = fft_array(n);
+	self->xi = fft_array(n);
+	self->yr = fft_array(n);
+	self->yi = fft_array(n);
+	return self;
+}
+
+void av_fft_destroy(av_FFT * self) {
+	if (!self) return;
+	for (int i = 0; i < self->stages; i++) {
+		av_aligned_free(self->twr[i]);
+		av_aligned_free(self->twi[i]);
+		if (self->rootr[i]) av_aligned_free(self->rootr[i]);
+		if (self->rooti[i]) av_aligned_free(self->rooti[i]);
+	}
+	av_aligned_free(self->wr);
+	av_aligned_free(self->wi);
+	av_aligned_free(self->xr);
+	av_aligned_free(self->xi);
+	av_aligned_free(self->yr);
+	av_aligned_free(self->yi);
+	free(self);
+}
+
+int av_fft_size(const av_FFT * self) {
+	return self->size;
+}
+
+void av_fft_forward(av_FFT * self, const float * in, float * re, float * im) {
+	const int n = self->n;
+	// even samples as the real part, odd samples as the imaginary part:
+	for (int k = 0; k < n; k++) {
+		self->xr[k] = in[2 * k];
+		self->xi[k] = in[2 * k + 1];
+	}
+	float * zr, * zi;
+	fft_complex(self, &zr, &zi);
+	// split into the spectra of the even and odd samples, and recombine:
+	// X[k] = (Z[k] + Z*[n-k]) / 2 - i/2 W^k (Z[k] - Z*[n-k])
+	re[0] = zr[0] + zi[0];
+	im[0] = 0.f;
+	re[n] = zr[0] - zi[0];
+	im[n] = 0.f;
+	for (int k = 1; k < n; k++) {
+		float ar = zr[k], ai = zi[k];
+		float br = zr[n - k], bi = -zi[n - k];
+		float er = 0.5f * (ar + br), ei = 0.5f * (ai + bi);
+		// (a - b) * -i/2:
+		float or_ = 0.5f * (ai - bi), oi = -0.5f * (ar - br);
+		float wr = self->wr[k], wi = self->wi[k];
+		re[k] = er + or_ * wr - oi * wi;
+		im[k] = ei + or_ * wi + oi * wr;
+	}
+}
+
+void av_fft_inverse(av_FFT * self, const float * re, const float * im, float * out) {
+	const int n = self->n;
+	// rebuild the half-length spectrum Z = E + i O, conjugated so that the forward 
+	// transform computes the inverse:
+	for (int k = 0; k < n; k++) {
+		float ar = re[k], ai = im[k];
+		float br = re[n - k], bi = -im[n - k];
+		float er = 0.5f * (ar + br), ei = 0.5f * (ai + bi);
+		// O = (a - b) * conj(W^k) / 2:
+		float dr = 0.5f * (ar - br), di = 0.5f * (ai - bi);
+		float wr = self->wr[k], wi = -self->wi[k];
+		float or_ = dr * wr - di * wi, oi = dr * wi + di * wr;
+		self->xr[k] = er - oi;
+		self->xi[k] = -(ei + or_);
+	}
+	float * zr, * zi;
+	fft_complex(self, &zr, &zi);
+	const float scale = 1.f / n;
+	for (int k = 0; k < n; k++) {
+		out[2 * k] = zr[k] * scale;
+		out[2 * k + 1] = -zi[k] * scale;
+	}
+}
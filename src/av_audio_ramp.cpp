@@ -0,0 +1,148 @@
+#include "av_audio.hpp"
+
+#include <math.h>
+#include <string.h>
+
+// native parameter smoothing. each ramping parameter takes a slot in dense arrays, so
+// that a whole segment's worth of every ramp is computed in one SIMD pass; the results are
+// then scattered into the voice pool as the segment's starting value and per-frame slope.
+
+// exponential ramps get this close to the target (relative to where they started)
+// by the end of the ramp time, and then jump to it:
+#define RAMP_EXP_RESIDUE 0.001
+
+// slot arrays (AV_RAMPS_MAX is a multiple of the vector width, so the last vector can be
+// computed whole):
+static float value[AV_RAMPS_MAX];		// at the start of the segment
+static float target[AV_RAMPS_MAX];
+static float step[AV_RAMPS_MAX];		// per frame (linear)
+static float coef[AV_RAMPS_MAX];		// per frame (exponential), 1 for linear
+static float factor[AV_RAMPS_MAX];	// coef ^ factorframes
+static float remain[AV_RAMPS_MAX];	// frames left
+static float next[AV_RAMPS_MAX];		// at the end of the segment
+static float slope[AV_RAMPS_MAX];
+static double exact[AV_RAMPS_MAX];		// the target, as given
+static int entry[AV_RAMPS_MAX];			// pid * AV_AUDIO_VOICES_MAX + id
+static int count = 0;
+static int factorframes = 0;			// segment length that factor was computed for
+
+// the slot of each parameter, or -1:
+static int slots[AV_AUDIO_VOICE_PARAMS * AV_AUDIO_VOICES_MAX];
+static int initialized = 0;
+
+static void ramp_remove(av_VoicePool * pool, int s) {
+	int i = entry[s];
+	(&pool->slope[0][0])[i] = 0.f;
+	slots[i] = -1;
+	// the last slot moves into the gap:
+	int last = --count;
+	if (s != last) {
+		value[s] = value[last];
+		target[s] = target[last];
+		step[s] = step[last];
+		coef[s] = coef[last];
+		factor[s] = factor[last];
+		remain[s] = remain[last];
+		next[s] = next[last];
+		slope[s] = slope[last];
+		exact[s] = exact[last];
+		entry[s] = entry[last];
+		slots[entry[s]] = s;
+	}
+}
+
+void av_ramp_clear(av_VoicePool * pool) {
+	if (!initialized) {
+		for (int i = 0; i < AV_AUDIO_VOICE_PARAMS * AV_AUDIO_VOICES_MAX; i++) slots[i] = -1;
+		initialized = 1;
+	}
+	while (count) ramp_remove(pool, count - 1);
+}
+
+void av_ramp_cancel(av_VoicePool * pool, int id) {
+	for (int p = 0; p < AV_AUDIO_VOICE_PARAMS; p++) {
+		int s = slots[p * AV_AUDIO_VOICES_MAX + id];
+		if (s >= 0) ramp_remove(pool, s);
+	}
+}
+
+void av_ramp_set(av_VoicePool * pool, int id, int pid, double v, double frames, int shape) {
+	int i = pid * AV_AUDIO_VOICES_MAX + id;
+	int s = slots[i];
+	double from = pool->param[pid][id];
+	if (frames < 1. || from == v || (s < 0 && count >= AV_RAMPS_MAX)) {
+		// immediate (or out of slots):
+		if (s >= 0) ramp_remove(pool, s);
+		pool->param[pid][id] = v;
+		return;
+	}
+	if (s < 0) {
+		s = count++;
+		slots[i] = s;
+		entry[s] = i;
+	}
+	// a ramp already under way continues from where it has got to:
+	value[s] = (float)from;
+	target[s] = (float)v;
+	exact[s] = v;
+	remain[s] = (float)frames;
+	if (shape == AV_AUDIO_RAMP_EXP) {
+		step[s] = 0.f;
+		coef[s] = (float)pow(RAMP_EXP_RESIDUE, 1. / frames);
+		factor[s] = (float)pow((double)coef[s], (double)factorframes);
+	} else {
+		step[s] = (float)((v - from) / frames);
+		coef[s] = factor[s] = 1.f;
+	}
+}
+
+void av_ramp_begin(av_VoicePool * pool, int frames) {
+	if (!count) return;
+	// the per-segment factors only change with the segment length:
+	if (frames != factorframes) {
+		for (int s = 0; s < count; s++) {
+			factor[s] = coef[s] == 1.f ? 1.f : (float)pow((double)coef[s], (double)frames);
+		}
+		factorframes = frames;
+	}
+	int s = 0;
+	#ifdef AV_AUDIO_SSE
+	const __m128 n = _mm_set1_ps((float)frames);
+	const __m128 inv = _mm_set1_ps(1.f / frames);
+	for (; s < count; s += 4) {
+		// next = target + (value - target) * factor + step * n, or target once the time is up:
+		__m128 v = _mm_loadu_ps(value + s);
+		__m128 t = _mm_loadu_ps(target + s);
+		__m128 r = _mm_sub_ps(_mm_loadu_ps(remain + s), n);
+		__m128 e = _mm_add_ps(_mm_add_ps(t, _mm_mul_ps(_mm_sub_ps(v, t), _mm_loadu_ps(factor + s))), _mm_mul_ps(_mm_loadu_ps(step + s), n));
+		__m128 done = _mm_cmple_ps(r, _mm_setzero_ps());
+		e = _mm_or_ps(_mm_and_ps(done, t), _mm_andnot_ps(done, e));
+		_mm_storeu_ps(remain + s, r);
+		_mm_storeu_ps(next + s, e);
+		_mm_storeu_ps(slope + s, _mm_mul_ps(_mm_sub_ps(e, v), inv));
+	}
+	#else
+	for (; s < count; s++) {
+		remain[s] -= frames;
+		float e = target[s] + (value[s] - target[s]) * factor[s] + step[s] * frames;
+		next[s] = remain[s] <= 0.f ? target[s] : e;
+		slope[s] = (next[s] - value[s]) / frames;
+	}
+	#endif
+	// the pool's arrays, indexed as [pid * AV_AUDIO_VOICES_MAX + id]:
+	float * slopes = &pool->slope[0][0];
+	for (s = 0; s < count; s++) slopes[entry[s]] = slope[s];
+}
+
+void av_ramp_end(av_VoicePool * pool) {
+	double * params = &pool->param[0][0];
+	for (int s = count - 1; s >= 0; s--) {
+		if (remain[s] <= 0.f) {
+			params[entry[s]] = exact[s];
+			ramp_remove(pool, s);
+		} else {
+			value[s] = next[s];
+			params[entry[s]] = next[s];
+		}
+	}
+}
@@ -0,0 +1,364 @@
+#include "av_audio.hpp"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// recording of the output (and optionally the input) to disk.
+// the audio thread only copies each block into a ring; the writer thread drains it
+// into large writes, so the callback never touches the file. if the writer falls so far
+// behind that a block does not fit, the block is dropped and counted.
+
+#define RECORD_SECONDS 4				// ring capacity
+#define RECORD_RING_BYTES_MAX (1 << 26)	// ...unless that would be larger than this
+#define RECORD_ALIGN 4096				// the header is padded so that the data starts here
+#define RECORD_CHUNK (1 << 18)			// bytes per write (a multiple of RECORD_ALIGN)
+#define RECORD_UPDATE 1.				// seconds between header updates, so a crash leaves a readable file
+
+enum {
+	RECORD_WAV,		// RF64 once the data passes 4GB
+	RECORD_W64,
+	RECORD_CAF
+};
+
+// recorder states:
+enum {
+	RECORD_IDLE,		// owned by the main thread
+	RECORD_RUNNING,		// filled by the audio thread, drained by the writer thread
+	RECORD_STOPPING		// the writer thread finishes the file and returns it to idle
+};
+
+struct av_Recorder {
+	volatile long state;
+
+	// set before the recorder is published:
+	FILE * file;
+	char * path;
+	int format, outchannels, inchannels, channels;
+	double samplerate;
+	float * ring;
+	uint32_t frames;		// ring capacity (a power of two)
+	uint32_t wakeframes;	// pending frames at which the writer is woken
+
+	// free-running frame counters:
+	volatile uint32_t write;	// audio thread
+	volatile uint32_t read;		// writer thread
+
+	// audio thread only:
+	volatile uint32_t dropped;
+	volatile long wanted;		// a drain has been requested
+
+	// writer thread only:
+	unsigned char * chunk;
+	size_t used;				// bytes in chunk
+	volatile double written;	// frames on disk (a double, so that it can be read whole)
+	uint64_t bytes;				// data bytes on disk
+	uint64_t updated;			// data bytes when the header was last written
+	volatile long failed;
+};
+
+static av_Recorder rec;
+static av_thread record_thread;
+static av_semaphore record_wake;
+static int record_started = 0;
+static volatile long busy = 0;		// the audio thread is writing into the ring
+
+static void put_le16(unsigned char * p, uint32_t v) { p[0] = v; p[1] = v >> 8; }
+static void put_le32(unsigned char * p, uint32_t v) { put_le16(p, v); put_le16(p + 2, v >> 16); }
+static void put_le64(unsigned char * p, uint64_t v) { put_le32(p, (uint32_t)v); put_le32(p + 4, (uint32_t)(v >> 32)); }
+static void put_be32(unsigned char * p, uint32_t v) { p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v; }
+static void put_be64(unsigned char * p, uint64_t v) { put_be32(p, (uint32_t)(v >> 32)); put_be32(p + 4, (uint32_t)v); }
+
+// the Sony Wave64 chunk ids are GUIDs: a RIFF-like tag followed by a fixed suffix
+static void put_w64(unsigned char * p, const char * tag) {
+	static const unsigned char riff[12] = { 0x2E, 0x91, 0xCF, 0x11, 0xA5, 0xD6, 0x28, 0xDB, 0x04, 0xC1, 0x00, 0x00 };
+	static const unsigned char other[12] = { 0xF3, 0xAC, 0xD3, 0x11, 0x8C, 0xD1, 0x00, 0xC0, 0x4F, 0x8E, 0xDB, 0x8A };
+	memcpy(p, tag, 4);
+	memcpy(p + 4, strcmp(tag, "riff") ? other : riff, 12);
+}
+
+// fills the RECORD_ALIGN bytes before the data, for the given data size.
+// returns 1, or 2 if the data needed 64-bit sizes (a WAV becomes RF64):
+static int record_header(int format, int channels, double samplerate, unsigned char * h, uint64_t bytes) {
+	memset(h, 0, RECORD_ALIGN);
+	const uint32_t framebytes = channels * sizeof(float);
+	const uint64_t frames = bytes / framebytes;
+	if (format == RECORD_W64) {
+		put_w64(h, "riff");
+		put_le64(h + 16, RECORD_ALIGN + ((bytes + 7) & ~(uint64_t)7));
+		put_w64(h + 24, "wave");
+		put_w64(h + 40, "fmt ");
+		put_le64(h + 56, 24 + 18);
+		put_le16(h + 64, 3);	// WAVE_FORMAT_IEEE_FLOAT
+		put_le16(h + 66, channels);
+		put_le32(h + 68, (uint32_t)samplerate);
+		put_le32(h + 72, (uint32_t)samplerate * framebytes);
+		put_le16(h + 76, framebytes);
+		put_le16(h + 78, 32);
+		// chunks are 8-byte aligned, so the fmt chunk ends at 88:
+		put_w64(h + 88, "junk");
+		put_le64(h + 104, RECORD_ALIGN - 24 - 88);
+		put_w64(h + RECORD_ALIGN - 24, "data");
+		put_le64(h + RECORD_ALIGN - 8, 24 + bytes);
+	} else if (format == RECORD_CAF) {
+		// CAF is big-endian, but describes little-endian float samples here:
+		memcpy(h, "caff", 4);
+		h[5] = 1;	// version
+		memcpy(h + 8, "desc", 4);
+		put_be64(h + 12, 32);
+		union { double d; uint64_t u; } rate;
+		rate.d = samplerate;
+		put_be64(h + 20, rate.u);
+		memcpy(h + 28, "lpcm", 4);
+		put_be32(h + 32, 1 | 2);	// kCAFLinearPCMFormatFlagIsFloat | IsLittleEndian
+		put_be32(h + 36, framebytes);
+		put_be32(h + 40, 1);
+		put_be32(h + 44, channels);
+		put_be32(h + 48, 32);
+		memcpy(h + 52, "free", 4);
+		put_be64(h + 56, RECORD_ALIGN - 16 - 64);
+		memcpy(h + RECORD_ALIGN - 16, "data", 4);
+		// the size includes the edit count:
+		put_be64(h + RECORD_ALIGN - 12, 4 + bytes);
+	} else {
+		uint64_t riffsize = RECORD_ALIGN - 8 + bytes;
+		int rf64 = riffsize > 0xFFFFFFFFu;
+		memcpy(h, rf64 ? "RF64" : "RIFF", 4);
+		put_le32(h + 4, rf64 ? 0xFFFFFFFFu : (uint32_t)riffsize);
+		memcpy(h + 8, "WAVE", 4);
+		// room for the 64-bit sizes, should the file need them:
+		memcpy(h + 12, rf64 ? "ds64" : "JUNK", 4);
+		put_le32(h + 16, 28);
+		if (rf64) {
+			put_le64(h + 20, riffsize);
+			put_le64(h + 28, bytes);
+			put_le64(h + 36, frames);
+		}
+		memcpy(h + 48, "fmt ", 4);
+		put_le32(h + 52, 18);
+		put_le16(h + 56, 3);	// WAVE_FORMAT_IEEE_FLOAT
+		put_le16(h + 58, channels);
+		put_le32(h + 60, (uint32_t)samplerate);
+		put_le32(h + 64, (uint32_t)samplerate * framebytes);
+		put_le16(h + 68, framebytes);
+		put_le16(h + 70, 32);
+		memcpy(h + 74, "fact", 4);
+		put_le32(h + 78, 4);
+		put_le32(h + 82, rf64 ? 0xFFFFFFFFu : (uint32_t)frames);
+		memcpy(h + 86, "JUNK", 4);
+		put_le32(h + 90, RECORD_ALIGN - 8 - 94);
+		memcpy(h + RECORD_ALIGN - 8, "data", 4);
+		put_le32(h + RECORD_ALIGN - 4, rf64 ? 0xFFFFFFFFu : (uint32_t)bytes);
+		if (rf64) return 2;
+	}
+	return 1;
+}
+
+// writer thread (or main thread, before publishing):
+static int record_writeheader(av_Recorder * r) {
+	unsigned char h[RECORD_ALIGN];
+	record_header(r->format, r->channels, r->samplerate, h, r->bytes);
+	int ok = fseek(r->file, 0, SEEK_SET) == 0 && fwrite(h, 1, RECORD_ALIGN, r->file) == RECORD_ALIGN;
+	fseek(r->file, 0, SEEK_END);
+	r->updated = r->bytes;
+	return ok;
+}
+
+static void record_flush(av_Recorder * r) {
+	if (!r->used) return;
+	if (!r->failed) {
+		if (fwrite(r->chunk, 1, r->used, r->file) == r->used) {
+			r->bytes += r->used;
+			r->written = (double)(r->bytes / (r->channels * sizeof(float)));
+		} else {
+			printf("error writing audio recording %s\n", r->path);
+			r->failed = 1;
+		}
+	}
+	r->used = 0;
+}
+
+// copy everything the audio thread has written into the chunk, writing each time it fills:
+static void record_drain(av_Recorder * r) {
+	const size_t framebytes = r->channels * sizeof(float);
+	const size_t ringbytes = r->frames * framebytes;
+	const unsigned char * ring = (const unsigned char *)r->ring;
+	uint32_t read = r->read;
+	uint32_t write = av_atomic_load_acquire(&r->write);
+	size_t start = (read & (r->frames - 1)) * framebytes;
+	size_t total = (size_t)(write - read) * framebytes;
+	size_t copied = 0;
+	while (copied < total) {
+		size_t offset = (start + copied) % ringbytes;
+		size_t n = total - copied;
+		if (n > ringbytes - offset) n = ringbytes - offset;
+		if (n > RECORD_CHUNK - r->used) n = RECORD_CHUNK - r->used;
+		memcpy(r->chunk + r->used, ring + offset, n);
+		r->used += n;
+		copied += n;
+		if (r->used == RECORD_CHUNK) {
+			record_flush(r);
+			// whole frames copied so far are free for the audio thread again:
+			av_atomic_store_release(&r->read, read + (uint32_t)(copied / framebytes));
+		}
+	}
+	av_atomic_store_release(&r->read, write);
+}
+
+static void record_finish(av_Recorder * r) {
+	// the audio thread may still be in its last block:
+	while (av_atomic_load(&busy)) av_thread_yield();
+	record_drain(r);
+	record_flush(r);
+	// Wave64 chunks are padded to 8 bytes:
+	if (r->format == RECORD_W64 && (r->bytes & 7)) {
+		static const unsigned char pad[8] = { 0 };
+		fwrite(pad, 1, 8 - (r->bytes & 7), r->file);
+	}
+	if (!r->failed && !record_writeheader(r)) printf("error writing audio recording %s\n", r->path);
+	fclose(r->file);
+	printf("recorded %.0f frames of %d channels to %s (%u blocks dropped)\n", (double)r->written, r->channels, r->path, r->dropped);
+	free(r->path);
+	av_aligned_free(r->chunk);
+	av_aligned_free(r->ring);
+	r->file = 0;
+	r->path = 0;
+	r->chunk = 0;
+	r->ring = 0;
+	av_atomic_store_release(&r->state, (long)RECORD_IDLE);
+}
+
+static void * record_main(void * ud) {
+	for (;;) {
+		av_semaphore_wait(&record_wake);
+		av_atomic_exchange(&rec.wanted, 0);
+		long state = av_atomic_load(&rec.state);
+		if (state == RECORD_RUNNING) {
+			record_drain(&rec);
+			if (!rec.failed && rec.bytes - rec.updated >= RECORD_UPDATE * rec.samplerate * rec.channels * sizeof(float)) {
+				record_writeheader(&rec);
+			}
+		} else if (state == RECORD_STOPPING) {
+			record_finish(&rec);
+		}
+	}
+	return 0;
+}
+
+// audio thread: append the block just processed.
+void av_audio_record_write(const av_Audio * audio, unsigned int frames) {
+	av_atomic_store(&busy, 1);
+	if (av_atomic_load(&rec.state) == RECORD_RUNNING) {
+		uint32_t write = rec.write;
+		uint32_t pending = write - av_atomic_load_acquire(&rec.read);
+		if (rec.frames - pending < frames) {
+			rec.dropped++;
+		} else {
+			// channels beyond those of the current stream (after a reconfiguration) are silent:
+			const int channels = rec.channels;
+			const uint32_t mask = rec.frames - 1;
+			for (int c = 0; c < channels; c++) {
+				const float * src = 0;
+				if (c < rec.outchannels) {
+					if ((unsigned int)c < audio->outchannels) src = audio->output + c * audio->busstride;
+				} else if ((unsigned int)(c - rec.outchannels) < audio->inchannels) {
+					src = audio->input + (c - rec.outchannels) * audio->busstride;
+				}
+				float * dst = rec.ring + c;
+				for (unsigned int i = 0; i < frames; i++) {
+					dst[((write + i) & mask) * channels] = src ? src[i] : 0.f;
+				}
+			}
+			av_atomic_store_release(&rec.write, write + frames);
+			if (pending + frames >= rec.wakeframes && !av_atomic_exchange(&rec.wanted, 1)) {
+				av_semaphore_post(&record_wake);
+			}
+		}
+	}
+	av_atomic_store(&busy, 0);
+}
+
+// the file format follows the extension: .w64, .caf, or otherwise WAV
+static int record_format(const char * path) {
+	const char * ext = strrchr(path, '.');
+	char lower[8] = { 0 };
+	for (int i = 0; ext && ext[i + 1] && i < 7; i++) lower[i] = tolower(ext[i + 1]);
+	if (!strcmp(lower, "w64")) return RECORD_W64;
+	if (!strcmp(lower, "caf")) return RECORD_CAF;
+	return RECORD_WAV;
+}
+
+int av_audio_file_header(FILE * f, const char * path, int channels, double samplerate, uint64_t bytes) {
+	unsigned char h[RECORD_ALIGN];
+	int res = record_header(record_format(path), channels, samplerate, h, bytes);
+	int ok = fseek(f, 0, SEEK_SET) == 0 && fwrite(h, 1, RECORD_ALIGN, f) == RECORD_ALIGN;
+	fseek(f, 0, SEEK_END);
+	return ok ? res : 0;
+}
+
+int av_audio_record_start(const char * path, int input) {
+	av_Audio * audio = av_audio_get();
+	// a previous recording may still be finishing:
+	while (av_atomic_load_acquire(&rec.state) == RECORD_STOPPING) av_thread_yield();
+	if (rec.state != RECORD_IDLE) {
+		printf("already recording audio to %s\n", rec.path);
+		return 0;
+	}
+	av_Recorder * r = &rec;
+	r->outchannels = audio->outchannels;
+	r->inchannels = input ? audio->inchannels : 0;
+	r->channels = r->outchannels + r->inchannels;
+	if (r->channels <= 0) return 0;
+	r->file = fopen(path, "wb");
+	if (!r->file) {
+		printf("unable to record audio to %s\n", path);
+		return 0;
+	}
+	// the writes are already large, so there is no need for stdio to copy them:
+	setvbuf(r->file, 0, _IONBF, 0);
+	r->path = strdup(path);
+	r->format = record_format(path);
+	r->samplerate = audio->samplerate;
+	const uint32_t framebytes = r->channels * sizeof(float);
+	r->frames = 1;
+	while (r->frames < RECORD_SECONDS * audio->samplerate) r->frames <<= 1;
+	while ((uint64_t)r->frames * framebytes > RECORD_RING_BYTES_MAX && r->frames > 8 * (uint32_t)audio->blocksize) r->frames >>= 1;
+	r->wakeframes = RECORD_CHUNK / framebytes;
+	if (r->wakeframes > r->frames / 4) r->wakeframes = r->frames / 4;
+	r->ring = (float *)av_aligned_alloc(r->frames * framebytes);
+	r->chunk = (unsigned char *)av_aligned_alloc(RECORD_CHUNK);
+	r->write = 0;
+	r->read = 0;
+	r->dropped = 0;
+	r->wanted = 0;
+	r->used = 0;
+	r->written = 0.;
+	r->bytes = 0;
+	r->failed = 0;
+	record_writeheader(r);
+
+	if (!record_started) {
+		av_semaphore_init(&record_wake);
+		av_thread_create(&record_thread, record_main, 0);
+		record_started = 1;
+	}
+	av_atomic_store_release(&r->state, (long)RECORD_RUNNING);
+	return 1;
+}
+
+void av_audio_record_stop() {
+	if (!av_atomic_cas(&rec.state, RECORD_RUNNING, RECORD_STOPPING)) return;
+	// the writer thread completes the file:
+	av_semaphore_post(&record_wake);
+}
+
+int av_audio_record_info(av_AudioRecordInfo * info) {
+	long state = av_atomic_load_acquire(&rec.state);
+	info->recording = state != RECORD_IDLE;
+	info->channels = rec.channels;
+	info->frames = rec.written;
+	info->dropped = rec.dropped;
+	info->failed = (int)rec.failed;
+	return info->recording;
+}
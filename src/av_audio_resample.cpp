@@ -0,0 +1,189 @@
+#include "av_audio.hpp"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+// polyphase windowed-sinc sample rate conversion for arbitrary ratios.
+// the filter is tabulated at phases sub-sample offsets (plus one, so that the last can be
+// interpolated toward the next sample), and each output is a pair of SIMD dot products with
+// the two nearest phases, linearly interpolated.
+
+#define RESAMPLE_CHUNK 1024		// input frames buffered per channel, beyond the filter length
+
+struct av_ResamplePreset {
+	int taps, phases;
+	double beta;		// Kaiser window shape (stopband attenuation)
+	double rolloff;		// passband edge, as a fraction of the lower Nyquist frequency
+};
+
+static const av_ResamplePreset presets[] = {
+	{ 16, 128, 6., 0.85 },		// AV_RESAMPLE_FAST
+	{ 32, 256, 8., 0.91 },		// AV_RESAMPLE_MEDIUM
+	{ 64, 512, 10., 0.95 },		// AV_RESAMPLE_BEST
+};
+
+struct av_Resampler {
+	double inrate, outrate;
+	double step;		// input frames per output frame
+	double pos;			// of the next output, in frames from the start of the history
+	int channels, taps, half, phases;
+	float * table;		// (phases + 1) rows of taps coefficients
+	float * history[AV_AUDIO_STREAM_CHANNELS_MAX];	// planar input, capacity taps + RESAMPLE_CHUNK
+	int fill;			// frames in history
+};
+
+// zeroth-order modified Bessel function of the first kind:
+static double bessel_i0(double x) {
+	double sum = 1., term = 1.;
+	for (int k = 1; k < 50; k++) {
+		term *= (x / (2. * k)) * (x / (2. * k));
+		sum += term;
+		if (term < sum * 1e-12) break;
+	}
+	return sum;
+}
+
+static float resample_dot(const float * x, const float * h0, const float * h1, float t, int taps) {
+	#ifdef AV_AUDIO_SSE
+	__m128 s0 = _mm_setzero_ps(), s1 = _mm_setzero_ps();
+	for (int k = 0; k < taps; k += 4) {
+		__m128 v = _mm_loadu_ps(x + k);
+		s0 = _mm_add_ps(s0, _mm_mul_ps(v, _mm_load_ps(h0 + k)));
+		s1 = _mm_add_ps(s1, _mm_mul_ps(v, _mm_load_ps(h1 + k)));
+	}
+	float a[4], b[4];
+	_mm_storeu_ps(a, s0);
+	_mm_storeu_ps(b, s1);
+	float y0 = (a[0] + a[1]) + (a[2] + a[3]);
+	float y1 = (b[0] + b[1]) + (b[2] + b[3]);
+	#else
+	float y0 = 0.f, y1 = 0.f;
+	for (int k = 0; k < taps; k++) {
+		y0 += x[k] * h0[k];
+		y1 += x[k] * h1[k];
+	}
+	#endif
+	return y0 + t * (y1 - y0);
+}
+
+void av_resampler_reset(av_Resampler * self) {
+	// silence before the first input, so that the first output is centred on it:
+	self->fill = self->half - 1;
+	for (int c = 0; c < self->channels; c++) memset(self->history[c], 0, sizeof(float) * self->fill);
+	self->pos = self->half - 1;
+}
+
+av_Resampler * av_resampler_create(double inrate, double outrate, int channels, int quality) {
+	if (inrate <= 0. || outrate <= 0. || channels < 1 || channels > AV_AUDIO_STREAM_CHANNELS_MAX) return 0;
+	if (quality < AV_RESAMPLE_FAST) quality = AV_RESAMPLE_FAST;
+	if (quality > AV_RESAMPLE_BEST) quality = AV_RESAMPLE_BEST;
+	const av_ResamplePreset& q = presets[quality];
+
+	av_Resampler * self = (av_Resampler *)calloc(1, sizeof(av_Resampler));
+	self->inrate = inrate;
+	self->outrate = outrate;
+	self->step = inrate / outrate;
+	self->channels = channels;
+	// when downsampling, the filter spans as many output frames as it would otherwise:
+	// (in whole vectors)
+	double stretch = outrate < inrate ? inrate / outrate : 1.;
+	self->taps = 4 * (int)ceil(q.taps * stretch / 4.);
+	self->half = self->taps / 2;
+	self->phases = q.phases;
+
+	// when downsampling, the cutoff follows the output's Nyquist frequency:
+	double cut = q.rolloff * (outrate < inrate ? outrate / inrate : 1.);
+	const double pi = 3.141592653589793;
+	double norm = 1. / bessel_i0(q.beta);
+	const int taps = self->taps;
+	self->table = (float *)av_aligned_alloc(sizeof(float) * (q.phases + 1) * taps);
+	for (int p = 0; p <= q.phases; p++) {
+		float * row = self->table + p * taps;
+		double sum = 0.;
+		for (int k = 0; k < taps; k++) {
+			// distance of tap k from the output, in input frames:
+			double d = k - (self->half - 1) - (double)p / q.phases;
+			double w = d / self->half;
+			double window = fabs(w) < 1. ? bessel_i0(q.beta * sqrt(1. - w * w)) * norm : 0.;
+			double x = pi * cut * d;
+			double sinc = fabs(x) < 1e-9 ? 1. : sin(x) / x;
+			row[k] = (float)(cut * sinc * window);
+			sum += row[k];
+		}
+		// unity gain at DC for every phase:
+		for (int k = 0; k < taps; k++) row[k] = (float)(row[k] / sum);
+	}
+	for (int c = 0; c < channels; c++) {
+		self->history[c] = (float *)av_aligned_alloc(sizeof(float) * (taps + RESAMPLE_CHUNK));
+	}
+	av_resampler_reset(self);
+	return self;
+}
+
+void av_resampler_destroy(av_Resampler * self) {
+	if (!self) return;
+	for (int c = 0; c < self->channels; c++) av_aligned_free(self->history[c]);
+	av_aligned_free(self->table);
+	free(self);
+}
+
+int av_resampler_maxout(av_Resampler * self, int inframes) {
+	return (int)ceil((inframes + 1) / self->step) + 1;
+}
+
+int av_resampler_latency(av_Resampler * self) {
+	return self->half;
+}
+
+int av_resampler_process(av_Resampler * self, const float * in, int inframes, float * out) {
+	const int channels = self->channels, taps = self->taps, half = self->half;
+	const int capacity = taps + RESAMPLE_CHUNK;
+	int produced = 0;
+	while (inframes > 0) {
+		// append as much input as fits:
+		int n = capacity - self->fill;
+		if (n > inframes) n = inframes;
+		for (int c = 0; c < channels; c++) {
+			float * dst = self->history[c] + self->fill;
+			if (in) {
+				for (int i = 0; i < n; i++) dst[i] = in[i * channels + c];
+			} else {
+				memset(dst, 0, sizeof(float) * n);
+			}
+		}
+		if (in) in += n * channels;
+		inframes -= n;
+		self->fill += n;
+
+		// every output whose filter lies within the history:
+		double pos = self->pos;
+		while ((int)pos + half < self->fill) {
+			int ip = (int)pos;
+			float fp = (float)((pos - ip) * self->phases);
+			int p = (int)fp;
+			if (p >= self->phases) p = self->phases - 1;
+			const float * h0 = self->table + p * taps;
+			int start = ip - half + 1;
+			for (int c = 0; c < channels; c++) {
+				out[c] = resample_dot(self->history[c] + start, h0, h0 + taps, fp - p, taps);
+			}
+			out += channels;
+			produced++;
+			pos += self->step;
+		}
+
+		// forget what no later output needs:
+		int drop = (int)pos - half + 1;
+		if (drop > 0) {
+			if (drop > self->fill) drop = self->fill;
+			for (int c = 0; c < channels; c++) {
+				memmove(self->history[c], self->history[c] + drop, sizeof(float) * (self->fill - drop));
+			}
+			self->fill -= drop;
+			pos -= drop;
+		}
+		self->pos = pos;
+	}
+	return produced;
+}
@@ -0,0 +1,497 @@
+#include "av_audio.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// sample formats on disk:
+enum {
+	STREAM_PCM8U,	// WAV 8-bit (unsigned)
+	STREAM_PCM8,	// AIFF 8-bit (signed)
+	STREAM_PCM16,
+	STREAM_PCM24,
+	STREAM_PCM32,
+	STREAM_FLOAT32,
+	STREAM_FLOAT64
+};
+
+// slot states:
+enum {
+	STREAM_FREE,		// owned by the main thread
+	STREAM_PLAYING,		// filled by the I/O thread, read by one voice on the audio thread
+	STREAM_DONE			// released by the audio thread; the I/O thread closes it
+};
+
+struct av_AudioStream {
+	volatile long state;
+
+	// header (written before the stream is published):
+	FILE * file;
+	int channels, samplerate, format, bytes, bigendian, loop;
+	long datastart;
+	uint32_t length;		// frames in the file
+
+	// I/O thread only:
+	uint32_t position;		// next frame to read from the file
+	unsigned char * iobuf;
+	// files at another rate are converted to the audio samplerate as they are read:
+	av_Resampler * resampler;
+	float * decoded, * resampled;
+	uint32_t chunk;			// frames per read
+	uint32_t chunkmax;		// the most frames one resampled chunk can produce
+	int flushed;			// the resampler's lookahead has been emptied at the end of the file
+
+	// interleaved ring of decoded frames; write/read are free-running frame counters:
+	float * ring;
+	volatile uint32_t write;	// I/O thread
+	volatile uint32_t read;		// audio thread
+	volatile uint32_t end;		// frame count at which a non-looping stream ends (~0 until known)
+
+	// audio thread only:
+	volatile uint32_t played, underruns;
+	volatile long wanted;		// a refill has been requested
+};
+
+static av_AudioStream streams[AV_AUDIO_STREAMS_MAX];
+static av_thread io_thread;
+static av_semaphore io_wake;
+static int io_started = 0;
+// underruns across all streams since the last av_audio_stream_underruns():
+static volatile long underruns = 0;
+
+static uint32_t read_le32(const unsigned char * b) { return b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t)b[3] << 24); }
+static uint16_t read_le16(const unsigned char * b) { return b[0] | (b[1] << 8); }
+static uint32_t read_be32(const unsigned char * b) { return ((uint32_t)b[0] << 24) | (b[1] << 16) | (b[2] << 8) | b[3]; }
+static uint16_t read_be16(const unsigned char * b) { return (b[0] << 8) | b[1]; }
+
+// AIFF stores the sample rate as an 80-bit IEEE extended float:
+static double read_extended(const unsigned char * b) {
+	int exponent = ((b[0] & 0x7f) << 8) | b[1];
+	uint32_t hi = read_be32(b + 2);
+	uint32_t lo = read_be32(b + 6);
+	if (exponent == 0 && hi == 0 && lo == 0) return 0.;
+	double v = (hi * 4294967296. + lo) / 9223372036854775808.;	// mantissa / 2^63
+	exponent -= 16383;
+	while (exponent > 0) { v *= 2.; exponent--; }
+	while (exponent < 0) { v *= 0.5; exponent++; }
+	return (b[0] & 0x80) ? -v : v;
+}
+
+static int stream_parse_wav(av_AudioStream * s, FILE * f) {
+	unsigned char h[16];
+	int format = 0, bits = 0;
+	while (fread(h, 1, 8, f) == 8) {
+		uint32_t size = read_le32(h + 4);
+		long next = ftell(f) + size + (size & 1);
+		if (!memcmp(h, "fmt ", 4)) {
+			unsigned char fmt[40];
+			if (size < 16 || fread(fmt, 1, size < 40 ? size : 40, f) < 16) return 0;
+			format = read_le16(fmt);
+			s->channels = read_le16(fmt + 2);
+			s->samplerate = read_le32(fmt + 4);
+			bits = read_le16(fmt + 14);
+			// WAVE_FORMAT_EXTENSIBLE keeps the real format at the start of the subformat GUID:
+			if (format == 0xFFFE && size >= 26) format = read_le16(fmt + 24);
+		} else if (!memcmp(h, "data", 4)) {
+			if (!s->channels || !bits) return 0;
+			s->datastart = ftell(f);
+			s->bytes = bits / 8;
+			s->length = size / (s->bytes * s->channels);
+			if (format == 1) {
+				switch (bits) {
+					case 8: s->format = STREAM_PCM8U; break;
+					case 16: s->format = STREAM_PCM16; break;
+					case 24: s->format = STREAM_PCM24; break;
+					case 32: s->format = STREAM_PCM32; break;
+					default: return 0;
+				}
+			} else if (format == 3) {
+				if (bits == 32) s->format = STREAM_FLOAT32;
+				else if (bits == 64) s->format = STREAM_FLOAT64;
+				else return 0;
+			} else {
+				return 0;
+			}
+			return 1;
+		}
+		if (fseek(f, next, SEEK_SET)) return 0;
+	}
+	return 0;
+}
+
+static int stream_parse_aiff(av_AudioStream * s, FILE * f, int aifc) {
+	unsigned char h[26];
+	int bits = 0;
+	s->bigendian = 1;
+	s->format = -1;
+	while (fread(h, 1, 8, f) == 8) {
+		uint32_t size = read_be32(h + 4);
+		long next = ftell(f) + size + (size & 1);
+		if (!memcmp(h, "COMM", 4)) {
+			if (size < 18 || fread(h, 1, size < 26 ? size : 26, f) < 18) return 0;
+			s->channels = read_be16(h);
+			s->length = read_be32(h + 2);
+			bits = read_be16(h + 6);
+			s->samplerate = (int)read_extended(h + 8);
+			// the compression type comes first, since floats don't go by sample size:
+			const unsigned char * type = (aifc && size >= 22) ? h + 18 : (const unsigned char *)"NONE";
+			if (!memcmp(type, "fl32", 4) || !memcmp(type, "FL32", 4)) {
+				s->format = STREAM_FLOAT32;
+				s->bytes = 4;
+			} else if (!memcmp(type, "fl64", 4) || !memcmp(type, "FL64", 4)) {
+				s->format = STREAM_FLOAT64;
+				s->bytes = 8;
+			} else if (!memcmp(type, "NONE", 4) || !memcmp(type, "sowt", 4)) {
+				s->bigendian = memcmp(type, "sowt", 4) != 0;
+				s->bytes = (bits + 7) / 8;
+				switch (s->bytes) {
+					case 1: s->format = STREAM_PCM8; break;
+					case 2: s->format = STREAM_PCM16; break;
+					case 3: s->format = STREAM_PCM24; break;
+					case 4: s->format = STREAM_PCM32; break;
+					default: return 0;
+				}
+			} else {
+				return 0;
+			}
+		} else if (!memcmp(h, "SSND", 4)) {
+			if (s->format < 0 || !s->channels) return 0;
+			if (fread(h, 1, 8, f) != 8) return 0;
+			s->datastart = ftell(f) + read_be32(h);
+			return 1;
+		}
+		if (fseek(f, next, SEEK_SET)) return 0;
+	}
+	return 0;
+}
+
+// opens a sound file and reads its header, leaving it at the start of the samples:
+static FILE * stream_fopen(av_AudioStream * s, const char * path) {
+	FILE * f = fopen(path, "rb");
+	if (!f) {
+		printf("could not open %s\n", path);
+		return 0;
+	}
+	unsigned char h[12];
+	int ok = 0;
+	s->bigendian = 0;
+	s->channels = 0;
+	if (fread(h, 1, 12, f) == 12) {
+		if (!memcmp(h, "RIFF", 4) && !memcmp(h + 8, "WAVE", 4)) {
+			ok = stream_parse_wav(s, f);
+		} else if (!memcmp(h, "FORM", 4) && !memcmp(h + 8, "AIFF", 4)) {
+			ok = stream_parse_aiff(s, f, 0);
+		} else if (!memcmp(h, "FORM", 4) && !memcmp(h + 8, "AIFC", 4)) {
+			ok = stream_parse_aiff(s, f, 1);
+		}
+	}
+	if (!ok || s->channels > AV_AUDIO_STREAM_CHANNELS_MAX || fseek(f, s->datastart, SEEK_SET)) {
+		printf("unsupported sound file %s\n", path);
+		fclose(f);
+		return 0;
+	}
+	return f;
+}
+
+// convert n interleaved samples from disk to float:
+static void stream_convert(const av_AudioStream * s, const unsigned char * src, float * dst, int n) {
+	int be = s->bigendian;
+	switch (s->format) {
+		case STREAM_PCM8U:
+			for (int i = 0; i < n; i++) dst[i] = (src[i] - 128) * (1.f / 128.f);
+			break;
+		case STREAM_PCM8:
+			for (int i = 0; i < n; i++) dst[i] = (signed char)src[i] * (1.f / 128.f);
+			break;
+		case STREAM_PCM16:
+			for (int i = 0; i < n; i++, src += 2) {
+				int16_t v = be ? (int16_t)read_be16(src) : (int16_t)read_le16(src);
+				dst[i] = v * (1.f / 32768.f);
+			}
+			break;
+		case STREAM_PCM24:
+			for (int i = 0; i < n; i++, src += 3) {
+				int32_t v = be
+					? (int32_t)(((uint32_t)src[0] << 24) | (src[1] << 16) | (src[2] << 8))
+					: (int32_t)(((uint32_t)src[2] << 24) | (src[1] << 16) | (src[0] << 8));
+				dst[i] = (v >> 8) * (1.f / 8388608.f);
+			}
+			break;
+		case STREAM_PCM32:
+			for (int i = 0; i < n; i++, src += 4) {
+				int32_t v = (int32_t)(be ? read_be32(src) : read_le32(src));
+				dst[i] = (float)(v * (1. / 2147483648.));
+			}
+			break;
+		case STREAM_FLOAT32:
+			for (int i = 0; i < n; i++, src += 4) {
+				union { uint32_t u; float f; } v;
+				v.u = be ? read_be32(src) : read_le32(src);
+				dst[i] = v.f;
+			}
+			break;
+		case STREAM_FLOAT64:
+			for (int i = 0; i < n; i++, src += 8) {
+				union { uint64_t u; double d; } v;
+				uint64_t lo = be ? read_be32(src + 4) : read_le32(src);
+				uint64_t hi = be ? read_be32(src) : read_le32(src + 4);
+				v.u = (hi << 32) | lo;
+				dst[i] = (float)v.d;
+			}
+			break;
+	}
+}
+
+// copy resampled frames into the ring at write, wrapping around its end:
+static void stream_put(av_AudioStream * s, uint32_t write, uint32_t n) {
+	uint32_t offset = write & (AV_AUDIO_STREAM_FRAMES - 1);
+	uint32_t first = n < AV_AUDIO_STREAM_FRAMES - offset ? n : AV_AUDIO_STREAM_FRAMES - offset;
+	memcpy(s->ring + offset * s->channels, s->resampled, sizeof(float) * first * s->channels);
+	memcpy(s->ring, s->resampled + first * s->channels, sizeof(float) * (n - first) * s->channels);
+}
+
+// I/O thread: top up the ring of a playing stream; returns frames read:
+static uint32_t stream_fill(av_AudioStream * s) {
+	uint32_t total = 0;
+	uint32_t need = s->resampler ? s->chunkmax : AV_AUDIO_STREAM_CHUNK;
+	for (;;) {
+		uint32_t write = s->write;
+		uint32_t space = AV_AUDIO_STREAM_FRAMES - (write - av_atomic_load_acquire(&s->read));
+		if (space < need) break;
+
+		if (s->position >= s->length) {
+			if (!s->loop || s->length == 0) {
+				if (s->resampler && !s->flushed) {
+					// the last frames are still in the filter's lookahead:
+					uint32_t n = av_resampler_process(s->resampler, 0, av_resampler_latency(s->resampler), s->resampled);
+					stream_put(s, write, n);
+					write += n;
+					s->flushed = 1;
+					av_atomic_store_release(&s->write, write);
+				}
+				av_atomic_store_release(&s->end, write);
+				break;
+			}
+			s->position = 0;
+			fseek(s->file, s->datastart, SEEK_SET);
+		}
+
+		// never read across the end of the file, or the end of the ring:
+		uint32_t n = s->chunk;
+		if (n > s->length - s->position) n = s->length - s->position;
+		uint32_t offset = write & (AV_AUDIO_STREAM_FRAMES - 1);
+		if (!s->resampler && n > AV_AUDIO_STREAM_FRAMES - offset) n = AV_AUDIO_STREAM_FRAMES - offset;
+
+		size_t got = fread(s->iobuf, s->bytes * s->channels, n, s->file);
+		if (got == 0) {
+			// truncated file: treat as ended here
+			s->length = s->position;
+			continue;
+		}
+		s->position += (uint32_t)got;
+		total += (uint32_t)got;
+		if (s->resampler) {
+			// the end is only known once the lookahead has been flushed (above):
+			stream_convert(s, s->iobuf, s->decoded, (int)got * s->channels);
+			uint32_t produced = av_resampler_process(s->resampler, s->decoded, (int)got, s->resampled);
+			stream_put(s, write, produced);
+			av_atomic_store_release(&s->write, write + produced);
+		} else {
+			stream_convert(s, s->iobuf, s->ring + offset * s->channels, (int)got * s->channels);
+			if (s->position >= s->length && !s->loop) av_atomic_store_release(&s->end, write + (uint32_t)got);
+			av_atomic_store_release(&s->write, write + (uint32_t)got);
+		}
+	}
+	return total;
+}
+
+static void stream_release(av_AudioStream * s) {
+	fclose(s->file);
+	free(s->iobuf);
+	av_aligned_free(s->ring);
+	av_resampler_destroy(s->resampler);
+	free(s->decoded);
+	free(s->resampled);
+	s->file = 0;
+	s->iobuf = 0;
+	s->ring = 0;
+	s->resampler = 0;
+	s->decoded = 0;
+	s->resampled = 0;
+	av_atomic_store_release(&s->state, (long)STREAM_FREE);
+}
+
+static void * io_main(void * ud) {
+	for (;;) {
+		av_semaphore_wait(&io_wake);
+		for (int id = 1; id < AV_AUDIO_STREAMS_MAX; id++) {
+			av_AudioStream * s = &streams[id];
+			long state = av_atomic_load_acquire(&s->state);
+			if (state == STREAM_PLAYING) {
+				av_atomic_exchange(&s->wanted, 0);
+				stream_fill(s);
+			} else if (state == STREAM_DONE) {
+				stream_release(s);
+			}
+		}
+	}
+	return 0;
+}
+
+int av_audio_stream_open(const char * path, int loop) {
+	int id = 1;
+	while (id < AV_AUDIO_STREAMS_MAX && av_atomic_load_acquire(&streams[id].state) != STREAM_FREE) id++;
+	if (id >= AV_AUDIO_STREAMS_MAX) {
+		printf("too many audio streams open\n");
+		return 0;
+	}
+	av_AudioStream * s = &streams[id];
+
+	FILE * f = stream_fopen(s, path);
+	if (!f) return 0;
+
+	s->file = f;
+	s->loop = loop;
+	s->position = 0;
+	s->iobuf = (unsigned char *)malloc(AV_AUDIO_STREAM_CHUNK * s->channels * s->bytes);
+	s->ring = (float *)av_aligned_alloc(sizeof(float) * AV_AUDIO_STREAM_FRAMES * s->channels);
+	s->chunk = AV_AUDIO_STREAM_CHUNK;
+	av_Audio * audio = av_audio_get();
+	if (s->samplerate != (int)audio->samplerate) {
+		s->resampler = av_resampler_create(s->samplerate, audio->samplerate, s->channels, audio->resamplequality);
+	}
+	if (s->resampler) {
+		// a resampled chunk (or the final flush) must fit in half of the ring:
+		while (s->chunk > 64 && av_resampler_maxout(s->resampler, s->chunk) > AV_AUDIO_STREAM_FRAMES / 2) s->chunk /= 2;
+		uint32_t flush = av_resampler_latency(s->resampler);
+		s->chunkmax = av_resampler_maxout(s->resampler, s->chunk > flush ? s->chunk : flush);
+		s->decoded = (float *)malloc(sizeof(float) * s->chunk * s->channels);
+		s->resampled = (float *)malloc(sizeof(float) * s->chunkmax * s->channels);
+		s->flushed = 0;
+	}
+	s->write = 0;
+	s->read = 0;
+	s->end = ~0u;
+	s->played = 0;
+	s->underruns = 0;
+	s->wanted = 0;
+
+	// prefill, so that playback can start straight away:
+	stream_fill(s);
+
+	if (!io_started) {
+		av_semaphore_init(&io_wake);
+		av_thread_create(&io_thread, io_main, 0);
+		io_started = 1;
+	}
+	av_atomic_store_release(&s->state, (long)STREAM_PLAYING);
+	return id;
+}
+
+int av_audio_stream_info(int id, av_AudioStreamInfo * info) {
+	if (id <= 0 || id >= AV_AUDIO_STREAMS_MAX) return 0;
+	av_AudioStream * s = &streams[id];
+	if (av_atomic_load_acquire(&s->state) != STREAM_PLAYING) return 0;
+	info->channels = s->channels;
+	info->samplerate = s->samplerate;
+	info->frames = s->length;
+	info->played = s->played;
+	info->underruns = s->underruns;
+	info->finished = s->read == av_atomic_load_acquire(&s->end);
+	return 1;
+}
+
+void av_audio_stream_close(int id) {
+	if (id <= 0 || id >= AV_AUDIO_STREAMS_MAX) return;
+	av_AudioStream * s = &streams[id];
+	if (av_atomic_load_acquire(&s->state) != STREAM_PLAYING) return;
+	// no kernel can be reading it now; the I/O thread frees it:
+	av_atomic_store_release(&s->state, (long)STREAM_DONE);
+	av_semaphore_post(&io_wake);
+}
+
+float * av_audio_sound_load(const char * path, av_AudioStreamInfo * info) {
+	av_AudioStream s;
+	memset(&s, 0, sizeof(s));
+	FILE * f = stream_fopen(&s, path);
+	if (!f) return 0;
+	size_t samples = (size_t)s.length * s.channels;
+	float * data = (float *)malloc(sizeof(float) * (samples ? samples : 1));
+	unsigned char * buf = (unsigned char *)malloc(AV_AUDIO_STREAM_CHUNK * s.channels * s.bytes);
+	uint32_t frames = 0;
+	while (frames < s.length) {
+		uint32_t n = s.length - frames < AV_AUDIO_STREAM_CHUNK ? s.length - frames : AV_AUDIO_STREAM_CHUNK;
+		size_t got = fread(buf, s.bytes * s.channels, n, f);
+		if (got == 0) break;
+		stream_convert(&s, buf, data + (size_t)frames * s.channels, (int)got * s.channels);
+		frames += (uint32_t)got;
+	}
+	free(buf);
+	fclose(f);
+	if (info) {
+		info->channels = s.channels;
+		info->samplerate = s.samplerate;
+		info->frames = frames;
+		info->played = 0;
+		info->underruns = 0;
+		info->finished = 1;
+	}
+	return data;
+}
+
+void av_audio_sound_free(float * data) {
+	free(data);
+}
+
+uint32_t av_audio_stream_underruns() {
+	return (uint32_t)av_atomic_exchange(&underruns, 0);
+}
+
+// params: 0 stream id, 1 amplitude, 2 pan (0..1, mono files only)
+void av_kernel_stream(av_VoicePool * pool, int id, float * out, int stride, int channels, int frames) {
+	int sid = (int)pool->param[0][id];
+	if (sid <= 0 || sid >= AV_AUDIO_STREAMS_MAX) return;
+	av_AudioStream * s = &streams[sid];
+	if (av_atomic_load_acquire(&s->state) != STREAM_PLAYING) return;
+
+	uint32_t read = s->read;
+	uint32_t avail = av_atomic_load_acquire(&s->write) - read;
+	uint32_t n = (uint32_t)frames < avail ? (uint32_t)frames : avail;
+	if (n < (uint32_t)frames && read + n != av_atomic_load_acquire(&s->end)) {
+		// the I/O thread fell behind:
+		s->underruns++;
+		av_atomic_add(&underruns, 1);
+	}
+
+	// amplitude and pan may be ramping:
+	float amp = (float)pool->param[1][id];
+	float damp = pool->slope[1][id];
+	int sc = s->channels;
+	if (sc == 1) {
+		float pan = (float)pool->param[2][id], dpan = pool->slope[2][id];
+		float gains[2] = { amp * (1.f - pan), amp * pan };
+		float dgains[2] = { damp * (1.f - pan) - amp * dpan, damp * pan + amp * dpan };
+		for (uint32_t i = 0; i < n; i++) {
+			float v = s->ring[(read + i) & (AV_AUDIO_STREAM_FRAMES - 1)];
+			out[i] += gains[0] * v;
+			out[stride + i] += gains[1] * v;
+			gains[0] += dgains[0];
+			gains[1] += dgains[1];
+		}
+	} else {
+		// file channel c plays on output channel c:
+		int cmax = sc < channels ? sc : channels;
+		for (uint32_t i = 0; i < n; i++) {
+			const float * frame = s->ring + ((read + i) & (AV_AUDIO_STREAM_FRAMES - 1)) * sc;
+			for (int c = 0; c < cmax; c++) out[c * stride + i] += amp * frame[c];
+			amp += damp;
+		}
+	}
+	av_atomic_store_release(&s->read, read + n);
+	s->played += n;
+
+	// ask for more once the ring is half empty:
+	if (avail - n < AV_AUDIO_STREAM_FRAMES / 2 && !av_atomic_exchange(&s->wanted, 1)) {
+		av_semaphore_post(&io_wake);
+	}
+}
@@ -0,0 +1,413 @@
+#include "av_audio.hpp"
+
+#include <math.h>
+#include <string.h>
+
+static const double pi = 3.141592653589793;
+static const double twopi = 6.283185307179586;
+
+// sin(2 pi x) for x in [-0.5, 0.5): fold to [-0.25, 0.25], then an odd Taylor polynomial
+// (error below 4e-7):
+static inline float sine_poly(float x) {
+	if (x > 0.25f) x = 0.5f - x;
+	else if (x < -0.25f) x = -0.5f - x;
+	float y = x * (float)twopi;
+	float y2 = y * y;
+	return y * (1.f + y2 * (-1.f/6.f + y2 * (1.f/120.f + y2 * (-1.f/5040.f + y2 * (1.f/362880.f + y2 * (-1.f/39916800.f))))));
+}
+
+static inline double wrap(double phase) {
+	return phase - floor(phase);
+}
+
+void av_osc_setfreq(av_Osc * self, double freq, double samplerate) {
+	self->incr = freq / samplerate;
+}
+
+void av_osc_sine(av_Osc * self, float * out, int frames) {
+	double phase = wrap(self->phase);
+	double incr = self->incr;
+	int i = 0;
+	#ifdef AV_AUDIO_SSE
+	// four phases at a time, re-based on the double-precision phase each step:
+	const __m128 ramp = _mm_mul_ps(_mm_set_ps(3.f, 2.f, 1.f, 0.f), _mm_set1_ps((float)incr));
+	const __m128 half = _mm_set1_ps(0.5f);
+	const __m128 quarter = _mm_set1_ps(0.25f);
+	const __m128 one = _mm_set1_ps(1.f);
+	const __m128 c1 = _mm_set1_ps(-1.f/6.f), c2 = _mm_set1_ps(1.f/120.f), c3 = _mm_set1_ps(-1.f/5040.f);
+	const __m128 c4 = _mm_set1_ps(1.f/362880.f), c5 = _mm_set1_ps(-1.f/39916800.f);
+	for (; i + 4 <= frames; i += 4) {
+		__m128 x = _mm_add_ps(_mm_set1_ps((float)phase), ramp);
+		// into [-0.5, 0.5) (|incr| is at most half a cycle, so x is within (-2, 3)):
+		x = _mm_sub_ps(x, _mm_and_ps(_mm_cmpge_ps(x, half), one));
+		x = _mm_sub_ps(x, _mm_and_ps(_mm_cmpge_ps(x, half), one));
+		x = _mm_add_ps(x, _mm_and_ps(_mm_cmplt_ps(x, _mm_sub_ps(_mm_setzero_ps(), half)), one));
+		x = _mm_add_ps(x, _mm_and_ps(_mm_cmplt_ps(x, _mm_sub_ps(_mm_setzero_ps(), half)), one));
+		// fold into [-0.25, 0.25]:
+		__m128 hi = _mm_cmpgt_ps(x, quarter);
+		x = _mm_or_ps(_mm_and_ps(hi, _mm_sub_ps(half, x)), _mm_andnot_ps(hi, x));
+		__m128 lo = _mm_cmplt_ps(x, _mm_sub_ps(_mm_setzero_ps(), quarter));
+		x = _mm_or_ps(_mm_and_ps(lo, _mm_sub_ps(_mm_sub_ps(_mm_setzero_ps(), half), x)), _mm_andnot_ps(lo, x));
+		__m128 y = _mm_mul_ps(x, _mm_set1_ps((float)twopi));
+		__m128 y2 = _mm_mul_ps(y, y);
+		__m128 p = _mm_add_ps(c4, _mm_mul_ps(y2, c5));
+		p = _mm_add_ps(c3, _mm_mul_ps(y2, p));
+		p = _mm_add_ps(c2, _mm_mul_ps(y2, p));
+		p = _mm_add_ps(c1, _mm_mul_ps(y2, p));
+		p = _mm_add_ps(one, _mm_mul_ps(y2, p));
+		_mm_storeu_ps(out + i, _mm_mul_ps(y, p));
+		phase = wrap(phase + 4. * incr);
+	}
+	#endif
+	for (; i < frames; i++) {
+		float x = (float)(phase >= 0.5 ? phase - 1. : phase);
+		out[i] = sine_poly(x);
+		phase = wrap(phase + incr);
+	}
+	self->phase = phase;
+}
+
+// polynomial correction for a unit step at phase 0, t being the phase and dt the increment:
+static inline double polyblep(double t, double dt) {
+	if (t < dt) {
+		t /= dt;
+		return t + t - t*t - 1.;
+	} else if (t > 1. - dt) {
+		t = (t - 1.) / dt;
+		return t*t + t + t + 1.;
+	}
+	return 0.;
+}
+
+void av_osc_saw(av_Osc * self, float * out, int frames) {
+	double phase = wrap(self->phase);
+	double dt = fabs(self->incr);
+	for (int i = 0; i < frames; i++) {
+		out[i] = (float)(2. * phase - 1. - polyblep(phase, dt));
+		phase = wrap(phase + self->incr);
+	}
+	self->phase = phase;
+}
+
+void av_osc_square(av_Osc * self, float * out, int frames) {
+	double phase = wrap(self->phase);
+	double dt = fabs(self->incr);
+	for (int i = 0; i < frames; i++) {
+		double v = phase < 0.5 ? 1. : -1.;
+		v += polyblep(phase, dt);
+		v -= polyblep(wrap(phase + 0.5), dt);
+		out[i] = (float)v;
+		phase = wrap(phase + self->incr);
+	}
+	self->phase = phase;
+}
+
+// the triangle's corners are only discontinuities of slope, so its harmonics already
+// fall away at 12dB per octave; it is computed directly:
+void av_osc_triangle(av_Osc * self, float * out, int frames) {
+	double phase = wrap(self->phase);
+	for (int i = 0; i < frames; i++) {
+		double v = phase < 0.5 ? 4. * phase - 1. : 3. - 4. * phase;
+		out[i] = (float)v;
+		phase = wrap(phase + self->incr);
+	}
+	self->phase = phase;
+}
+
+void av_osc_table(av_Osc * self, const float * table, int size, float * out, int frames) {
+	double phase = wrap(self->phase);
+	int mask = size - 1;
+	for (int i = 0; i < frames; i++) {
+		double pos = phase * size;
+		int i0 = (int)pos;
+		float frac = (float)(pos - i0);
+		float a = table[i0 & mask];
+		float b = table[(i0 + 1) & mask];
+		out[i] = a + frac * (b - a);
+		phase = wrap(phase + self->incr);
+	}
+	self->phase = phase;
+}
+
+// coefficients from Robert Bristow-Johnson's audio EQ cookbook:
+void av_biquad_set(av_Biquad * self, int type, double freq, double q, double gain, double samplerate) {
+	double w = twopi * freq / samplerate;
+	double cw = cos(w), sw = sin(w);
+	if (q <= 0.) q = 0.707;
+	double alpha = sw / (2. * q);
+	double A = pow(10., gain / 40.);
+	double b0, b1, b2, a0, a1, a2;
+	switch (type) {
+		case AV_BIQUAD_HIGHPASS:
+			b0 = (1. + cw) * 0.5; b1 = -(1. + cw); b2 = b0;
+			a0 = 1. + alpha; a1 = -2. * cw; a2 = 1. - alpha;
+			break;
+		case AV_BIQUAD_BANDPASS:
+			b0 = alpha; b1 = 0.; b2 = -alpha;
+			a0 = 1. + alpha; a1 = -2. * cw; a2 = 1. - alpha;
+			break;
+		case AV_BIQUAD_NOTCH:
+			b0 = 1.; b1 = -2. * cw; b2 = 1.;
+			a0 = 1. + alpha; a1 = -2. * cw; a2 = 1. - alpha;
+			break;
+		case AV_BIQUAD_PEAK:
+			b0 = 1. + alpha * A; b1 = -2. * cw; b2 = 1. - alpha * A;
+			a0 = 1. + alpha / A; a1 = -2. * cw; a2 = 1. - alpha / A;
+			break;
+		case AV_BIQUAD_LOWSHELF: {
+			double sa = 2. * sqrt(A) * alpha;
+			b0 = A * ((A + 1.) - (A - 1.) * cw + sa);
+			b1 = 2. * A * ((A - 1.) - (A + 1.) * cw);
+			b2 = A * ((A + 1.) - (A - 1.) * cw - sa);
+			a0 = (A + 1.) + (A - 1.) * cw + sa;
+			a1 = -2. * ((A - 1.) + (A + 1.) * cw);
+			a2 = (A + 1.) + (A - 1.) * cw - sa;
+		} break;
+		case AV_BIQUAD_HIGHSHELF: {
+			double sa = 2. * sqrt(A) * alpha;
+			b0 = A * ((A + 1.) + (A - 1.) * cw + sa);
+			b1 = -2. * A * ((A - 1.) + (A + 1.) * cw);
+			b2 = A * ((A + 1.) + (A - 1.) * cw - sa);
+			a0 = (A + 1.) - (A - 1.) * cw + sa;
+			a1 = 2. * ((A - 1.) - (A + 1.) * cw);
+			a2 = (A + 1.) - (A - 1.) * cw - sa;
+		} break;
+		default: // AV_BIQUAD_LOWPASS
+			b0 = (1. - cw) * 0.5; b1 = 1. - cw; b2 = b0;
+			a0 = 1. + alpha; a1 = -2. * cw; a2 = 1. - alpha;
+	}
+	self->b0 = (float)(b0 / a0);
+	self->b1 = (float)(b1 / a0);
+	self->b2 = (float)(b2 / a0);
+	self->a1 = (float)(a1 / a0);
+	self->a2 = (float)(a2 / a0);
+}
+
+// transposed direct form II:
+void av_biquad_process(av_Biquad * self, const float * in, float * out, int frames) {
+	float b0 = self->b0, b1 = self->b1, b2 = self->b2, a1 = self->a1, a2 = self->a2;
+	float z1 = self->z1, z2 = self->z2;
+	for (int i = 0; i < frames; i++) {
+		float x = in[i];
+		float y = b0 * x + z1;
+		z1 = b1 * x - a1 * y + z2;
+		z2 = b2 * x - a2 * y;
+		out[i] = y;
+	}
+	// flush denormals:
+	if (fabsf(z1) < 1e-20f) z1 = 0.f;
+	if (fabsf(z2) < 1e-20f) z2 = 0.f;
+	self->z1 = z1;
+	self->z2 = z2;
+}
+
+// Andrew Simper's trapezoidal-integrator SVF:
+void av_svf_set(av_SVF * self, double freq, double q, double samplerate) {
+	if (q <= 0.) q = 0.707;
+	double f = freq < samplerate * 0.49 ? freq : samplerate * 0.49;
+	double g = tan(pi * f / samplerate);
+	double k = 1. / q;
+	double a1 = 1. / (1. + g * (g + k));
+	self->k = (float)k;
+	self->a1 = (float)a1;
+	self->a2 = (float)(g * a1);
+	self->a3 = (float)(g * g * a1);
+}
+
+void av_svf_process(av_SVF * self, const float * in, float * low, float * band, float * high, int frames) {
+	float k = self->k, a1 = self->a1, a2 = self->a2, a3 = self->a3;
+	float ic1 = self->ic1, ic2 = self->ic2;
+	for (int i = 0; i < frames; i++) {
+		float v0 = in[i];
+		float v3 = v0 - ic2;
+		float v1 = a1 * ic1 + a2 * v3;
+		float v2 = ic2 + a2 * ic1 + a3 * v3;
+		ic1 = 2.f * v1 - ic1;
+		ic2 = 2.f * v2 - ic2;
+		if (low) low[i] = v2;
+		if (band) band[i] = v1;
+		if (high) high[i] = v0 - k * v1 - v2;
+	}
+	if (fabsf(ic1) < 1e-20f) ic1 = 0.f;
+	if (fabsf(ic2) < 1e-20f) ic2 = 0.f;
+	self->ic1 = ic1;
+	self->ic2 = ic2;
+}
+
+enum {
+	ENV_IDLE,
+	ENV_ATTACK,
+	ENV_DECAY,
+	ENV_SUSTAIN,
+	ENV_RELEASE
+};
+
+void av_env_set(av_Env * self, double attack, double decay, double sustain, double release, double samplerate) {
+	// at least one sample per segment:
+	self->attack = (float)(attack * samplerate > 1. ? attack * samplerate : 1.);
+	self->decay = (float)(decay * samplerate > 1. ? decay * samplerate : 1.);
+	self->sustain = (float)sustain;
+	self->release = (float)(release * samplerate > 1. ? release * samplerate : 1.);
+}
+
+void av_env_gate(av_Env * self, int on) {
+	if (on) {
+		self->stage = ENV_ATTACK;
+		self->rate = 1.f / self->attack;
+	} else if (self->stage != ENV_IDLE) {
+		self->stage = ENV_RELEASE;
+		self->rate = -self->value / self->release;
+	}
+}
+
+int av_env_process(av_Env * self, float * out, int frames) {
+	float value = self->value;
+	int i = 0;
+	while (i < frames) {
+		switch (self->stage) {
+			case ENV_ATTACK:
+				for (; i < frames && value < 1.f; i++) {
+					value += self->rate;
+					out[i] = value < 1.f ? value : 1.f;
+				}
+				if (value >= 1.f) {
+					value = 1.f;
+					self->stage = ENV_DECAY;
+					self->rate = (self->sustain - 1.f) / self->decay;
+				}
+				break;
+			case ENV_DECAY:
+				for (; i < frames && value > self->sustain; i++) {
+					value += self->rate;
+					out[i] = value > self->sustain ? value : self->sustain;
+				}
+				if (value <= self->sustain) {
+					value = self->sustain;
+					self->stage = ENV_SUSTAIN;
+				}
+				break;
+			case ENV_SUSTAIN:
+				for (; i < frames; i++) out[i] = value;
+				break;
+			case ENV_RELEASE:
+				for (; i < frames && value > 0.f; i++) {
+					value += self->rate;
+					out[i] = value > 0.f ? value : 0.f;
+				}
+				if (value <= 0.f) {
+					value = 0.f;
+					self->stage = ENV_IDLE;
+				}
+				break;
+			default: // ENV_IDLE
+				value = 0.f;
+				memset(out + i, 0, sizeof(float) * (frames - i));
+				i = frames;
+		}
+	}
+	self->value = value;
+	return self->stage != ENV_IDLE;
+}
+
+void av_delay_process(av_Delay * self, const float * in, float * out, int frames, float delay, float feedback) {
+	float * buf = self->buffer;
+	int mask = self->size - 1;
+	int write = self->write;
+	if (delay < 1.f) delay = 1.f;
+	if (delay > (float)mask) delay = (float)mask;
+	int d0 = (int)delay;
+	float frac = delay - d0;
+	for (int i = 0; i < frames; i++) {
+		float a = buf[(write - d0) & mask];
+		float b = buf[(write - d0 - 1) & mask];
+		float y = a + frac * (b - a);
+		buf[write] = in[i] + feedback * y;
+		out[i] = y;
+		write = (write + 1) & mask;
+	}
+	self->write = write;
+}
+
+// xorshift32:
+static inline uint32_t noise_next(uint32_t& s) {
+	if (s == 0) s = 0x9e3779b9;
+	s ^= s << 13;
+	s ^= s >> 17;
+	s ^= s << 5;
+	return s;
+}
+
+static inline float noise_float(uint32_t& s) {
+	return (int32_t)noise_next(s) * (1.f / 2147483648.f);
+}
+
+void av_noise_white(av_Noise * self, float * out, int frames) {
+	uint32_t s = self->seed;
+	for (int i = 0; i < frames; i++) out[i] = noise_float(s);
+	self->seed = s;
+}
+
+// Paul Kellet's refined pink noise filter:
+void av_noise_pink(av_Noise * self, float * out, int frames) {
+	uint32_t s = self->seed;
+	float * b = self->pink;
+	for (int i = 0; i < frames; i++) {
+		float w = noise_float(s);
+		b[0] = 0.99886f * b[0] + w * 0.0555179f;
+		b[1] = 0.99332f * b[1] + w * 0.0750759f;
+		b[2] = 0.96900f * b[2] + w * 0.1538520f;
+		b[3] = 0.86650f * b[3] + w * 0.3104856f;
+		b[4] = 0.55000f * b[4] + w * 0.5329522f;
+		b[5] = -0.7616f * b[5] - w * 0.0168980f;
+		out[i] = (b[0] + b[1] + b[2] + b[3] + b[4] + b[5] + b[6] + w * 0.5362f) * 0.11f;
+		b[6] = w * 0.115926f;
+	}
+	self->seed = s;
+}
+
+void av_block_mul(float * out, const float * in, int frames) {
+	int i = 0;
+	#ifdef AV_AUDIO_SSE
+	for (; i + 4 <= frames; i += 4) {
+		_mm_storeu_ps(out + i, _mm_mul_ps(_mm_loadu_ps(out + i), _mm_loadu_ps(in + i)));
+	}
+	#endif
+	for (; i < frames; i++) out[i] *= in[i];
+}
+
+void av_block_scale(float * out, float gain, int frames) {
+	int i = 0;
+	#ifdef AV_AUDIO_SSE
+	__m128 g = _mm_set1_ps(gain);
+	for (; i + 4 <= frames; i += 4) {
+		_mm_storeu_ps(out + i, _mm_mul_ps(_mm_loadu_ps(out + i), g));
+	}
+	#endif
+	for (; i < frames; i++) out[i] *= gain;
+}
+
+void av_block_mix(float * out, const float * in, float gain, int frames) {
+	int i = 0;
+	#ifdef AV_AUDIO_SSE
+	__m128 g = _mm_set1_ps(gain);
+	for (; i + 4 <= frames; i += 4) {
+		_mm_storeu_ps(out + i, _mm_add_ps(_mm_loadu_ps(out + i), _mm_mul_ps(_mm_loadu_ps(in + i), g)));
+	}
+	#endif
+	for (; i < frames; i++) out[i] += in[i] * gain;
+}
+
+void av_block_mixramp(float * out, const float * in, float gain0, float gain1, int frames) {
+	if (frames <= 0) return;
+	float dg = (gain1 - gain0) / frames;
+	int i = 0;
+	#ifdef AV_AUDIO_SSE
+	__m128 g = _mm_add_ps(_mm_set1_ps(gain0), _mm_mul_ps(_mm_set_ps(3.f, 2.f, 1.f, 0.f), _mm_set1_ps(dg)));
+	__m128 dg4 = _mm_set1_ps(4.f * dg);
+	for (; i + 4 <= frames; i += 4) {
+		_mm_storeu_ps(out + i, _mm_add_ps(_mm_loadu_ps(out + i), _mm_mul_ps(_mm_loadu_ps(in + i), g)));
+		g = _mm_add_ps(g, dg4);
+	}
+	#endif
+	for (; i < frames; i++) out[i] += in[i] * (gain0 + dg * i);
+}
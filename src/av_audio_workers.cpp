@@ -0,0 +1,229 @@
+#include "av_audio.hpp"
+
+#include <stdio.h>
+#include <string.h>
+
+// how long an idle worker spins waiting for the next block before parking:
+#define AV_AUDIO_WORKER_SPIN 0.0002
+
+// a Chase-Lev style deque of chunk indices. chunks are only pushed by the audio thread 
+// while no participant is active, so during a block the owner pops from the bottom
+// and thieves take from the top.
+struct av_Deque {
+	volatile long top;
+	char pad0[60];
+	volatile long bottom;
+	char pad1[60];
+	int items[AV_AUDIO_CHUNKS_MAX];
+};
+
+#define AV_DEQUE_EMPTY -1
+
+static int deque_pop(av_Deque& d) {
+	long b = av_atomic_load(&d.bottom) - 1;
+	av_atomic_store(&d.bottom, b);
+	long t = av_atomic_load(&d.top);
+	if (t > b) {
+		av_atomic_store(&d.bottom, b + 1);
+		return AV_DEQUE_EMPTY;
+	}
+	int item = d.items[b];
+	if (t == b) {
+		// the last item: race any thieves for it
+		if (!av_atomic_cas(&d.top, t, t + 1)) item = AV_DEQUE_EMPTY;
+		av_atomic_store(&d.bottom, b + 1);
+	}
+	return item;
+}
+
+static int deque_steal(av_Deque& d) {
+	long t = av_atomic_load(&d.top);
+	long b = av_atomic_load(&d.bottom);
+	if (t >= b) return AV_DEQUE_EMPTY;
+	int item = d.items[t];
+	return av_atomic_cas(&d.top, t, t + 1) ? item : AV_DEQUE_EMPTY;
+}
+
+struct av_Worker {
+	av_thread thread;
+	av_semaphore wake;
+	volatile long parked;
+	int participant;
+};
+
+static struct {
+	int count;			// number of worker threads
+	av_Worker workers[AV_AUDIO_WORKERS_MAX];
+	av_Deque deques[AV_AUDIO_WORKERS_MAX + 1];
+	
+	// the current block's job:
+	av_audio_job job;
+	void * ud;
+	
+	// even while a block is available, odd while the audio thread is setting one up:
+	volatile long generation;
+	// workers currently inside a block:
+	volatile long active;
+	// chunks not yet completed:
+	volatile long remaining;
+	volatile long quit;
+	long epoch;			// counts worker sets started
+} pool;
+
+// the worker set the calling thread last gave its priority:
+static AV_THREAD_LOCAL long matched = 0;
+
+// run chunks until no deque has any left:
+static void participate(int participant) {
+	int n = pool.count + 1;
+	for (;;) {
+		int chunk = deque_pop(pool.deques[participant]);
+		for (int i = 1; chunk == AV_DEQUE_EMPTY && i < n; i++) {
+			chunk = deque_steal(pool.deques[(participant + i) % n]);
+		}
+		if (chunk == AV_DEQUE_EMPTY) {
+			// a failed steal may just have lost a race; only stop when everything is taken:
+			bool empty = true;
+			for (int i = 0; i < n; i++) {
+				av_Deque& d = pool.deques[i];
+				if (av_atomic_load(&d.top) < av_atomic_load(&d.bottom)) empty = false;
+			}
+			if (empty) return;
+			continue;
+		}
+		(pool.job)(pool.ud, chunk, participant);
+		av_atomic_add(&pool.remaining, -1);
+	}
+}
+
+static void * worker_main(void * arg) {
+	av_Worker& w = *(av_Worker *)arg;
+	long last = 0;
+	double spinstart = av_monotonic_time();
+	while (!av_atomic_load(&pool.quit)) {
+		long g = av_atomic_load(&pool.generation);
+		if (g == last || (g & 1)) {
+			if (av_monotonic_time() - spinstart < AV_AUDIO_WORKER_SPIN) {
+				av_cpu_pause();
+			} else {
+				// park, unless a block arrived meanwhile:
+				av_atomic_store(&w.parked, 1);
+				g = av_atomic_load(&pool.generation);
+				if ((g == last || (g & 1)) && !av_atomic_load(&pool.quit)) {
+					av_semaphore_wait(&w.wake);
+				} else if (!av_atomic_exchange(&w.parked, 0)) {
+					// the audio thread already took our flag, and has posted (or will post) 
+					// a wakeup we won't need; absorb it so it doesn't cut the next park short:
+					av_semaphore_wait(&w.wake);
+				}
+				spinstart = av_monotonic_time();
+			}
+			continue;
+		}
+		// join the block, unless the audio thread has already moved on:
+		av_atomic_add(&pool.active, 1);
+		if (av_atomic_load(&pool.generation) == g) {
+			participate(w.participant);
+			last = g;
+		}
+		av_atomic_add(&pool.active, -1);
+		spinstart = av_monotonic_time();
+	}
+	return 0;
+}
+
+static void workers_stop() {
+	if (pool.count == 0) return;
+	av_atomic_store(&pool.quit, 1);
+	for (int i = 0; i < pool.count; i++) {
+		if (av_atomic_exchange(&pool.workers[i].parked, 0)) {
+			av_semaphore_post(&pool.workers[i].wake);
+		}
+	}
+	for (int i = 0; i < pool.count; i++) {
+		av_thread_join(pool.workers[i].thread);
+		av_semaphore_destroy(&pool.workers[i].wake);
+	}
+	pool.count = 0;
+}
+
+void av_audio_workers_start(int n) {
+	workers_stop();
+	if (n > AV_AUDIO_WORKERS_MAX) n = AV_AUDIO_WORKERS_MAX;
+	int cores = av_cpu_count();
+	
+	pool.quit = 0;
+	pool.generation = 0;
+	pool.active = 0;
+	pool.remaining = 0;
+	pool.epoch++;
+	for (int i = 0; i < n; i++) {
+		av_Worker& w = pool.workers[i];
+		w.participant = i + 1;
+		w.parked = 0;
+		av_semaphore_init(&w.wake);
+		if (av_thread_create(&w.thread, worker_main, &w)) {
+			printf("could not create audio worker %d\n", i);
+			av_semaphore_destroy(&w.wake);
+			break;
+		}
+		// leave core 0 to the audio thread (see av_audio_workers_attach):
+		if (cores > 1) av_thread_pin(w.thread, 1 + (i % (cores - 1)));
+		pool.count++;
+	}
+	printf("using %d audio worker threads\n", pool.count);
+}
+
+int av_audio_workers_count() {
+	return pool.count;
+}
+
+// the audio thread waits for the workers' chunks, so they must not be preempted where it isn't:
+// they get its priority, and it gets core 0, away from theirs.
+// (once per worker set and device thread; e.g. a reopened stream brings a new audio thread)
+void av_audio_workers_attach() {
+	if (matched == pool.epoch) return;
+	matched = pool.epoch;
+	for (int i = 0; i < pool.count; i++) av_thread_match_priority(pool.workers[i].thread);
+	if (av_cpu_count() > 1) av_thread_pin(av_thread_self(), 0);
+}
+
+void av_audio_parallel(av_audio_job job, void * ud, int chunks) {
+	if (chunks > AV_AUDIO_CHUNKS_MAX) chunks = AV_AUDIO_CHUNKS_MAX;
+	int n = pool.count + 1;
+	
+	if (pool.count == 0 || chunks < 2) {
+		for (int i = 0; i < chunks; i++) job(ud, i, 0);
+		return;
+	}
+	
+	// close the previous block, and wait for any straggling workers to leave it:
+	long g = pool.generation + 1;
+	av_atomic_store(&pool.generation, g);
+	while (av_atomic_load(&pool.active)) av_cpu_pause();
+	
+	// deal the chunks:
+	pool.job = job;
+	pool.ud = ud;
+	for (int i = 0; i < n; i++) {
+		pool.deques[i].top = 0;
+		pool.deques[i].bottom = 0;
+	}
+	for (int i = 0; i < chunks; i++) {
+		av_Deque& d = pool.deques[i % n];
+		d.items[d.bottom++] = i;
+	}
+	pool.remaining = chunks;
+	
+	// open the block, and wake any parked workers:
+	av_atomic_store(&pool.generation, g + 1);
+	for (int i = 0; i < pool.count; i++) {
+		av_Worker& w = pool.workers[i];
+		if (av_atomic_load(&w.parked) && av_atomic_exchange(&w.parked, 0)) {
+			av_semaphore_post(&w.wake);
+		}
+	}
+	
+	participate(0);
+	while (av_atomic_load(&pool.remaining) > 0) av_cpu_pause();
+}
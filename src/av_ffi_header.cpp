@@ -1,12 +1,36 @@
 const char * av_ffi_header = ""
-"-- generated from av.h on Mon Sep  9 20:53:39 2013 \n"
-"print('Built on Mon Sep  9 20:53:39 2013') \n"
+"-- generated from av.h on Sun Oct 18 00:24:08 2026 \n"
+"print('Built on Sun Oct 18 00:24:08 2026') \n"
 "local header = [[ \n"
 " void av_sleep(double seconds); \n"
 " double av_time(); \n"
 " double av_filetime(const char * filename); \n"
 " void av_reload(); \n"
 "enum { \n"
+" AV_FILE_CREATED = 1, \n"
+" AV_FILE_MODIFIED, \n"
+" AV_FILE_DELETED, \n"
+" AV_FILE_RESCAN \n"
+"}; \n"
+"typedef struct av_FileEvent { \n"
+" int watch; \n"
+" int kind; \n"
+" char path[512]; \n"
+"} av_FileEvent; \n"
+" int av_filewatch_add(const char * path, int recursive); \n"
+" void av_filewatch_remove(int id); \n"
+" int av_filewatch_poll(av_FileEvent * events, int max); \n"
+" int av_filewatch_native(); \n"
+" void av_trace_enable(int enable); \n"
+" int av_trace_enabled(); \n"
+" void av_trace_begin(const char * name); \n"
+" void av_trace_end(); \n"
+" void av_trace_thread(const char * name); \n"
+" void av_trace_retire(const char * name); \n"
+" const char * av_trace_intern(const char * name); \n"
+" void av_trace_clear(); \n"
+" int av_trace_write(const char * path); \n"
+"enum { \n"
 " AV_KEY_ENTER =3, \n"
 " AV_KEY_BACKSPACE =8, \n"
 " AV_KEY_TAB =9, \n"
@@ -20,13 +44,35 @@ const char * av_ffi_header = ""
 " AV_KEY_PAGE_DOWN, AV_KEY_PAGE_UP, \n"
 " AV_KEY_END, AV_KEY_HOME \n"
 "}; \n"
+"enum { \n"
+" AV_EVENT_KEYDOWN = 1, \n"
+" AV_EVENT_KEYUP, \n"
+" AV_EVENT_MOUSEDOWN, \n"
+" AV_EVENT_MOUSEUP, \n"
+" AV_EVENT_MOUSEDRAG, \n"
+" AV_EVENT_MOUSEMOVE \n"
+"}; \n"
+"typedef struct av_WindowEvent { \n"
+" double t; \n"
+" int type; \n"
+" int key; \n"
+" int x, y; \n"
+" int shift, alt, ctrl; \n"
+"} av_WindowEvent; \n"
 "typedef struct av_Window { \n"
 " int width, height; \n"
 " int is_fullscreen; \n"
 " int button; \n"
 " int shift, alt, ctrl; \n"
 " int is_stereo; \n"
+" int is_vsync; \n"
+" int is_headless; \n"
+" unsigned int framebuffer; \n"
 " double fps; \n"
+" double frametime; \n"
+" double framecost; \n"
+" double jitter; \n"
+" int events_dropped; \n"
 " void (*oncreate)(struct av_Window * self); \n"
 " void (*onresize)(struct av_Window * self, int w, int h); \n"
 " void (*onvisible)(struct av_Window * self, int state); \n"
@@ -42,16 +88,162 @@ const char * av_ffi_header = ""
 " AV_AUDIO_CMD_VOICE_REMOVE, \n"
 " AV_AUDIO_CMD_VOICE_PARAM, \n"
 " AV_AUDIO_CMD_VOICE_CODE, \n"
+" AV_AUDIO_CMD_VOICE_KERNEL, \n"
+" AV_AUDIO_CMD_VOICE_POSITION, \n"
+" AV_AUDIO_CMD_LISTENER, \n"
+" AV_AUDIO_CMD_DECODER, \n"
+" AV_AUDIO_CMD_STREAM_CLOSE, \n"
+" AV_AUDIO_CMD_VOICE_BYTECODE, \n"
+" AV_AUDIO_CMD_REVERB, \n"
+" AV_AUDIO_CMD_PARAMS, \n"
 " AV_AUDIO_CMD_SKIP = 255 \n"
 "}; \n"
 "typedef struct av_msg_param { \n"
 " int id, pid; \n"
 " double value; \n"
 "} av_msg_param; \n"
-"typedef struct av_msgbuffer { \n"
-" int read, write, size, unused; \n"
+"enum { \n"
+" AV_AUDIO_RAMP_LINEAR, \n"
+" AV_AUDIO_RAMP_EXP \n"
+"}; \n"
+"typedef struct av_param_ramp { \n"
+" int id, pid; \n"
+" double value; \n"
+" float time; \n"
+" int shape; \n"
+"} av_param_ramp; \n"
+"typedef struct av_msg_params { \n"
+" int count, unused; \n"
+"} av_msg_params; \n"
+"typedef struct av_msg_bytecode { \n"
+" uint32_t size; \n"
+" float fade; \n"
+"} av_msg_bytecode; \n"
+"typedef struct av_msg_kernel { \n"
+" int id, kernel; \n"
+"} av_msg_kernel; \n"
+"typedef struct av_msg_position { \n"
+" int id, spatial; \n"
+" double pos[3]; \n"
+"} av_msg_position; \n"
+"typedef struct av_msg_listener { \n"
+" double pos[3]; \n"
+" double quat[4]; \n"
+" double near; \n"
+"} av_msg_listener; \n"
+"typedef struct av_msg_decoder { \n"
+" int order, speakers; \n"
+" float matrix[64][16]; \n"
+"} av_msg_decoder; \n"
+"typedef struct av_Convolver av_Convolver; \n"
+"typedef struct av_msg_reverb { \n"
+" int channels; \n"
+" float dry, wet; \n"
+" av_Convolver * convolver[64]; \n"
+"} av_msg_reverb; \n"
+"typedef struct av_msg { \n"
+" uint32_t cmd; \n"
+" uint32_t size; \n"
+" double t; \n"
+"} av_msg; \n"
+"typedef struct av_msgqueue { \n"
 " unsigned char * data; \n"
-"} av_msgbuffer; \n"
+" uint32_t size, mask; \n"
+" char pad0[48]; \n"
+" uint32_t write; \n"
+" uint32_t reserved; \n"
+" uint32_t readcache; \n"
+" uint32_t unused0; \n"
+" char pad1[48]; \n"
+" uint32_t read; \n"
+" uint32_t pending; \n"
+" uint32_t deferred_used, deferred_taken, deferred_last; \n"
+" uint32_t unused1; \n"
+" unsigned char * deferred; \n"
+" char pad2[32]; \n"
+"} av_msgqueue; \n"
+"typedef struct av_VoicePool { \n"
+" int capacity, params; \n"
+" double samplerate; \n"
+" int count; \n"
+" int kernel[4096]; \n"
+" int spatial[4096]; \n"
+" double position[3][4096]; \n"
+" int next[4096]; \n"
+" int prev[4096]; \n"
+" uint32_t serial[4096]; \n"
+" double param[32][4096]; \n"
+" float slope[32][4096]; \n"
+" int freecount; \n"
+" int freelist[4096]; \n"
+" unsigned char allocated[4096]; \n"
+"} av_VoicePool; \n"
+"typedef void (*av_voice_kernel)(av_VoicePool * pool, int id, float * out, int stride, int channels, int frames); \n"
+"enum { \n"
+" AV_AUDIO_KERNEL_NONE, \n"
+" AV_AUDIO_KERNEL_SINE, \n"
+" AV_AUDIO_KERNEL_STREAM, \n"
+" AV_AUDIO_KERNEL_BUILTIN_COUNT \n"
+"}; \n"
+"typedef struct av_AudioStats { \n"
+" uint32_t callbacks; \n"
+" uint32_t underflows; \n"
+" uint32_t overflows; \n"
+" uint32_t late; \n"
+" uint32_t queue_used; \n"
+" uint32_t queue_max; \n"
+" uint32_t reset; \n"
+" uint32_t lua_alloc; \n"
+" uint32_t lua_alloc_max; \n"
+" uint32_t lua_fallbacks; \n"
+" uint32_t lua_kb; \n"
+" uint32_t stream_underruns; \n"
+" double block_time; \n"
+" double block_max; \n"
+" double load; \n"
+" double load_avg; \n"
+" double gc_time; \n"
+" uint32_t histogram[64]; \n"
+"} av_AudioStats; \n"
+"typedef struct av_AudioStreamInfo { \n"
+" int channels, samplerate; \n"
+" uint32_t frames; \n"
+" uint32_t played; \n"
+" uint32_t underruns; \n"
+" int finished; \n"
+"} av_AudioStreamInfo; \n"
+"typedef struct av_AudioCapture { \n"
+" float * data; \n"
+" uint32_t frames; \n"
+" uint32_t channels; \n"
+" volatile uint32_t write; \n"
+" volatile double time; \n"
+"} av_AudioCapture; \n"
+"typedef struct av_Analysis { \n"
+" volatile uint32_t sequence; \n"
+" int source; \n"
+" int size; \n"
+" int hop; \n"
+" int bins; \n"
+" uint32_t frames; \n"
+" uint32_t onsets; \n"
+" uint32_t dropped; \n"
+" double time; \n"
+" float rms; \n"
+" float flux; \n"
+" float onset; \n"
+" float centroid; \n"
+" float bands[24]; \n"
+" float magnitude[(8192 / 2 + 1)]; \n"
+" float phase[(8192 / 2 + 1)]; \n"
+"} av_Analysis; \n"
+"typedef struct av_AudioRecordInfo { \n"
+" int recording; \n"
+" int channels; \n"
+" double frames; \n"
+" uint32_t dropped; \n"
+" int failed; \n"
+"} av_AudioRecordInfo; \n"
 "typedef struct av_Audio { \n"
 " unsigned int blocksize; \n"
 " unsigned int frames; \n"
@@ -60,20 +252,139 @@ const char * av_ffi_header = ""
 " double time; \n"
 " double samplerate; \n"
 " double lag; \n"
-" av_msgbuffer msgbuffer; \n"
+" double latency; \n"
+" double gcbudget; \n"
+" double devicerate; \n"
+" double hardwarerate; \n"
+" int resamplequality; \n"
+" av_msgqueue msgqueue; \n"
+" av_VoicePool * voices; \n"
+" av_AudioStats stats; \n"
 " float * buffer; \n"
 " int blocks, blockread, blockwrite, blockstep; \n"
 " float * input; \n"
 " float * output; \n"
+" int busstride; \n"
+" av_AudioCapture capture; \n"
+" av_AudioCapture monitor; \n"
+" float * spatial; \n"
+" float * fade; \n"
+" int fadechannels; \n"
 " void (*onframes)(struct av_Audio * self, double sampletime, float * inputs, float * outputs, int frames); \n"
 "} av_Audio; \n"
 " av_Window * av_window_create(); \n"
 " void av_window_setfullscreen(av_Window * self, int b); \n"
 " void av_window_settitle(av_Window * self, const char * name); \n"
 " void av_window_setdim(av_Window * self, int x, int y); \n"
+" void av_window_setvsync(av_Window * self, int b); \n"
+" av_WindowEvent * av_window_events(av_Window * self, int * count); \n"
 " void av_state_reset(void * state); \n"
 " av_Audio * av_audio_get(); \n"
 " void av_audio_start(); \n"
+" int av_audio_reconfigure(double samplerate, int blocksize, int inchannels, int outchannels, double latency); \n"
+" uint32_t av_audio_capture_count(); \n"
+" const float * av_audio_capture_read(int channel, uint32_t start, uint32_t frames); \n"
+" int av_audio_capture_valid(uint32_t start); \n"
+" double av_audio_capture_time(const av_AudioCapture * cap, uint32_t frame); \n"
+" av_Analysis * av_audio_analysis_start(int source, int size, int hop); \n"
+" void av_audio_analysis_stop(av_Analysis * analysis); \n"
+" int av_audio_record_start(const char * path, int input); \n"
+" void av_audio_record_stop(); \n"
+" int av_audio_record_info(av_AudioRecordInfo * info); \n"
+" int av_audio_render(const char * path, float * buffer, int frames); \n"
+" int av_audio_kernel_register(av_voice_kernel kernel); \n"
+" void av_audio_setworkers(int n); \n"
+" int av_ambi_decoder_design(av_msg_decoder * decoder, int order, int speakers, const double * azimuth, const double * elevation); \n"
+" void av_audio_ambi_encode(int id, const float * left, const float * right, int frames); \n"
+" int av_audio_stream_open(const char * path, int loop); \n"
+" int av_audio_stream_info(int id, av_AudioStreamInfo * info); \n"
+" float * av_audio_sound_load(const char * path, av_AudioStreamInfo * info); \n"
+" void av_audio_sound_free(float * data); \n"
+" int av_audio_reverb_design(av_msg_reverb * msg, const float * ir, int frames, int irchannels, int outchannels); \n"
+" int av_audio_voice_alloc(); \n"
+" void av_audio_voice_free(int id); \n"
+" void av_audio_voice_freeall(); \n"
+" int av_msgqueue_init(av_msgqueue * q, uint32_t size); \n"
+" void * av_msgqueue_reserve(av_msgqueue * q, uint32_t cmd, uint32_t size, double t); \n"
+" void av_msgqueue_commit(av_msgqueue * q); \n"
+" int av_msgqueue_drain(av_msgqueue * q, av_msg ** msgs, int max, double until); \n"
+" void av_msgqueue_release(av_msgqueue * q); \n"
+" uint32_t av_msgqueue_used(av_msgqueue * q); \n"
+"typedef struct av_Osc { \n"
+" double phase, incr; \n"
+"} av_Osc; \n"
+" void av_osc_setfreq(av_Osc * self, double freq, double samplerate); \n"
+" void av_osc_sine(av_Osc * self, float * out, int frames); \n"
+" void av_osc_saw(av_Osc * self, float * out, int frames); \n"
+" void av_osc_square(av_Osc * self, float * out, int frames); \n"
+" void av_osc_triangle(av_Osc * self, float * out, int frames); \n"
+" void av_osc_table(av_Osc * self, const float * table, int size, float * out, int frames); \n"
+"enum { \n"
+" AV_BIQUAD_LOWPASS, \n"
+" AV_BIQUAD_HIGHPASS, \n"
+" AV_BIQUAD_BANDPASS, \n"
+" AV_BIQUAD_NOTCH, \n"
+" AV_BIQUAD_PEAK, \n"
+" AV_BIQUAD_LOWSHELF, \n"
+" AV_BIQUAD_HIGHSHELF \n"
+"}; \n"
+"typedef struct av_Biquad { \n"
+" float b0, b1, b2, a1, a2; \n"
+" float z1, z2; \n"
+"} av_Biquad; \n"
+" void av_biquad_set(av_Biquad * self, int type, double freq, double q, double gain, double samplerate); \n"
+" void av_biquad_process(av_Biquad * self, const float * in, float * out, int frames); \n"
+"typedef struct av_SVF { \n"
+" float k, a1, a2, a3; \n"
+" float ic1, ic2; \n"
+"} av_SVF; \n"
+" void av_svf_set(av_SVF * self, double freq, double q, double samplerate); \n"
+" void av_svf_process(av_SVF * self, const float * in, float * low, float * band, float * high, int frames); \n"
+"typedef struct av_Env { \n"
+" int stage; \n"
+" float value, rate; \n"
+" float attack, decay, sustain, release; \n"
+"} av_Env; \n"
+" void av_env_set(av_Env * self, double attack, double decay, double sustain, double release, double samplerate); \n"
+" void av_env_gate(av_Env * self, int on); \n"
+" int av_env_process(av_Env * self, float * out, int frames); \n"
+"typedef struct av_Delay { \n"
+" float * buffer; \n"
+" int size, write; \n"
+"} av_Delay; \n"
+" void av_delay_process(av_Delay * self, const float * in, float * out, int frames, float delay, float feedback); \n"
+"typedef struct av_Noise { \n"
+" uint32_t seed; \n"
+" float pink[7]; \n"
+"} av_Noise; \n"
+" void av_noise_white(av_Noise * self, float * out, int frames); \n"
+" void av_noise_pink(av_Noise * self, float * out, int frames); \n"
+" void av_block_mul(float * out, const float * in, int frames); \n"
+" void av_block_scale(float * out, float gain, int frames); \n"
+" void av_block_mix(float * out, const float * in, float gain, int frames); \n"
+" void av_block_mixramp(float * out, const float * in, float gain0, float gain1, int frames); \n"
+"typedef struct av_FFT av_FFT; \n"
+" av_FFT * av_fft_create(int size); \n"
+" void av_fft_destroy(av_FFT * self); \n"
+" int av_fft_size(const av_FFT * self); \n"
+" void av_fft_forward(av_FFT * self, const float * in, float * re, float * im); \n"
+" void av_fft_inverse(av_FFT * self, const float * re, const float * im, float * out); \n"
+"enum { \n"
+" AV_RESAMPLE_FAST, \n"
+" AV_RESAMPLE_MEDIUM, \n"
+" AV_RESAMPLE_BEST \n"
+"}; \n"
+"typedef struct av_Resampler av_Resampler; \n"
+" av_Resampler * av_resampler_create(double inrate, double outrate, int channels, int quality); \n"
+" void av_resampler_destroy(av_Resampler * self); \n"
+" int av_resampler_process(av_Resampler * self, const float * in, int inframes, float * out); \n"
+" int av_resampler_maxout(av_Resampler * self, int inframes); \n"
+" int av_resampler_latency(av_Resampler * self); \n"
+" void av_resampler_reset(av_Resampler * self); \n"
+" av_Convolver * av_convolver_create(const float * ir, int frames, int channels, int channel, int partition); \n"
+" void av_convolver_destroy(av_Convolver * self); \n"
+" void av_convolver_process(av_Convolver * self, const float * in, float * out, int frames); \n"
+" uint32_t av_convolver_late(av_Convolver * self); \n"
 "typedef struct { \n"
 " int kind; \n"
 " int xdata; \n"
@@ -127,23 +438,45 @@ const char * av_main = ""
 "-- a bit of helpful info: \n"
 "print(string.format(\"Using %s on %s (%s)\", jit.version, jit.os, jit.arch)) \n"
 " \n"
-"local watched = {} \n"
+"local watched = {}	-- filename -> watch id \n"
+"local unstarted = {} \n"
 "local states = {} \n"
 " \n"
+"-- changes arrive in batches, once per frame (see av_filewatch.cpp): \n"
+"local maxevents = 64 \n"
+"local events = ffi.new(\"av_FileEvent[?]\", maxevents) \n"
+"local moduleswatch = C.av_filewatch_add(exepath .. \"/modules\", 1) \n"
+" \n"
 "function av_tick() \n"
+"	for filename in pairs(unstarted) do \n"
+"		unstarted[filename] = nil \n"
+"		spawn(filename) \n"
+"	end \n"
+"	 \n"
 "	-- filewatch: \n"
-"	for filename, mtime in pairs(watched) do \n"
-"		local t = C.av_filetime(filename) \n"
-"		if t > mtime then \n"
-"			watched[filename] = t \n"
-"			spawn(filename) \n"
+"	local reload = {} \n"
+"	repeat \n"
+"		local n = C.av_filewatch_poll(events, maxevents) \n"
+"		for i = 0, n-1 do \n"
+"			local e = events[i] \n"
+"			if e.watch == moduleswatch then \n"
+"				-- a module changed; restart everything that might use it: \n"
+"				for filename in pairs(watched) do reload[filename] = true end \n"
+"			elseif e.kind ~= C.AV_FILE_DELETED then \n"
+"				-- (file watches report the filename as given) \n"
+"				local filename = ffi.string(e.path) \n"
+"				if watched[filename] then reload[filename] = true end \n"
+"			end \n"
 "		end \n"
+"	until n < maxevents \n"
+"	for filename in pairs(reload) do \n"
+"		spawn(filename) \n"
 "	end \n"
 "end \n"
 " \n"
 "-- force reload all scripts: \n"
 "function av_reload() \n"
-"	for filename, mtime in pairs(watched) do \n"
+"	for filename in pairs(watched) do \n"
 "		spawn(filename) \n"
 "	end \n"
 "end \n"
@@ -211,7 +544,10 @@ const char * av_main = ""
 "end \n"
 " \n"
 "function watch(filename) \n"
-"	watched[filename] = 0 \n"
+"	if not watched[filename] then \n"
+"		watched[filename] = C.av_filewatch_add(filename, 0) \n"
+"		unstarted[filename] = true \n"
+"	end \n"
 "end \n"
 " \n"
 "watch(filename) \n"
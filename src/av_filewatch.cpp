@@ -0,0 +1,436 @@
+#include "av.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef AV_WINDOWS
+	#include <io.h>
+#else
+	#include <dirent.h>
+	#include <errno.h>
+#endif
+
+#ifdef AV_LINUX
+	#include <sys/inotify.h>
+	#define AV_FILEWATCH_INOTIFY 1
+#endif
+
+// file & directory watching for the main thread.
+// on Linux, inotify reports changes to a non-blocking descriptor that is drained when
+// polled; elsewhere (or if inotify is unavailable) the watched paths are re-scanned with
+// stat() at a limited rate. either way, raw changes are held back until the path has been
+// quiet for a moment, so that an editor's burst of truncate/write/rename/chmod on save
+// surfaces as a single event.
+
+#define WATCHES_MAX 1024		// including the subdirectories of recursive watches
+#define PENDING_MAX 512
+#define SETTLE 0.05				// seconds a path must be quiet before its event is released
+#define RESCAN_PERIOD 0.25		// seconds between scans, when polling
+
+struct av_Watch {
+	int owner;		// the id given to the caller, or -1 if unused
+	int recursive;
+	int wd;			// inotify watch descriptor, or -1
+	char dir[AV_FILEWATCH_PATH_MAX];	// empty, or ending with a slash
+	char name[AV_FILEWATCH_PATH_MAX];	// the file within dir; empty to watch the whole directory
+};
+
+struct av_WatchEntry {
+	int owner;
+	int seen;		// scan generation
+	// (mtime has whole-second resolution, so a quick save is also told by size & inode)
+	double mtime, size, inode;
+	char path[AV_FILEWATCH_PATH_MAX];
+};
+
+struct av_WatchPending {
+	int owner;
+	int kind;
+	double last;	// time of the most recent raw change
+	char path[AV_FILEWATCH_PATH_MAX];
+};
+
+static av_Watch watches[WATCHES_MAX];
+static int nwatches = 0;
+static int nextid = 0;
+
+static av_WatchPending pending[PENDING_MAX];
+static int npending = 0;
+// owners that lost events (to overflow), and should rescan everything:
+static int lost[WATCHES_MAX];
+static int nlost = 0;
+
+// polling state:
+static av_WatchEntry * entries = 0;
+static int nentries = 0, entriescap = 0;
+static int generation = 0;
+static double nextscan = 0;
+
+static int fd = -1;			// inotify descriptor
+static int initialized = 0;
+
+static void init() {
+	if (initialized) return;
+	initialized = 1;
+	#ifdef AV_FILEWATCH_INOTIFY
+	fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd < 0) printf("inotify unavailable, polling for file changes\n");
+	#endif
+}
+
+// returns 0 (and changes nothing) if the path would not fit; such paths are skipped.
+// (dst may be dir)
+static int join(char * dst, const char * dir, const char * name) {
+	size_t dirlen = strlen(dir), namelen = strlen(name);
+	if (dirlen + namelen >= AV_FILEWATCH_PATH_MAX) return 0;
+	memmove(dst, dir, dirlen);
+	memcpy(dst + dirlen, name, namelen + 1);
+	return 1;
+}
+
+static int isdir(const char * path) {
+	struct stat st;
+	return stat(path[0] ? path : ".", &st) == 0 && (st.st_mode & S_IFDIR);
+}
+
+// calls f for each entry of the directory (dir is empty or ends with a slash):
+typedef void (*listfunc)(int owner, const char * dir, const char * name, int report);
+static void listdir(int owner, const char * dir, listfunc f, int report) {
+	#ifdef AV_WINDOWS
+		char pattern[AV_FILEWATCH_PATH_MAX];
+		if (!join(pattern, dir, "*")) return;
+		_finddata_t data;
+		intptr_t h = _findfirst(pattern, &data);
+		if (h == -1) return;
+		do {
+			if (strcmp(data.name, ".") && strcmp(data.name, "..")) f(owner, dir, data.name, report);
+		} while (_findnext(h, &data) == 0);
+		_findclose(h);
+	#else
+		DIR * d = opendir(dir[0] ? dir : ".");
+		if (!d) return;
+		struct dirent * e;
+		while ((e = readdir(d))) {
+			if (strcmp(e->d_name, ".") && strcmp(e->d_name, "..")) f(owner, dir, e->d_name, report);
+		}
+		closedir(d);
+	#endif
+}
+
+static void note(int owner, int kind, const char * path) {
+	double now = av_monotonic_time();
+	for (int i = 0; i < npending; i++) {
+		av_WatchPending& p = pending[i];
+		if (p.owner != owner || strcmp(p.path, path)) continue;
+		if (p.kind == AV_FILE_CREATED && kind == AV_FILE_DELETED) {
+			// came and went (an editor's temporary file):
+			pending[i] = pending[--npending];
+			return;
+		} else if (p.kind == AV_FILE_DELETED && kind == AV_FILE_CREATED) {
+			// replaced (save by rename):
+			p.kind = AV_FILE_MODIFIED;
+		} else if (!(p.kind == AV_FILE_CREATED && kind == AV_FILE_MODIFIED)) {
+			p.kind = kind;
+		}
+		p.last = now;
+		return;
+	}
+	if (npending == PENDING_MAX) {
+		for (int i = 0; i < nlost; i++) if (lost[i] == owner) return;
+		if (nlost < WATCHES_MAX) lost[nlost++] = owner;
+		return;
+	}
+	av_WatchPending& p = pending[npending++];
+	p.owner = owner;
+	p.kind = kind;
+	p.last = now;
+	AV_SNPRINTF(p.path, AV_FILEWATCH_PATH_MAX, "%s", path);
+}
+
+static void loseall() {
+	nlost = 0;
+	for (int i = 0; i < nwatches; i++) {
+		int owner = watches[i].owner;
+		if (owner < 0) continue;
+		int known = 0;
+		for (int j = 0; j < nlost; j++) known |= lost[j] == owner;
+		if (!known) lost[nlost++] = owner;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// polling
+////////////////////////////////////////////////////////////////////////////////
+
+static void scanfile(int owner, const char * path, int report) {
+	struct stat st;
+	if (stat(path, &st) != 0) return;
+	double t = (double)st.st_mtime, size = (double)st.st_size, inode = (double)st.st_ino;
+	for (int i = 0; i < nentries; i++) {
+		av_WatchEntry& e = entries[i];
+		if (e.owner != owner || strcmp(e.path, path)) continue;
+		e.seen = generation;
+		if (t != e.mtime || size != e.size || inode != e.inode) {
+			e.mtime = t;
+			e.size = size;
+			e.inode = inode;
+			if (report) note(owner, AV_FILE_MODIFIED, path);
+		}
+		return;
+	}
+	if (nentries == entriescap) {
+		entriescap = entriescap ? entriescap * 2 : 64;
+		entries = (av_WatchEntry *)realloc(entries, sizeof(av_WatchEntry) * entriescap);
+	}
+	av_WatchEntry& e = entries[nentries++];
+	e.owner = owner;
+	e.seen = generation;
+	e.mtime = t;
+	e.size = size;
+	e.inode = inode;
+	AV_SNPRINTF(e.path, AV_FILEWATCH_PATH_MAX, "%s", path);
+	if (report) note(owner, AV_FILE_CREATED, path);
+}
+
+static void scanentry(int owner, const char * dir, const char * name, int report) {
+	char path[AV_FILEWATCH_PATH_MAX];
+	if (!join(path, dir, name)) return;
+	if (isdir(path)) {
+		// (only listed for recursive watches)
+		if (!join(path, path, "/")) return;
+		listdir(owner, path, scanentry, report);
+	} else {
+		scanfile(owner, path, report);
+	}
+}
+
+static void scanentry_flat(int owner, const char * dir, const char * name, int report) {
+	char path[AV_FILEWATCH_PATH_MAX];
+	if (join(path, dir, name) && !isdir(path)) scanfile(owner, path, report);
+}
+
+static void scanwatch(av_Watch& w, int report) {
+	if (w.name[0]) {
+		char path[AV_FILEWATCH_PATH_MAX];
+		if (join(path, w.dir, w.name)) scanfile(w.owner, path, report);
+	} else {
+		listdir(w.owner, w.dir, w.recursive ? scanentry : scanentry_flat, report);
+	}
+}
+
+static void scan() {
+	generation++;
+	for (int i = 0; i < nwatches; i++) {
+		if (watches[i].owner >= 0) scanwatch(watches[i], 1);
+	}
+	// anything not seen has gone:
+	for (int i = nentries - 1; i >= 0; i--) {
+		if (entries[i].seen != generation) {
+			note(entries[i].owner, AV_FILE_DELETED, entries[i].path);
+			entries[i] = entries[--nentries];
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// inotify
+////////////////////////////////////////////////////////////////////////////////
+
+static int addwatch(int owner, const char * dir, const char * name, int recursive);
+
+#ifdef AV_FILEWATCH_INOTIFY
+
+static void addsubdir(int owner, const char * dir, const char * name, int report) {
+	char path[AV_FILEWATCH_PATH_MAX];
+	if (!join(path, dir, name)) return;
+	if (isdir(path)) {
+		if (!join(path, path, "/")) return;
+		addwatch(owner, path, "", 1);
+		// anything created before the watch was in place:
+		if (report) listdir(owner, path, addsubdir, report);
+	} else if (report) {
+		note(owner, AV_FILE_CREATED, path);
+	}
+}
+
+static void readevents() {
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	for (;;) {
+		ssize_t len = read(fd, buf, sizeof(buf));
+		if (len <= 0) break;	// EAGAIN: nothing more for now
+		for (char * p = buf; p < buf + len; ) {
+			const struct inotify_event * ev = (const struct inotify_event *)p;
+			p += sizeof(struct inotify_event) + ev->len;
+			if (ev->mask & IN_Q_OVERFLOW) {
+				loseall();
+				continue;
+			}
+			for (int i = 0; i < nwatches; i++) {
+				av_Watch& w = watches[i];
+				if (w.owner < 0 || w.wd != ev->wd) continue;
+				if (ev->mask & IN_IGNORED) {
+					// the directory itself went away:
+					w.wd = -1;
+					continue;
+				}
+				if (!ev->len || (w.name[0] && strcmp(w.name, ev->name))) continue;
+				char path[AV_FILEWATCH_PATH_MAX];
+				if (!join(path, w.dir, ev->name)) continue;
+				if (ev->mask & IN_ISDIR) {
+					if (w.recursive && (ev->mask & (IN_CREATE | IN_MOVED_TO))) {
+						addsubdir(w.owner, w.dir, ev->name, 1);
+					}
+				} else if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+					note(w.owner, AV_FILE_CREATED, path);
+				} else if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+					note(w.owner, AV_FILE_DELETED, path);
+				} else {
+					note(w.owner, AV_FILE_MODIFIED, path);
+				}
+			}
+		}
+	}
+}
+
+#endif
+
+static int addwatch(int owner, const char * dir, const char * name, int recursive) {
+	int i = 0;
+	while (i < nwatches && watches[i].owner >= 0) i++;
+	if (i == WATCHES_MAX) {
+		printf("too many file watches\n");
+		return -1;
+	}
+	if (i == nwatches) nwatches++;
+	av_Watch& w = watches[i];
+	w.owner = owner;
+	w.recursive = recursive;
+	w.wd = -1;
+	AV_SNPRINTF(w.dir, AV_FILEWATCH_PATH_MAX, "%s", dir);
+	AV_SNPRINTF(w.name, AV_FILEWATCH_PATH_MAX, "%s", name);
+	#ifdef AV_FILEWATCH_INOTIFY
+	if (fd >= 0) {
+		// (watching the directory, even for a single file, survives saves by rename)
+		w.wd = inotify_add_watch(fd, dir[0] ? dir : ".",
+			IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB);
+		if (w.wd < 0) {
+			printf("failed to watch %s: %s\n", dir[0] ? dir : ".", strerror(errno));
+			w.owner = -1;
+			return -1;
+		}
+		if (recursive) listdir(owner, w.dir, addsubdir, 0);
+		return i;
+	}
+	#endif
+	scanwatch(w, 0);
+	return i;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// API
+////////////////////////////////////////////////////////////////////////////////
+
+int av_filewatch_add(const char * path, int recursive) {
+	init();
+	char dir[AV_FILEWATCH_PATH_MAX], name[AV_FILEWATCH_PATH_MAX];
+	size_t len = strlen(path);
+	if (len + 2 > AV_FILEWATCH_PATH_MAX) return -1;
+	if (len && isdir(path)) {
+		AV_SNPRINTF(dir, AV_FILEWATCH_PATH_MAX, "%s", path);
+		if (path[len-1] != '/' && path[len-1] != '\\') strcat(dir, "/");
+		name[0] = '\0';
+	} else {
+		// a file (which need not exist yet) within its directory:
+		const char * slash = strrchr(path, '/');
+		#ifdef AV_WINDOWS
+		const char * bslash = strrchr(path, '\\');
+		if (bslash > slash) slash = bslash;
+		#endif
+		size_t dirlen = slash ? slash - path + 1 : 0;
+		memcpy(dir, path, dirlen);
+		dir[dirlen] = '\0';
+		AV_SNPRINTF(name, AV_FILEWATCH_PATH_MAX, "%s", path + dirlen);
+		if (!name[0] || !isdir(dir)) return -1;
+		recursive = 0;
+	}
+	int owner = nextid++;
+	if (addwatch(owner, dir, name, recursive) < 0) return -1;
+	return owner;
+}
+
+void av_filewatch_remove(int id) {
+	for (int i = 0; i < nwatches; i++) {
+		av_Watch& w = watches[i];
+		if (w.owner != id) continue;
+		w.owner = -1;
+		#ifdef AV_FILEWATCH_INOTIFY
+		if (w.wd >= 0) {
+			// descriptors are shared by watches on the same directory:
+			int shared = 0;
+			for (int j = 0; j < nwatches; j++) shared |= watches[j].owner >= 0 && watches[j].wd == w.wd;
+			if (!shared) inotify_rm_watch(fd, w.wd);
+		}
+		#endif
+	}
+	for (int i = nentries - 1; i >= 0; i--) {
+		if (entries[i].owner == id) entries[i] = entries[--nentries];
+	}
+	for (int i = npending - 1; i >= 0; i--) {
+		if (pending[i].owner == id) pending[i] = pending[--npending];
+	}
+	for (int i = nlost - 1; i >= 0; i--) {
+		if (lost[i] == id) lost[i] = lost[--nlost];
+	}
+}
+
+int av_filewatch_native() {
+	init();
+	return fd >= 0;
+}
+
+int av_filewatch_poll(av_FileEvent * events, int max) {
+	init();
+	double now = av_monotonic_time();
+	#ifdef AV_FILEWATCH_INOTIFY
+	if (fd >= 0) {
+		readevents();
+	} else
+	#endif
+	if (now >= nextscan) {
+		scan();
+		nextscan = now + RESCAN_PERIOD;
+	}
+
+	int n = 0;
+	// watches that lost track, reported by their root:
+	while (nlost && n < max) {
+		int owner = lost[--nlost];
+		for (int i = 0; i < nwatches; i++) {
+			if (watches[i].owner != owner) continue;
+			av_FileEvent& e = events[n];
+			// (a watch's own path always fits; see av_filewatch_add)
+			if (!join(e.path, watches[i].dir, watches[i].name)) break;
+			e.watch = owner;
+			e.kind = AV_FILE_RESCAN;
+			n++;
+			break;
+		}
+	}
+	// settled changes, oldest first:
+	for (int i = 0; i < npending && n < max; ) {
+		if (now - pending[i].last < SETTLE) {
+			i++;
+			continue;
+		}
+		av_FileEvent& e = events[n++];
+		e.watch = pending[i].owner;
+		e.kind = pending[i].kind;
+		memcpy(e.path, pending[i].path, AV_FILEWATCH_PATH_MAX);
+		memmove(pending + i, pending + i + 1, sizeof(av_WatchPending) * (npending - i - 1));
+		npending--;
+	}
+	return n;
+}
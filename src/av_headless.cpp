@@ -0,0 +1,170 @@
+#include "av.hpp"
+
+#include <stdio.h>
+
+// offscreen rendering without a display server, for batch rendering and benchmarks.
+// an EGL context is created on Mesa's surfaceless platform where available (no X or GPU
+// needed; software GL via llvmpipe), otherwise on the default display, and frames are
+// drawn into a framebuffer object in place of a window.
+
+#ifdef AV_EGL
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <GL/glext.h>
+
+static EGLDisplay display = EGL_NO_DISPLAY;
+static EGLContext context = EGL_NO_CONTEXT;
+static EGLSurface surface = EGL_NO_SURFACE;
+
+static GLuint fbo = 0, color = 0, depth = 0;
+
+// (framebuffer objects are not in the GL 1.x headers/libraries):
+static PFNGLGENFRAMEBUFFERSPROC genframebuffers;
+static PFNGLBINDFRAMEBUFFERPROC bindframebuffer;
+static PFNGLDELETEFRAMEBUFFERSPROC deleteframebuffers;
+static PFNGLFRAMEBUFFERRENDERBUFFERPROC framebufferrenderbuffer;
+static PFNGLCHECKFRAMEBUFFERSTATUSPROC checkframebufferstatus;
+static PFNGLGENRENDERBUFFERSPROC genrenderbuffers;
+static PFNGLBINDRENDERBUFFERPROC bindrenderbuffer;
+static PFNGLDELETERENDERBUFFERSPROC deleterenderbuffers;
+static PFNGLRENDERBUFFERSTORAGEPROC renderbufferstorage;
+
+static EGLDisplay getdisplay() {
+	#ifdef EGL_PLATFORM_SURFACELESS_MESA
+	PFNEGLGETPLATFORMDISPLAYEXTPROC getplatformdisplay =
+		(PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+	if (getplatformdisplay) {
+		EGLDisplay d = getplatformdisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, 0);
+		if (d != EGL_NO_DISPLAY && eglInitialize(d, 0, 0)) return d;
+	}
+	#endif
+	EGLDisplay d = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+	if (d != EGL_NO_DISPLAY && eglInitialize(d, 0, 0)) return d;
+	return EGL_NO_DISPLAY;
+}
+
+int av_headless_create(int width, int height) {
+	display = getdisplay();
+	if (display == EGL_NO_DISPLAY) {
+		printf("headless: no EGL display\n");
+		return 0;
+	}
+	// any surface type will do, since drawing goes to the FBO:
+	const EGLint attribs[] = {
+		EGL_SURFACE_TYPE, 0,
+		EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+		EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8, EGL_ALPHA_SIZE, 8,
+		EGL_NONE
+	};
+	EGLConfig config;
+	EGLint count = 0;
+	if (!eglChooseConfig(display, attribs, &config, 1, &count) || count < 1) {
+		printf("headless: no EGL config for desktop GL\n");
+		av_headless_destroy();
+		return 0;
+	}
+	// desktop GL (compatibility), since scripts use the fixed-function pipeline:
+	eglBindAPI(EGL_OPENGL_API);
+	context = eglCreateContext(display, config, EGL_NO_CONTEXT, 0);
+	if (context == EGL_NO_CONTEXT) {
+		printf("headless: failed to create EGL context (0x%x)\n", eglGetError());
+		av_headless_destroy();
+		return 0;
+	}
+	// a token pbuffer if the config has them, else no surface at all (EGL_KHR_surfaceless_context):
+	EGLint types = 0;
+	eglGetConfigAttrib(display, config, EGL_SURFACE_TYPE, &types);
+	if (types & EGL_PBUFFER_BIT) {
+		const EGLint pbattribs[] = { EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE };
+		surface = eglCreatePbufferSurface(display, config, pbattribs);
+	}
+	if (!eglMakeCurrent(display, surface, surface, context)) {
+		printf("headless: failed to make EGL context current (0x%x)\n", eglGetError());
+		av_headless_destroy();
+		return 0;
+	}
+
+	genframebuffers = (PFNGLGENFRAMEBUFFERSPROC)eglGetProcAddress("glGenFramebuffers");
+	bindframebuffer = (PFNGLBINDFRAMEBUFFERPROC)eglGetProcAddress("glBindFramebuffer");
+	deleteframebuffers = (PFNGLDELETEFRAMEBUFFERSPROC)eglGetProcAddress("glDeleteFramebuffers");
+	framebufferrenderbuffer = (PFNGLFRAMEBUFFERRENDERBUFFERPROC)eglGetProcAddress("glFramebufferRenderbuffer");
+	checkframebufferstatus = (PFNGLCHECKFRAMEBUFFERSTATUSPROC)eglGetProcAddress("glCheckFramebufferStatus");
+	genrenderbuffers = (PFNGLGENRENDERBUFFERSPROC)eglGetProcAddress("glGenRenderbuffers");
+	bindrenderbuffer = (PFNGLBINDRENDERBUFFERPROC)eglGetProcAddress("glBindRenderbuffer");
+	deleterenderbuffers = (PFNGLDELETERENDERBUFFERSPROC)eglGetProcAddress("glDeleteRenderbuffers");
+	renderbufferstorage = (PFNGLRENDERBUFFERSTORAGEPROC)eglGetProcAddress("glRenderbufferStorage");
+	if (!genframebuffers || !bindframebuffer || !framebufferrenderbuffer || !genrenderbuffers || !renderbufferstorage) {
+		printf("headless: framebuffer objects not supported\n");
+		av_headless_destroy();
+		return 0;
+	}
+
+	genframebuffers(1, &fbo);
+	genrenderbuffers(1, &color);
+	genrenderbuffers(1, &depth);
+	if (!av_headless_resize(width, height)) {
+		av_headless_destroy();
+		return 0;
+	}
+	printf("headless: %s (%s), %dx%d\n", glGetString(GL_RENDERER), glGetString(GL_VERSION), width, height);
+	return 1;
+}
+
+int av_headless_resize(int width, int height) {
+	bindrenderbuffer(GL_RENDERBUFFER, color);
+	renderbufferstorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+	bindrenderbuffer(GL_RENDERBUFFER, depth);
+	renderbufferstorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+	bindrenderbuffer(GL_RENDERBUFFER, 0);
+
+	bindframebuffer(GL_FRAMEBUFFER, fbo);
+	framebufferrenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, color);
+	framebufferrenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depth);
+	GLenum status = checkframebufferstatus(GL_FRAMEBUFFER);
+	if (status != GL_FRAMEBUFFER_COMPLETE) {
+		printf("headless: framebuffer incomplete (0x%x)\n", status);
+		return 0;
+	}
+	// without a window, reads come from the FBO as well:
+	glDrawBuffer(GL_COLOR_ATTACHMENT0);
+	glReadBuffer(GL_COLOR_ATTACHMENT0);
+	glViewport(0, 0, width, height);
+	return 1;
+}
+
+unsigned int av_headless_framebuffer() {
+	return fbo;
+}
+
+void av_headless_destroy() {
+	if (context != EGL_NO_CONTEXT) {
+		if (fbo) deleteframebuffers(1, &fbo);
+		if (color) deleterenderbuffers(1, &color);
+		if (depth) deleterenderbuffers(1, &depth);
+		fbo = color = depth = 0;
+		eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+		eglDestroyContext(display, context);
+		context = EGL_NO_CONTEXT;
+	}
+	if (surface != EGL_NO_SURFACE) {
+		eglDestroySurface(display, surface);
+		surface = EGL_NO_SURFACE;
+	}
+	if (display != EGL_NO_DISPLAY) {
+		eglTerminate(display);
+		display = EGL_NO_DISPLAY;
+	}
+}
+
+#else
+
+int av_headless_create(int width, int height) {
+	printf("headless: not available in this build (requires AV_EGL)\n");
+	return 0;
+}
+int av_headless_resize(int width, int height) { return 0; }
+unsigned int av_headless_framebuffer() { return 0; }
+void av_headless_destroy() {}
+
+#endif
@@ -0,0 +1,125 @@
+#include "av.hpp"
+
+#include <stdio.h>
+
+// the host functions shared by the application (av.cpp) and the audio benchmark
+// (av_audio_bench.cpp): the clock, sleeping, and creating Lua states with the builtin
+// and lpeg modules preloaded.
+
+#ifdef AV_WINDOWS
+	#include < time.h >
+	#if defined(_MSC_VER) || defined(_MSC_EXTENSIONS)
+	  #define DELTA_EPOCH_IN_MICROSECS  11644473600000000Ui64
+	#else
+	  #define DELTA_EPOCH_IN_MICROSECS  11644473600000000ULL
+	#endif
+	 
+	struct timezone 
+	{
+	  int  tz_minuteswest; /* minutes W of Greenwich */
+	  int  tz_dsttime;     /* type of dst correction */
+	};
+	 
+	int gettimeofday(struct timeval *tv, struct timezone *tz)
+	{
+	  FILETIME ft;
+	  unsigned __int64 tmpres = 0;
+	  static int tzflag;
+	 
+	  if (NULL != tv)
+	  {
+		GetSystemTimeAsFileTime(&ft);
+	 
+		tmpres |= ft.dwHighDateTime;
+		tmpres <<= 32;
+		tmpres |= ft.dwLowDateTime;
+	 
+		/*converting file time to unix epoch*/
+		tmpres -= DELTA_EPOCH_IN_MICROSECS; 
+		tmpres /= 10;  /*convert into microseconds*/
+		tv->tv_sec = (long)(tmpres / 1000000UL);
+		tv->tv_usec = (long)(tmpres % 1000000UL);
+	  }
+	 
+	  if (NULL != tz)
+	  {
+		if (!tzflag)
+		{
+		  _tzset();
+		  tzflag++;
+		}
+		tz->tz_minuteswest = _timezone / 60;
+		tz->tz_dsttime = _daylight;
+	  }
+	 
+	  return 0;
+	}
+#endif
+
+double av_time() {
+		timeval t;
+		gettimeofday(&t, NULL);
+		return (double)t.tv_sec + (((double)t.tv_usec) * 1.0e-6);
+}	
+
+void av_sleep(double seconds) {
+	#ifdef AV_WINDOWS
+		Sleep((DWORD)(seconds * 1.0e3));
+	#else
+		time_t sec = (time_t)seconds;
+		long long int nsec = 1.0e9 * (seconds - (double)sec);
+		timespec tspec = { sec, nsec };
+		while (nanosleep(&tspec, &tspec) == -1) {
+			continue;
+		}
+	#endif
+}
+
+#include "av_ffi_header.cpp"
+
+int luaopen_builtin(lua_State * L) {
+
+	static struct luaL_reg lib[] = {
+		// { "name", func },
+		{ NULL, NULL },
+	};
+	luaL_register(L, "builtin", lib);
+	
+	if (luaL_loadstring(L, av_ffi_header)) {	
+		printf("error loading ffi header %s\n", lua_tostring(L, -1));
+	}
+	if (lua_pcall(L, 0, 1, 0)) {
+		printf("error loading ffi header %s\n", lua_tostring(L, -1));
+	}
+	lua_setfield(L, -2, "header");
+	
+	return 1;
+}
+
+lua_State * av_init_lua() {
+	return av_init_lua_alloc(0, 0);
+}
+
+lua_State * av_init_lua_alloc(lua_Alloc alloc, void * ud) {
+	// LuaJIT on x64 refuses custom allocators, in which case this returns NULL:
+	lua_State * L = alloc ? lua_newstate(alloc, ud) : lua_open();
+	if (!L) return 0;
+	luaL_openlibs(L);
+
+	lua_getglobal(L, "package");
+	lua_getfield(L, -1, "preload");
+		lua_pushcfunction(L, luaopen_builtin);
+		lua_setfield(L, -2, "builtin");
+		lua_pushcfunction(L, luaopen_lpeg);
+		lua_setfield(L, -2, "lpeg");
+	lua_pop(L, 2);
+	
+	lua_getglobal(L, "debug");
+	lua_pushliteral(L, "traceback");
+	lua_gettable(L, -2);
+	lua_setfield(L, LUA_REGISTRYINDEX, "debug.traceback");
+	
+	luaL_dostring(L, "package.path = './modules/?.lua;./modules/?/init.lua;'..package.path");
+	lua_settop(L, 0); // clean stack
+	return L;
+}
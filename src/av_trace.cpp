@@ -0,0 +1,206 @@
+#include "av.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// scoped timers, for seeing where a frame (or an audio block) went.
+// each thread that records claims a ring of completed spans (start & duration, monotonic)
+// from a pool allocated when tracing is enabled, so that recording never allocates or locks,
+// and the audio thread can take part. rings overwrite their oldest spans; the main thread
+// exports whatever they hold as Chrome trace-event JSON (chrome://tracing, or Perfetto).
+
+#define TRACE_THREADS_MAX 16
+#define TRACE_SPANS 32768		// per thread (a power of two)
+#define TRACE_DEPTH 64			// nesting, per thread
+#define TRACE_NAMES_MAX 1024
+
+struct av_TraceSpan {
+	double start, duration;
+	const char * name;
+};
+
+struct av_TraceRing {
+	av_TraceSpan * spans;
+	const char * thread;
+	volatile long written;	// spans ever written (published with release)
+	long cleared;			// spans before this are not exported (main thread)
+	volatile long retired;	// its thread has finished, and a successor of the same name may take it
+
+	// open scopes (this thread only):
+	double starts[TRACE_DEPTH];
+	const char * names[TRACE_DEPTH];
+	int depth;
+};
+
+static av_TraceRing rings[TRACE_THREADS_MAX];
+static volatile long nrings = 0;
+static volatile long enabled = 0;
+static double epoch = 0;
+
+// the calling thread's ring, and its name if given before it claimed one:
+static AV_THREAD_LOCAL av_TraceRing * local = 0;
+static AV_THREAD_LOCAL const char * localname = 0;
+
+// interned names, for callers whose strings do not persist (e.g. Lua):
+static char * names[TRACE_NAMES_MAX];
+static int nnames = 0;
+
+static av_TraceRing * claim() {
+	// a ring left by a finished thread of the same name (e.g. before the audio stream reopened):
+	if (localname) {
+		long n = av_atomic_load(&nrings);
+		if (n > TRACE_THREADS_MAX) n = TRACE_THREADS_MAX;
+		for (long i = 0; i < n; i++) {
+			av_TraceRing * r = &rings[i];
+			if (r->retired && r->thread && strcmp(r->thread, localname) == 0 && av_atomic_cas(&r->retired, 1, 0)) {
+				r->depth = 0;
+				return r;
+			}
+		}
+	}
+	long i = av_atomic_add(&nrings, 1) - 1;
+	if (i >= TRACE_THREADS_MAX) {
+		// (nrings stays past the end, so later threads give up here too)
+		return 0;
+	}
+	av_TraceRing * r = &rings[i];
+	r->thread = localname;
+	r->depth = 0;
+	return r;
+}
+
+void av_trace_enable(int enable) {
+	if (enable && !rings[0].spans) {
+		for (int i = 0; i < TRACE_THREADS_MAX; i++) {
+			rings[i].spans = (av_TraceSpan *)malloc(sizeof(av_TraceSpan) * TRACE_SPANS);
+		}
+		epoch = av_monotonic_time();
+	}
+	av_atomic_store(&enabled, enable ? 1 : 0);
+}
+
+int av_trace_enabled() {
+	return (int)av_atomic_load(&enabled);
+}
+
+void av_trace_thread(const char * name) {
+	localname = name;
+	if (local) local->thread = name;
+}
+
+const char * av_trace_intern(const char * name) {
+	for (int i = 0; i < nnames; i++) {
+		if (strcmp(names[i], name) == 0) return names[i];
+	}
+	if (nnames == TRACE_NAMES_MAX) return "(too many trace names)";
+	size_t len = strlen(name);
+	char * s = (char *)malloc(len + 1);
+	memcpy(s, name, len + 1);
+	names[nnames++] = s;
+	return s;
+}
+
+void av_trace_begin(const char * name) {
+	if (!av_atomic_load_acquire(&enabled)) return;
+	av_TraceRing * r = local;
+	if (!r) {
+		r = local = claim();
+		if (!r) return;
+	}
+	if (r->depth < TRACE_DEPTH) {
+		r->starts[r->depth] = av_monotonic_time();
+		r->names[r->depth] = name;
+	}
+	r->depth++;
+}
+
+void av_trace_end() {
+	av_TraceRing * r = local;
+	// (a scope that began before tracing was enabled has nothing to end)
+	if (!r || r->depth == 0) return;
+	r->depth--;
+	if (r->depth >= TRACE_DEPTH) return;
+	double now = av_monotonic_time();
+	long w = r->written;
+	av_TraceSpan& s = r->spans[w & (TRACE_SPANS - 1)];
+	s.start = r->starts[r->depth];
+	s.duration = now - s.start;
+	s.name = r->names[r->depth];
+	av_atomic_store_release(&r->written, w + 1);
+}
+
+void av_trace_retire(const char * name) {
+	long n = av_atomic_load(&nrings);
+	if (n > TRACE_THREADS_MAX) n = TRACE_THREADS_MAX;
+	for (long i = 0; i < n; i++) {
+		if (rings[i].thread && strcmp(rings[i].thread, name) == 0) av_atomic_store(&rings[i].retired, 1);
+	}
+}
+
+void av_trace_clear() {
+	long n = av_atomic_load(&nrings);
+	if (n > TRACE_THREADS_MAX) n = TRACE_THREADS_MAX;
+	for (long i = 0; i < n; i++) rings[i].cleared = av_atomic_load_acquire(&rings[i].written);
+}
+
+static void writestring(FILE * f, const char * s) {
+	fputc('"', f);
+	for (; *s; s++) {
+		unsigned char c = (unsigned char)*s;
+		if (c == '"' || c == '\\') {
+			fputc('\\', f);
+			fputc(c, f);
+		} else if (c < 0x20) {
+			fprintf(f, "\\u%04x", c);
+		} else {
+			fputc(c, f);
+		}
+	}
+	fputc('"', f);
+}
+
+int av_trace_write(const char * path) {
+	FILE * f = fopen(path, "w");
+	if (!f) {
+		printf("failed to open %s for the trace\n", path);
+		return -1;
+	}
+	av_TraceSpan * copy = (av_TraceSpan *)malloc(sizeof(av_TraceSpan) * TRACE_SPANS);
+	long n = av_atomic_load(&nrings);
+	if (n > TRACE_THREADS_MAX) n = TRACE_THREADS_MAX;
+	int count = 0;
+	fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	for (long i = 0; i < n; i++) {
+		av_TraceRing& r = rings[i];
+		if (count) fprintf(f, ",\n");
+		fprintf(f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%ld,\"args\":{\"name\":", i);
+		writestring(f, r.thread ? r.thread : "thread");
+		fprintf(f, "}}");
+		count++;
+
+		// copy what the ring holds, then drop whatever the writer may have overwritten meanwhile:
+		long end = av_atomic_load_acquire(&r.written);
+		long begin = end - TRACE_SPANS;
+		if (begin < r.cleared) begin = r.cleared;
+		if (begin < 0) begin = 0;
+		for (long k = begin; k < end; k++) copy[k & (TRACE_SPANS - 1)] = r.spans[k & (TRACE_SPANS - 1)];
+		av_atomic_fence();
+		// (including the slot of the span being written now)
+		long after = av_atomic_load_acquire(&r.written);
+		if (begin <= after - TRACE_SPANS) begin = after - TRACE_SPANS + 1;
+
+		for (long k = begin; k < end; k++) {
+			const av_TraceSpan& s = copy[k & (TRACE_SPANS - 1)];
+			fprintf(f, ",\n{\"name\":");
+			writestring(f, s.name);
+			fprintf(f, ",\"ph\":\"X\",\"pid\":1,\"tid\":%ld,\"ts\":%.3f,\"dur\":%.3f}",
+				i, (s.start - epoch) * 1e6, s.duration * 1e6);
+			count++;
+		}
+	}
+	fprintf(f, "\n]}\n");
+	fclose(f);
+	free(copy);
+	return count;
+}
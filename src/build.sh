@@ -16,6 +16,24 @@ rm -f lpeg-0.11/*.o
 rm -f *.o
 rm -f *.d
 
+AUDIO_SOURCES="av_audio.cpp av_audio_alloc.cpp av_audio_workers.cpp av_audio_ambi.cpp av_audio_stream.cpp av_audio_ugen.cpp av_audio_fft.cpp av_audio_analysis.cpp av_audio_convolve.cpp av_audio_record.cpp av_audio_ramp.cpp av_audio_resample.cpp av_trace.cpp"
+
+if [[ $1 == 'bench' ]]; then
+
+	# ./build.sh bench: the audio engine alone, over RtAudio's dummy (null) API
+	# (with no API defined, RtAudio.h selects the dummy itself)
+	# run from the repository root: src/av_audio_bench voices=... (see av_audio_bench.cpp)
+	PRODUCT_NAME="av_audio_bench"
+	rm -f $PRODUCT_NAME
+	if [[ $PLATFORM == 'Darwin' ]]; then
+		clang++ -O3 -Wall -Iosx/include -Iinclude -Irtaudio-4.0.11 -Ilpeg-0.11 av_audio_bench.cpp av_host.cpp $AUDIO_SOURCES rtaudio-4.0.11/RtAudio.cpp -x c lpeg-0.11/*.c -x none -pagezero_size 10000 -image_base 100000000 osx/lib/libluajit.a -o $PRODUCT_NAME
+	else
+		g++ -O3 -Wall -ffast-math -Wno-unknown-pragmas -D_GNU_SOURCE -Ilinux/include -I/usr/local/include/luajit-2.0 -I/usr/include/luajit-2.0 -Irtaudio-4.0.11 -Ilpeg-0.11 -Iinclude av_audio_bench.cpp av_host.cpp $AUDIO_SOURCES rtaudio-4.0.11/RtAudio.cpp -x c lpeg-0.11/*.c -x none -rdynamic -L/usr/local/lib -lluajit-5.1 -ldl -lrt -lpthread -o $PRODUCT_NAME
+	fi
+	exit
+
+fi
+
 if [[ $PLATFORM == 'Darwin' ]]; then
 
 	PRODUCT_NAME="av_osx"
@@ -29,7 +47,7 @@ if [[ $PLATFORM == 'Darwin' ]]; then
 	CFLAGS="-fno-stack-protector -O3 -Wall -fPIC"
 	DEFINES="-DEV_MULTIPLICITY=1 -DHAVE_GETTIMEOFDAY -D__MACOSX_CORE__"
 	INCLUDEPATHS="-Iosx/include -Iinclude -Irtaudio-4.0.11 -Ilpeg-0.11"
-	SOURCES="-x c++ av.cpp av_audio.cpp rtaudio-4.0.11/RtAudio.cpp -x c lpeg-0.11/*.c" # http-parser/*.c" # hidapi/mac/hid.c"
+	SOURCES="-x c++ av.cpp av_host.cpp av_filewatch.cpp av_headless.cpp $AUDIO_SOURCES rtaudio-4.0.11/RtAudio.cpp -x c lpeg-0.11/*.c" # http-parser/*.c" # hidapi/mac/hid.c"
 	# bullet.cpp
 	
 	LINK='clang++'
@@ -72,15 +90,15 @@ elif [[ $PLATFORM == 'Linux' ]]; then
 	
 	CC='g++'
 	CFLAGS="-O3 -Wall -fPIC -ffast-math -Wno-unknown-pragmas -MMD"
-	DEFINES="-D_GNU_SOURCE -DEV_MULTIPLICITY=1 -DHAVE_GETTIMEOFDAY -D__LINUX_ALSA__"
+	DEFINES="-D_GNU_SOURCE -DEV_MULTIPLICITY=1 -DHAVE_GETTIMEOFDAY -D__LINUX_ALSA__ -DAV_EGL"
 	INCLUDEPATHS="-Ilinux/include -I/usr/local/include/luajit-2.0 -I/usr/include/luajit-2.0 -Irtaudio-4.0.11 -Ilpeg-0.11 -Iinclude"
-	SOURCES="av.cpp av_audio.cpp rtaudio-4.0.11/RtAudio.cpp"
+	SOURCES="av.cpp av_host.cpp av_filewatch.cpp av_headless.cpp $AUDIO_SOURCES rtaudio-4.0.11/RtAudio.cpp"
 	
 	LINK=$CC
 	LDFLAGS="-w -rdynamic -Wl,-E "
 	LINKERPATHS="-L/usr/lib/nvidia-current/ -L/usr/local/lib -L/usr/lib"
 	#LIBRARIES="-lluajit-5.1 -lfreeimage -lGLEW -lGLU -lGL -lglut -lasound ../externs/libuv/libuv.a -lrt -lpthread"
-	LIBRARIES="-lluajit-5.1 -lGLU -lGL -lglut -lasound -lrt -lpthread" # linux/lib64/libfreenect.a -lusb-1.0"
+	LIBRARIES="-lluajit-5.1 -lGLU -lGL -lEGL -lglut -lasound -lrt -lpthread" # linux/lib64/libfreenect.a -lusb-1.0"
 	
 	echo compile
 	$CC -c $CFLAGS $DEFINES $INCLUDEPATHS $SOURCES
@@ -34,23 +34,45 @@ local lua = require "lua"
 -- a bit of helpful info:
 print(string.format("Using %s on %s (%s)", jit.version, jit.os, jit.arch))
 
-local watched = {}
+local watched = {}	-- filename -> watch id
+local unstarted = {}
 local states = {}
 
+-- changes arrive in batches, once per frame (see av_filewatch.cpp):
+local maxevents = 64
+local events = ffi.new("av_FileEvent[?]", maxevents)
+local moduleswatch = C.av_filewatch_add(exepath .. "/modules", 1)
+
 function av_tick()
+	for filename in pairs(unstarted) do
+		unstarted[filename] = nil
+		spawn(filename)
+	end
+	
 	-- filewatch:
-	for filename, mtime in pairs(watched) do
-		local t = C.av_filetime(filename)
-		if t > mtime then
-			watched[filename] = t
-			spawn(filename)
+	local reload = {}
+	repeat
+		local n = C.av_filewatch_poll(events, maxevents)
+		for i = 0, n-1 do
+			local e = events[i]
+			if e.watch == moduleswatch then
+				-- a module changed; restart everything that might use it:
+				for filename in pairs(watched) do reload[filename] = true end
+			elseif e.kind ~= C.AV_FILE_DELETED then
+				-- (file watches report the filename as given)
+				local filename = ffi.string(e.path)
+				if watched[filename] then reload[filename] = true end
+			end
 		end
+	until n < maxevents
+	for filename in pairs(reload) do
+		spawn(filename)
 	end
 end
 
 -- force reload all scripts:
 function av_reload()
-	for filename, mtime in pairs(watched) do
+	for filename in pairs(watched) do
 		spawn(filename)
 	end
 end
@@ -118,7 +140,10 @@ function spawn(filename)
 end
 
 function watch(filename)
-	watched[filename] = 0
+	if not watched[filename] then
+		watched[filename] = C.av_filewatch_add(filename, 0)
+		unstarted[filename] = true
+	end
 end
 
 watch(filename)
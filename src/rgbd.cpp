@@ -133,6 +133,7 @@ void av_rgbd_transform_rawpoints(av_RGBDSensor& sensor) {
 
 void depth_cb(freenect_device *dev, void *v_depth, uint32_t timestamp) {
 	av_RGBDSensor& sensor = *(av_RGBDSensor *)freenect_get_user(dev);	
+	av_TraceScope scope("rgbd depth");
 	uint16_t *depth = (uint16_t*)v_depth;
 	
 //	float ymin = 0;
@@ -254,6 +255,7 @@ void rgb_cb(freenect_device *dev, void *rgb, uint32_t timestamp) {
 }
 
 void *freenect_threadfunc(void *arg) {
+	av_trace_thread("rgbd");
 	
 	printf("RGBD starting with %d devices\n", rgbd.numdevices);
 	
@@ -275,7 +277,9 @@ void *freenect_threadfunc(void *arg) {
 	}
 	
 	while (!die) {
+		av_trace_begin("rgbd events");
 		int res = freenect_process_events(f_ctx);
+		av_trace_end();
 		if (res < 0 && res != -10) {
 			printf("\nError %d received from libusb - aborting.\n",res);
 			break;